@@ -0,0 +1,283 @@
+/*
+	synthetic load benchmark for the whole recording pipeline
+	feeds generated test patterns through SampleFrame() in offline mode for each codec/preset/CRF/format/resolution combination
+	and prints one JSON object per combination to stdout (JSON Lines) for regression tracking, progress goes to stderr
+
+	usage: Benchmark [--frames N] [--resolution WxH,...] [--codec h264,h265] [--preset name,...] [--crf N,...] [--format bgra,r10g10b10a2] [--out dir]
+	peak RSS is process wide => several selected combinations are run one per child process (same executable with single value options)
+	VIDEO_RECORDER_SIMD=scalar|sse2|avx2|avx512 env var forces kernel variant for A/B comparison, selected one is reported as "simd"
+
+	Benchmark conversion ... runs color conversion microbenchmarks instead (see ConversionBenchmark.cpp)
+	Benchmark quality ... runs quality vs speed regression harness (see QualityBenchmark.cpp)
+	Benchmark startup ... measures recorder construction and first session cost (see StartupBenchmark.cpp)
+	Benchmark dispatch ... measures worker task queue handoff cost of inline variant ring against virtual heap tasks (see DispatchBenchmark.cpp)
+*/
+
+#include <cstdlib>
+#include <cstdint>
+#include <cwchar>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <exception>
+#ifdef _WIN32
+#	define NOMINMAX
+#	define WIN32_LEAN_AND_MEAN
+#	include <Windows.h>
+#	include <Psapi.h>
+#else
+#	include <locale>
+#	include <codecvt>
+#	include <sys/resource.h>
+#endif
+#include "VideoRecorder.h"
+#include "Common.h"
+
+using namespace std;
+typedef CVideoRecorder::CFrame::FrameData FrameData;
+
+namespace
+{
+	constexpr unsigned int patternCount = 8;	// frames cycled through to keep encoder busy with motion
+
+	const char *const stageNames[CVideoRecorder::stageCount] = { "queue_wait", "get_frame_data", "convert", "scale", "encode", "mux" };
+	const char *const simdLevelNames[CVideoRecorder::simdLevelCount] = { "scalar", "sse2", "avx2", "avx512" };
+
+	struct Config
+	{
+		Named<CVideoRecorder::Codec> codec;
+		Named<CVideoRecorder::Preset> preset;
+		int64_t crf;
+		Named<FrameData::Format> format;
+		Resolution resolution;
+	};
+
+#ifdef _WIN32
+	uint_least64_t CPUTime100ns()
+	{
+		FILETIME creation, exit, kernel, user;
+		if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+			return 0;
+		const auto ToUInt64 = [](const FILETIME &time) { return uint_least64_t(time.dwHighDateTime) << 32 | time.dwLowDateTime; };
+		return ToUInt64(kernel) + ToUInt64(user);
+	}
+
+	size_t PeakRSS()
+	{
+		PROCESS_MEMORY_COUNTERS counters;
+		return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof counters) ? counters.PeakWorkingSetSize : 0;
+	}
+#else
+	uint_least64_t CPUTime100ns()
+	{
+		rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage))
+			return 0;
+		const auto ToUInt64 = [](const timeval &time) { return uint_least64_t(time.tv_sec) * 10'000'000 + time.tv_usec * 10; };
+		return ToUInt64(usage.ru_stime) + ToUInt64(usage.ru_utime);
+	}
+
+	size_t PeakRSS()
+	{
+		rusage usage;
+		return getrusage(RUSAGE_SELF, &usage) ? 0 : size_t(usage.ru_maxrss) * 1024;	// KiB on Linux
+	}
+#endif
+
+	void Run(const Config &config, unsigned int frameCount, const wstring &outDir)
+	{
+		vector<CPattern> patterns;
+		patterns.reserve(patternCount);
+		for (unsigned int phase = 0; phase < patternCount; phase++)
+			patterns.emplace_back(config.format.value, config.resolution.width, config.resolution.height, phase);
+
+		const wstring filename = TempFilename(outDir, L"benchmark_");
+		const auto format = config.format.value == FrameData::Format::R10G10B10A2 ? CVideoRecorder::Format::_10bit : CVideoRecorder::Format::_8bit;
+
+		// pool outlives recorder
+		static CVideoRecorder::CFramePool<CSyntheticFrame, CVideoRecorder::maxFramesInFlight> pool;
+		CVideoRecorder::Stats stats;
+
+		const auto cpuStart = CPUTime100ns();
+		const auto wallStart = chrono::steady_clock::now();
+		{
+			CVideoRecorder recorder;
+			recorder.SetOfflineMode(true);
+			recorder.StartRecord(filename, config.resolution.width, config.resolution.height, format, CVideoRecorder::FPS::_60, config.codec.value, config.crf, config.preset.value);
+			for (unsigned int i = 0; i < frameCount; i++)
+				recorder.SampleFrame([&](CVideoRecorder::CFrame::Opaque opaque)
+				{
+					auto frame = pool.Acquire(move(opaque), patterns[i % patternCount].GetFrameData());
+					if (frame)
+						frame->Ready();
+					return frame;
+				});
+			recorder.StopRecord();
+
+			// latencies survive till next StartRecord() => grab them after queue drains, recorder dtor then waits for flush
+			while ((stats = recorder.GetStats()).queueDepth)
+				this_thread::sleep_for(chrono::milliseconds(1));
+		}
+		const chrono::duration<double> wallTime = chrono::steady_clock::now() - wallStart;
+		const double cpuTime = (CPUTime100ns() - cpuStart) * 1e-7;
+
+		const auto fileSize = FileSize(filename);
+		RemoveFile(filename);
+
+		const auto Microseconds = [](chrono::nanoseconds time) { return chrono::duration<double, micro>(time).count(); };
+		cout << fixed << setprecision(3)
+			<< "{\"codec\":\"" << config.codec.name
+			<< "\",\"preset\":\"" << config.preset.name
+			<< "\",\"crf\":" << config.crf
+			<< ",\"format\":\"" << config.format.name
+			<< "\",\"simd\":\"" << simdLevelNames[(unsigned int)stats.simdLevel]
+			<< "\",\"width\":" << config.resolution.width
+			<< ",\"height\":" << config.resolution.height
+			<< ",\"frames_sampled\":" << stats.framesSampled
+			<< ",\"frames_encoded\":" << stats.framesEncoded
+			<< ",\"frames_dropped\":" << stats.framesDropped
+			<< ",\"wall_seconds\":" << wallTime.count()
+			<< ",\"fps\":" << stats.framesEncoded / wallTime.count()
+			<< ",\"cpu_seconds\":" << cpuTime
+			<< ",\"cpu_utilization\":" << cpuTime / wallTime.count() / thread::hardware_concurrency()
+			<< ",\"peak_rss_bytes\":" << PeakRSS()
+			<< ",\"peak_tracked_bytes\":" << stats.memoryTotal.peak
+			<< ",\"file_size\":" << fileSize
+			<< ",\"stages\":{";
+		for (unsigned int stage = 0; stage < CVideoRecorder::stageCount; stage++)
+		{
+			const auto &stageStats = stats.stages[stage];
+			cout << (stage ? ",\"" : "\"") << stageNames[stage]
+				<< "\":{\"count\":" << stageStats.count
+				<< ",\"p50_us\":" << Microseconds(stageStats.p50)
+				<< ",\"p99_us\":" << Microseconds(stageStats.p99)
+				<< ",\"max_us\":" << Microseconds(stageStats.max) << '}';
+		}
+		cout << "}}" << endl;
+	}
+
+	// returns child exit code, child prints its JSON line to inherited stdout
+	int RunChild(const wchar_t exe[], const Config &config, unsigned int frameCount, const wstring &outDir)
+	{
+		wostringstream command;
+		command << L'"' << exe << L"\" --frames " << frameCount
+			<< L" --codec " << config.codec.name
+			<< L" --preset " << config.preset.name
+			<< L" --crf " << config.crf
+			<< L" --format " << config.format.name
+			<< L" --resolution " << config.resolution.width << L'x' << config.resolution.height
+			<< L" --out \"" << outDir << L'"';
+		cout.flush();	// keep JSON lines ordered
+#ifdef _WIN32
+		return _wsystem((L'"' + command.str() + L'"').c_str());	// cmd /c strips outer quotes if command contains more of them
+#else
+		return system(wstring_convert<codecvt_utf8<wchar_t>>().to_bytes(command.str()).c_str());
+#endif
+	}
+}
+
+int ConversionBenchmark(int argc, wchar_t *argv[]), QualityBenchmark(int argc, wchar_t *argv[]), StartupBenchmark(int argc, wchar_t *argv[]), DispatchBenchmark(int argc, wchar_t *argv[]);
+
+int wmain(int argc, wchar_t *argv[])
+{
+	if (argc > 1 && wcscmp(argv[1], L"conversion") == 0)
+		return ConversionBenchmark(argc - 1, argv + 1);
+	if (argc > 1 && wcscmp(argv[1], L"quality") == 0)
+		return QualityBenchmark(argc - 1, argv + 1);
+	if (argc > 1 && wcscmp(argv[1], L"startup") == 0)
+		return StartupBenchmark(argc - 1, argv + 1);
+	if (argc > 1 && wcscmp(argv[1], L"dispatch") == 0)
+		return DispatchBenchmark(argc - 1, argv + 1);
+
+	unsigned int frameCount = 600;
+	vector<Resolution> resolutions{ { 1280, 720 }, { 1920, 1080 } };
+	vector<Named<CVideoRecorder::Codec>> selectedCodecs{ codecs[0] };
+	vector<Named<CVideoRecorder::Preset>> selectedPresets;
+	ParseNamed(L"ultrafast,veryfast,medium", presets, selectedPresets);
+	vector<int64_t> crfs{ 23 };
+	vector<Named<FrameData::Format>> selectedFormats(begin(formats), end(formats));
+	wstring outDir = TempDir();
+
+	for (int i = 1; i < argc; i++)
+	{
+		const wstring option = argv[i];
+		const wchar_t *const value = i + 1 < argc ? argv[++i] : nullptr;
+		bool ok = true;
+		if (!value)
+			ok = false;
+		else if (option == L"--frames")
+			ok = (frameCount = wcstoul(value, nullptr, 10)) > 0;
+		else if (option == L"--resolution")
+			ok = ParseResolutions(value, resolutions);
+		else if (option == L"--codec")
+			ok = ParseNamed(value, codecs, selectedCodecs);
+		else if (option == L"--preset")
+			ok = ParseNamed(value, presets, selectedPresets);
+		else if (option == L"--crf")
+		{
+			crfs.clear();
+			for (const auto &item : Split(value))
+				crfs.push_back(wcstoll(item.c_str(), nullptr, 10));
+		}
+		else if (option == L"--format")
+			ok = ParseNamed(value, formats, selectedFormats);
+		else if (option == L"--out")
+			outDir = value;
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			wcerr << L"Usage: " << argv[0] << L" [--frames N] [--resolution WxH,...] [--codec h264,h265] [--preset name,...] [--crf N,...] [--format bgra,r10g10b10a2] [--out dir]" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	const bool isolate = selectedCodecs.size() * selectedPresets.size() * crfs.size() * selectedFormats.size() * resolutions.size() > 1;
+	try
+	{
+		for (const auto &codec : selectedCodecs)
+			for (const auto &preset : selectedPresets)
+				for (const auto crf : crfs)
+					for (const auto &format : selectedFormats)
+						for (const auto &resolution : resolutions)
+						{
+							const Config config{ codec, preset, crf, format, resolution };
+							if (!isolate)
+							{
+								wclog << codec.name << L' ' << preset.name << L" crf " << crf << L' ' << format.name << L' ' << resolution.width << L'x' << resolution.height << L"..." << endl;
+								Run(config, frameCount, outDir);
+							}
+							else if (const int result = RunChild(argv[0], config, frameCount, outDir))
+							{
+								wcerr << L"Benchmark child process failed: " << result << endl;
+								return EXIT_FAILURE;
+							}
+						}
+	}
+	catch (const exception &error)
+	{
+		wcerr << L"Benchmark failed: " << error.what() << endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+#ifndef _WIN32
+int main(int argc, char *argv[])
+{
+	vector<wstring> args;
+	vector<wchar_t *> wargv;
+	for (int i = 0; i < argc; i++)
+		args.push_back(wstring_convert<codecvt_utf8<wchar_t>>().from_bytes(argv[i]));
+	for (auto &arg : args)
+		wargv.push_back(&arg[0]);
+	wargv.push_back(nullptr);
+	return wmain(argc, wargv.data());
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,120 @@
+#include <cwchar>
+#include <filesystem>
+#include <system_error>
+#ifdef _WIN32
+#	define NOMINMAX
+#	define WIN32_LEAN_AND_MEAN
+#	include <Windows.h>
+#else
+#	include <unistd.h>
+#endif
+#include "Common.h"
+
+using namespace std;
+typedef CVideoRecorder::CFrame::FrameData FrameData;
+
+const Named<CVideoRecorder::Codec> codecs[2] =
+{
+	{ CVideoRecorder::Codec::H264, "h264" },
+	{ CVideoRecorder::Codec::H265, "h265" },
+};
+
+const Named<CVideoRecorder::Preset> presets[10] =
+{
+	{ CVideoRecorder::Preset::placebo, "placebo" },
+	{ CVideoRecorder::Preset::veryslow, "veryslow" },
+	{ CVideoRecorder::Preset::slower, "slower" },
+	{ CVideoRecorder::Preset::slow, "slow" },
+	{ CVideoRecorder::Preset::medium, "medium" },
+	{ CVideoRecorder::Preset::fast, "fast" },
+	{ CVideoRecorder::Preset::faster, "faster" },
+	{ CVideoRecorder::Preset::veryfast, "veryfast" },
+	{ CVideoRecorder::Preset::superfast, "superfast" },
+	{ CVideoRecorder::Preset::ultrafast, "ultrafast" },
+};
+
+const Named<FrameData::Format> formats[2] =
+{
+	{ FrameData::Format::B8G8R8A8, "bgra" },
+	{ FrameData::Format::R10G10B10A2, "r10g10b10a2" },
+};
+
+CPattern::CPattern(FrameData::Format format, unsigned int width, unsigned int height, unsigned int phase) :
+	format(format), width(width), height(height), pixels(size_t(width) * height)
+{
+	// triangle rather than sawtooth ramps: wrap edges would make chroma depend on scaler's chroma siting, not on conversion accuracy
+	const auto Ramp = [](unsigned int x) { x %= 2048; return x < 1024 ? x : 2047 - x; };
+	uint_least32_t seed = 0x9E3779B9u * (phase + 1);
+	for (unsigned int y = 0; y < height; y++)
+		for (unsigned int x = 0; x < width; x++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			const unsigned int noise = seed >> 28;
+			const unsigned int r = Ramp(x + phase * 16), g = Ramp(y + phase * 8), b = Ramp(x + y + noise * 4);
+			auto &pixel = pixels[size_t(y) * width + x];
+			switch (format)
+			{
+			case FrameData::Format::B8G8R8A8:
+				pixel = b >> 2 | (g >> 2) << 8 | (r >> 2) << 16 | 0xFFu << 24;
+				break;
+			case FrameData::Format::R10G10B10A2:
+				pixel = r | g << 10 | b << 20 | 3u << 30;
+				break;
+			}
+		}
+}
+
+wstring TempDir()
+{
+	error_code error;
+	return filesystem::temp_directory_path(error).wstring();
+}
+
+wstring TempFilename(const wstring &dir, const wchar_t prefix[], const wchar_t extension[])
+{
+#ifdef _WIN32
+	const unsigned long pid = GetCurrentProcessId();
+#else
+	const unsigned long pid = getpid();
+#endif
+	return (filesystem::path(dir) / (prefix + to_wstring(pid) + extension)).wstring();
+}
+
+uint_least64_t FileSize(const wstring &filename)
+{
+	error_code error;
+	const auto size = filesystem::file_size(filename, error);
+	return error ? 0 : size;
+}
+
+void RemoveFile(const wstring &filename)
+{
+	error_code error;
+	filesystem::remove(filename, error);
+}
+
+vector<wstring> Split(const wchar_t list[])
+{
+	vector<wstring> items;
+	for (const wchar_t *begin = list;; begin++)
+	{
+		const wchar_t *const end = wcschr(begin, L',');
+		items.emplace_back(begin, end ? end : begin + wcslen(begin));
+		if (!end)
+			return items;
+		begin = end;
+	}
+}
+
+bool ParseResolutions(const wchar_t list[], vector<Resolution> &resolutions)
+{
+	resolutions.clear();
+	for (const auto &item : Split(list))
+	{
+		Resolution resolution;
+		if (swscanf(item.c_str(), L"%ux%u", &resolution.width, &resolution.height) != 2 || !resolution.width || !resolution.height)
+			return false;
+		resolutions.push_back(resolution);
+	}
+	return true;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "VideoRecorder.h"
+
+// test frames and command line helpers shared by benchmark modes
+
+struct Resolution
+{
+	unsigned int width, height;
+};
+
+// moving diagonal gradient with low amplitude noise, neither trivially compressible nor pure noise
+class CPattern
+{
+	typedef CVideoRecorder::CFrame::FrameData FrameData;
+
+	const FrameData::Format format;
+	const unsigned int width, height;
+	std::vector<uint32_t> pixels;
+
+public:
+	CPattern(FrameData::Format format, unsigned int width, unsigned int height, unsigned int phase);
+
+public:
+	FrameData GetFrameData() const { return { format, width, height, width * sizeof(uint32_t), pixels.data() }; }
+};
+
+class CSyntheticFrame final : public CVideoRecorder::CFrame
+{
+	const FrameData frameData;
+
+public:
+	CSyntheticFrame(Opaque opaque, const FrameData &frameData) : CFrame(std::move(opaque)), frameData(frameData) {}
+
+public:
+	FrameData GetFrameData() const override { return frameData; }
+};
+
+template<typename Enum>
+struct Named
+{
+	Enum value;
+	const char *name;
+};
+
+extern const Named<CVideoRecorder::Codec> codecs[2];
+extern const Named<CVideoRecorder::Preset> presets[10];
+extern const Named<CVideoRecorder::CFrame::FrameData::Format> formats[2];
+
+std::wstring TempDir();
+std::wstring TempFilename(const std::wstring &dir, const wchar_t prefix[], const wchar_t extension[] = L".mp4");	// unique per process
+uint_least64_t FileSize(const std::wstring &filename);
+void RemoveFile(const std::wstring &filename);
+std::vector<std::wstring> Split(const wchar_t list[]);
+bool ParseResolutions(const wchar_t list[], std::vector<Resolution> &resolutions);
+
+template<typename Enum, size_t count>
+bool ParseNamed(const wchar_t list[], const Named<Enum> (&table)[count], std::vector<Named<Enum>> &result)
+{
+	result.clear();
+	for (const auto &item : Split(list))
+	{
+		const Named<Enum> *found = nullptr;
+		for (const auto &entry : table)
+			if (item == std::wstring(entry.name, entry.name + std::strlen(entry.name)))
+				found = &entry;
+		if (!found)
+		{
+			std::wcerr << L"Unknown value \"" << item << L"\"." << std::endl;
+			return false;
+		}
+		result.push_back(*found);
+	}
+	return true;
+}
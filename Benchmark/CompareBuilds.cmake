@@ -0,0 +1,192 @@
+#[[
+	builds baseline, LTO, PGO and LTO+PGO variants of recorder + Benchmark, runs the same workload on each and reports gains over baseline
+	PGO variants are built instrumented, trained by pgo-train target and rebuilt with profile in the same build tree
+
+	usage: cmake [-DBUILD_ROOT=dir] [-DGENERATOR=name] [-DFRAMES=N] [-DBENCHMARK_ARGS=arg;...] [-DREPEAT=N] [-DPIPELINE=OFF] -P Benchmark/CompareBuilds.cmake
+	prints one line per variant and writes one JSON object per variant to BUILD_ROOT/compare.jsonl
+	pipeline figures are dominated by FFmpeg/x264 which are not rebuilt here, conversion and dispatch figures isolate recorder's own code
+	gains: fps higher is better, CPU seconds, conversion ms per frame and dispatch ns (p50 summed over runs) lower is better, all reported as speedup over baseline
+	each variant is measured REPEAT times (default 3) and best figure of each kind is kept
+	PIPELINE=OFF skips pipeline measurement and pipeline PGO training (no usable encoder or FFmpeg headers on host), profile then covers conversion and dispatch only
+
+	last run (Linux x86-64 AVX-512 VM, 1 core, GCC 12.2, FFmpeg 8.0 shared libs, PIPELINE=OFF, REPEAT=3), compare.jsonl sums plus
+	medians of 3 interleaved reruns for 1080p conversion at AVX2 level and unpaced variant_ring dispatch p50:
+		baseline	conversion 1458.1 ms			dispatch 32881 ns		bgra 149 fps (6.69 ms)	r10g10b10a2 95 fps (10.52 ms)	ring 5531 ns
+		lto			conversion 1620.0 ms (-10.00%)	dispatch 32739 ns (+0.43%)	bgra 149 fps (6.72 ms)	r10g10b10a2 108 fps (9.26 ms)	ring 4974 ns
+		pgo			conversion 1476.3 ms (-1.24%)	dispatch 30950 ns (+6.23%)	bgra 161 fps (6.21 ms)	r10g10b10a2 104 fps (9.65 ms)	ring 5167 ns
+		lto_pgo		conversion 1553.0 ms (-6.12%)	dispatch 33164 ns (-0.86%)	bgra 135 fps (7.42 ms)	r10g10b10a2 104 fps (9.59 ms)	ring 5503 ns
+	reruns of the same binaries spread 10-20% (conversion sums 1827-1938 ms for baseline), so no variant is measurably faster:
+	conversion time is spent in FFmpeg's swscale and in Imaging's intrinsics kernels, dispatch is bound by mutex and wakeup
+	ship baseline (Release, no LTO/PGO): same speed, reproducible builds, no training run in release pipeline
+	pipeline fps were not measured (benchmark was built without FFmpeg headers matching the libs), rerun without PIPELINE=OFF before revisiting the choice
+]]
+cmake_minimum_required(VERSION 3.19)	# string(JSON)
+
+get_filename_component(SOURCE_DIR ${CMAKE_CURRENT_LIST_DIR}/.. ABSOLUTE)
+if(NOT BUILD_ROOT)
+	set(BUILD_ROOT ${SOURCE_DIR}/_variants)
+endif()
+if(NOT FRAMES)
+	set(FRAMES 300)
+endif()
+if(NOT REPEAT)
+	set(REPEAT 3)
+endif()
+if(NOT DEFINED PIPELINE)
+	set(PIPELINE ON)
+endif()
+if(GENERATOR)
+	set(generatorArgs -G ${GENERATOR})
+endif()
+
+function(Run)
+	execute_process(COMMAND ${ARGN} RESULT_VARIABLE result)
+	if(result)
+		list(JOIN ARGN " " command)
+		message(FATAL_ERROR "\"${command}\" failed: ${result}")
+	endif()
+endfunction()
+
+function(Build dir lto pgo)
+	Run(${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${dir} ${generatorArgs} -DCMAKE_BUILD_TYPE=Release -DVIDEO_RECORDER_BUILD_BENCHMARKS=ON -DVIDEO_RECORDER_LTO=${lto} -DVIDEO_RECORDER_PGO=${pgo} -DVIDEO_RECORDER_PGO_TRAIN_PIPELINE=${PIPELINE})
+	Run(${CMAKE_COMMAND} --build ${dir} --config Release --parallel)
+	if(pgo STREQUAL "GENERATE")
+		Run(${CMAKE_COMMAND} --build ${dir} --config Release --target pgo-train)
+	endif()
+endfunction()
+
+# CMake math is integer only => work in thousandths, string(JSON) may strip trailing zeros of Benchmark's 3 decimals
+function(ToMilli value out)
+	if(NOT value MATCHES "^([0-9]+)(\\.([0-9]*))?$")
+		message(FATAL_ERROR "Unexpected number \"${value}\"")
+	endif()
+	set(integer ${CMAKE_MATCH_1})
+	string(SUBSTRING "${CMAKE_MATCH_3}000" 0 3 fraction)
+	string(REGEX REPLACE "^0+([0-9])" "\\1" digits ${integer}${fraction})	# leading zeros would read as octal
+	set(${out} ${digits} PARENT_SCOPE)
+endfunction()
+
+function(FromMilli value out)
+	math(EXPR integer "${value} / 1000")
+	math(EXPR fraction "${value} % 1000 + 1000")
+	string(SUBSTRING ${fraction} 1 3 fraction)
+	set(${out} ${integer}.${fraction} PARENT_SCOPE)
+endfunction()
+
+# ratio - 1 in percent with 2 decimals
+function(Gain numerator denominator out)
+	math(EXPR basisPoints "${numerator} * 10000 / ${denominator} - 10000")
+	set(sign +)
+	if(basisPoints LESS 0)
+		set(sign -)
+		math(EXPR basisPoints "-${basisPoints}")
+	endif()
+	math(EXPR integer "${basisPoints} / 100")
+	math(EXPR fraction "${basisPoints} % 100 + 100")
+	string(SUBSTRING ${fraction} 1 2 fraction)
+	set(${out} ${sign}${integer}.${fraction}% PARENT_SCOPE)
+endfunction()
+
+# sums field over JSON Lines output
+function(Sum output field out)
+	set(sum 0)
+	string(REPLACE "\n" ";" lines "${output}")
+	foreach(line IN LISTS lines)
+		if(line)
+			string(JSON value GET "${line}" ${field})
+			ToMilli(${value} value)
+			math(EXPR sum "${sum} + ${value}")
+		endif()
+	endforeach()
+	set(${out} ${sum} PARENT_SCOPE)
+endfunction()
+
+function(Measure dir prefix)
+	set(benchmark ${dir}/Benchmark)
+	if(EXISTS ${dir}/Release/Benchmark.exe)
+		set(benchmark ${dir}/Release/Benchmark.exe)
+	endif()
+	set(bestFps 0)
+	set(bestCpu 0)
+	set(bestConversion 0)
+	set(bestDispatch 0)
+	foreach(run RANGE 1 ${REPEAT})
+		if(PIPELINE)
+			execute_process(COMMAND ${benchmark} --frames ${FRAMES} ${BENCHMARK_ARGS} OUTPUT_VARIABLE pipeline RESULT_VARIABLE result)
+			if(result)
+				message(FATAL_ERROR "Pipeline benchmark failed in ${dir}: ${result}")
+			endif()
+			Sum("${pipeline}" fps fps)
+			Sum("${pipeline}" cpu_seconds cpu)
+			if(fps GREATER bestFps)
+				set(bestFps ${fps})
+			endif()
+			if(NOT bestCpu OR cpu LESS bestCpu)
+				set(bestCpu ${cpu})
+			endif()
+		endif()
+		execute_process(COMMAND ${benchmark} conversion OUTPUT_VARIABLE conversion RESULT_VARIABLE result)
+		if(result)
+			message(FATAL_ERROR "Conversion benchmark failed in ${dir}: ${result}")
+		endif()
+		execute_process(COMMAND ${benchmark} dispatch OUTPUT_VARIABLE dispatch RESULT_VARIABLE result)
+		if(result)
+			message(FATAL_ERROR "Dispatch benchmark failed in ${dir}: ${result}")
+		endif()
+		Sum("${conversion}" ms_per_frame conversionMs)
+		Sum("${dispatch}" dispatch_p50_ns dispatchNs)
+		if(NOT bestConversion OR conversionMs LESS bestConversion)
+			set(bestConversion ${conversionMs})
+		endif()
+		if(NOT bestDispatch OR dispatchNs LESS bestDispatch)
+			set(bestDispatch ${dispatchNs})
+		endif()
+	endforeach()
+	set(${prefix}_fps ${bestFps} PARENT_SCOPE)
+	set(${prefix}_cpu ${bestCpu} PARENT_SCOPE)
+	set(${prefix}_conversion ${bestConversion} PARENT_SCOPE)
+	set(${prefix}_dispatch ${bestDispatch} PARENT_SCOPE)
+endfunction()
+
+set(variants baseline lto pgo lto_pgo)
+set(baseline_lto OFF)
+set(baseline_pgo OFF)
+set(lto_lto ON)
+set(lto_pgo OFF)
+set(pgo_lto OFF)
+set(pgo_pgo ON)
+set(lto_pgo_lto ON)
+set(lto_pgo_pgo ON)
+
+foreach(variant IN LISTS variants)
+	set(dir ${BUILD_ROOT}/${variant})
+	message(STATUS "Building ${variant}...")
+	if(${variant}_pgo)
+		Build(${dir} ${${variant}_lto} GENERATE)
+		Build(${dir} ${${variant}_lto} USE)
+	else()
+		Build(${dir} ${${variant}_lto} OFF)
+	endif()
+	message(STATUS "Measuring ${variant}...")
+	Measure(${dir} ${variant})
+endforeach()
+
+file(WRITE ${BUILD_ROOT}/compare.jsonl "")
+foreach(variant IN LISTS variants)
+	Gain(${baseline_conversion} ${${variant}_conversion} conversionGain)
+	Gain(${baseline_dispatch} ${${variant}_dispatch} dispatchGain)
+	FromMilli(${${variant}_conversion} conversionMs)
+	FromMilli(${${variant}_dispatch} dispatchNs)
+	set(line "conversion ${conversionMs} ms (${conversionGain}), dispatch ${dispatchNs} ns (${dispatchGain})")
+	set(json "\"conversion_ms\":${conversionMs},\"conversion_gain\":\"${conversionGain}\",\"dispatch_ns\":${dispatchNs},\"dispatch_gain\":\"${dispatchGain}\"")
+	if(PIPELINE)
+		Gain(${${variant}_fps} ${baseline_fps} fpsGain)
+		Gain(${baseline_cpu} ${${variant}_cpu} cpuGain)
+		FromMilli(${${variant}_fps} fps)
+		FromMilli(${${variant}_cpu} cpu)
+		set(line "fps sum ${fps} (${fpsGain}), CPU ${cpu} s (${cpuGain}), ${line}")
+		set(json "\"fps_sum\":${fps},\"fps_gain\":\"${fpsGain}\",\"cpu_seconds\":${cpu},\"cpu_gain\":\"${cpuGain}\",${json}")
+	endif()
+	message("${variant}: ${line}")
+	file(APPEND ${BUILD_ROOT}/compare.jsonl "{\"variant\":\"${variant}\",${json}}\n")
+endforeach()
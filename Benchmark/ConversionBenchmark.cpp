@@ -0,0 +1,293 @@
+/*
+	color conversion microbenchmarks, replicate conversion chain from CFrameTask in isolation:
+		bgra_i420			sws_scale BGRA -> YUV420P
+		r10g10b10a2_i420	Imaging unpack to B8G8R8A8 + sws_scale -> YUV420P (current 10 bit source path)
+		r10g10b10a2_i010	Imaging unpack to R16G16B16A16 + sws_scale -> YUV420P10 (ENABLE_10BIT_TARGET_FORMAT path)
+	each kernel runs at every SIMD level supported by host (FFmpeg forced via av_force_cpu_flags(), Imaging variant selected explicitly)
+	and its output is checked against scalar BT.601 limited range reference, process exit code reflects check results
+
+	usage: Benchmark conversion [--resolution WxH,...] [--min-time ms]
+	prints one JSON object per kernel/resolution/SIMD level to stdout
+	GB/s counts source bytes, cycles per pixel are TSC (reference) cycles
+*/
+
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#ifdef _MSC_VER
+#	include <intrin.h>
+#else
+#	include <x86intrin.h>
+#endif
+extern "C"
+{
+#	include <libswscale/swscale.h>
+#	include <libavutil/cpu.h>
+#	include <libavutil/imgutils.h>
+}
+#include "Imaging.h"
+#include "VideoRecorder.h"
+#include "Common.h"
+
+using namespace std;
+typedef CVideoRecorder::CFrame::FrameData FrameData;
+
+namespace
+{
+	struct SIMDLevel
+	{
+		const char *name;
+		int flags;
+		CVideoRecorder::SIMDLevel imaging;
+	};
+
+	constexpr int
+		sse2Flags = AV_CPU_FLAG_MMX | AV_CPU_FLAG_MMXEXT | AV_CPU_FLAG_SSE | AV_CPU_FLAG_SSE2,
+		sse4Flags = sse2Flags | AV_CPU_FLAG_SSE3 | AV_CPU_FLAG_SSSE3 | AV_CPU_FLAG_SSE4 | AV_CPU_FLAG_SSE42,
+		avx2Flags = sse4Flags | AV_CPU_FLAG_AVX | AV_CPU_FLAG_AVX2 | AV_CPU_FLAG_FMA3,
+		avx512Flags = avx2Flags | AV_CPU_FLAG_AVX512;
+
+	const SIMDLevel simdLevels[] =
+	{
+		{ "c",		0,				CVideoRecorder::SIMDLevel::Scalar	},
+		{ "sse2",	sse2Flags,		CVideoRecorder::SIMDLevel::SSE2		},
+		{ "sse4",	sse4Flags,		CVideoRecorder::SIMDLevel::SSE2		},
+		{ "avx2",	avx2Flags,		CVideoRecorder::SIMDLevel::AVX2		},
+		{ "avx512",	avx512Flags,	CVideoRecorder::SIMDLevel::AVX512	},
+	};
+
+	const struct Kernel
+	{
+		const char *name;
+		FrameData::Format srcFormat;
+		AVPixelFormat dstFormat;
+	} kernels[] =
+	{
+		{ "bgra_i420",			FrameData::Format::B8G8R8A8,	AV_PIX_FMT_YUV420P		},
+		{ "r10g10b10a2_i420",	FrameData::Format::R10G10B10A2,	AV_PIX_FMT_YUV420P		},
+		{ "r10g10b10a2_i010",	FrameData::Format::R10G10B10A2,	AV_PIX_FMT_YUV420P10	},
+	};
+
+	// max abs difference vs reference in 8 bit units
+	constexpr int lumaTolerance = 2, chromaTolerance = 4;
+
+	class CPlanes
+	{
+		uint8_t *data[4]{};
+		int linesize[4]{};
+
+	public:
+		CPlanes(unsigned int width, unsigned int height, AVPixelFormat format)
+		{
+			if (av_image_alloc(data, linesize, width, height, format, 32) < 0)
+				throw bad_alloc();
+		}
+		CPlanes(CPlanes &) = delete;
+		void operator =(CPlanes &) = delete;
+		~CPlanes() { av_freep(&data[0]); }
+
+	public:
+		uint8_t *const *Data() const noexcept { return data; }
+		const int *Linesize() const noexcept { return linesize; }
+		template<typename Sample>
+		Sample &At(unsigned int plane, unsigned int x, unsigned int y) const noexcept { return reinterpret_cast<Sample *>(data[plane] + size_t(y) * linesize[plane])[x]; }
+	};
+
+	// mirrors CFrameTask conversion, sws context is created under currently forced CPU flags
+	class CConverter
+	{
+		const Kernel &kernel;
+		const CVideoRecorder::SIMDLevel simdLevel;
+		const unique_ptr<SwsContext, void (*)(SwsContext *)> cvtCtx;
+		vector<uint8_t> converted;
+
+	public:
+		CConverter(const Kernel &kernel, CVideoRecorder::SIMDLevel simdLevel, unsigned int width, unsigned int height) :
+			kernel(kernel),
+			simdLevel(simdLevel),
+			cvtCtx(sws_getContext(width, height, kernel.srcFormat == FrameData::Format::B8G8R8A8 ? AV_PIX_FMT_BGRA : kernel.dstFormat == AV_PIX_FMT_YUV420P10 ? AV_PIX_FMT_RGBA64 : AV_PIX_FMT_BGRA,
+				width, height, kernel.dstFormat, SWS_BILINEAR, NULL, NULL, NULL), sws_freeContext)
+		{
+			if (!cvtCtx)
+				throw runtime_error("Fail to create sws context");
+		}
+
+	public:
+		void operator ()(FrameData src, const CPlanes &dst)
+		{
+			if (src.format == FrameData::Format::R10G10B10A2)
+			{
+				const bool deep = kernel.dstFormat == AV_PIX_FMT_YUV420P10;
+				const size_t stride = (src.width * (deep ? 8 : 4) + 63) & ~size_t(63);
+				converted.resize(stride * src.height);
+				if (deep)
+					Imaging::ConvertToR16G16B16A16(src, converted.data(), stride, simdLevel);
+				else
+					Imaging::ConvertToB8G8R8A8(src, converted.data(), stride, simdLevel);
+				src.stride = stride;
+				src.pixels = converted.data();
+			}
+			const int srcStride = src.stride;
+			sws_scale(cvtCtx.get(), reinterpret_cast<const uint8_t *const *>(&src.pixels), &srcStride, 0, src.height, dst.Data(), dst.Linesize());
+		}
+	};
+
+	struct RGB
+	{
+		double r, g, b;
+	};
+
+	RGB FetchPixel(const FrameData &src, unsigned int x, unsigned int y)
+	{
+		const uint32_t pixel = reinterpret_cast<const uint32_t *>(static_cast<const uint8_t *>(src.pixels) + src.stride * y)[x];
+		switch (src.format)
+		{
+		case FrameData::Format::B8G8R8A8:
+			return { (pixel >> 16 & 0xFF) / 255., (pixel >> 8 & 0xFF) / 255., (pixel & 0xFF) / 255. };
+		case FrameData::Format::R10G10B10A2:
+			return { (pixel & 0x3FF) / 1023., (pixel >> 10 & 0x3FF) / 1023., (pixel >> 20 & 0x3FF) / 1023. };
+		default:
+			throw logic_error("Invalid format");
+		}
+	}
+
+	// straightforward BT.601 limited range with 2x2 box chroma, compared to kernel output plane by plane
+	template<typename Sample>
+	void CheckAgainstReference(const FrameData &src, const CPlanes &dst, unsigned int bitDepth, int (&maxError)[3])
+	{
+		const double scale = 1 << (bitDepth - 8);
+		const auto Luma = [](const RGB &c) { return .299 * c.r + .587 * c.g + .114 * c.b; };
+		fill(begin(maxError), end(maxError), 0);
+		for (unsigned int y = 0; y < src.height; y++)
+			for (unsigned int x = 0; x < src.width; x++)
+			{
+				const int ref = (int)lround((16 + 219 * Luma(FetchPixel(src, x, y))) * scale);
+				maxError[0] = max(maxError[0], abs(ref - (int)dst.At<Sample>(0, x, y)));
+			}
+		for (unsigned int y = 0; y < src.height / 2; y++)
+			for (unsigned int x = 0; x < src.width / 2; x++)
+			{
+				RGB avg{};
+				for (unsigned int dy = 0; dy < 2; dy++)
+					for (unsigned int dx = 0; dx < 2; dx++)
+					{
+						const RGB c = FetchPixel(src, x * 2 + dx, y * 2 + dy);
+						avg.r += c.r / 4, avg.g += c.g / 4, avg.b += c.b / 4;
+					}
+				const double luma = Luma(avg);
+				const int refU = (int)lround((128 + 224 * (avg.b - luma) / 1.772) * scale), refV = (int)lround((128 + 224 * (avg.r - luma) / 1.402) * scale);
+				maxError[1] = max(maxError[1], abs(refU - (int)dst.At<Sample>(1, x, y)));
+				maxError[2] = max(maxError[2], abs(refV - (int)dst.At<Sample>(2, x, y)));
+			}
+	}
+
+	bool Run(const Kernel &kernel, const Resolution &resolution, const SIMDLevel &simdLevel, chrono::steady_clock::duration minTime)
+	{
+		constexpr unsigned int minIterations = 5;
+		const CPattern pattern(kernel.srcFormat, resolution.width, resolution.height, 0);
+		const FrameData src = pattern.GetFrameData();
+		const CPlanes dst(resolution.width, resolution.height, kernel.dstFormat);
+
+		av_force_cpu_flags(simdLevel.flags);
+		CConverter convert(kernel, simdLevel.imaging, resolution.width, resolution.height);
+
+		convert(src, dst);	// warm up
+		unsigned int iterations = 0;
+		const auto start = chrono::steady_clock::now();
+		const auto tscStart = __rdtsc();
+		do
+		{
+			convert(src, dst);
+			iterations++;
+		} while (iterations < minIterations || chrono::steady_clock::now() - start < minTime);
+		const auto tscFinish = __rdtsc();
+		const chrono::duration<double> time = chrono::steady_clock::now() - start;
+
+		const unsigned int bitDepth = kernel.dstFormat == AV_PIX_FMT_YUV420P10 ? 10 : 8;
+		int maxError[3];
+		if (bitDepth > 8)
+			CheckAgainstReference<uint16_t>(src, dst, bitDepth, maxError);
+		else
+			CheckAgainstReference<uint8_t>(src, dst, bitDepth, maxError);
+		const int scale = 1 << (bitDepth - 8);
+		const bool ok = maxError[0] <= lumaTolerance * scale && max(maxError[1], maxError[2]) <= chromaTolerance * scale;
+
+		const double pixels = double(resolution.width) * resolution.height * iterations;
+		cout << fixed << setprecision(3)
+			<< "{\"benchmark\":\"" << kernel.name << '/' << resolution.width << 'x' << resolution.height << '/' << simdLevel.name
+			<< "\",\"kernel\":\"" << kernel.name
+			<< "\",\"width\":" << resolution.width
+			<< ",\"height\":" << resolution.height
+			<< ",\"simd\":\"" << simdLevel.name
+			<< "\",\"iterations\":" << iterations
+			<< ",\"ms_per_frame\":" << time.count() * 1e3 / iterations
+			<< ",\"gb_per_s\":" << pixels * sizeof(uint32_t) / time.count() * 1e-9
+			<< ",\"cycles_per_pixel\":" << (tscFinish - tscStart) / pixels
+			<< ",\"max_error\":[" << maxError[0] << ',' << maxError[1] << ',' << maxError[2]
+			<< "],\"ok\":" << (ok ? "true" : "false") << '}' << endl;
+		return ok;
+	}
+}
+
+int ConversionBenchmark(int argc, wchar_t *argv[])
+{
+	vector<Resolution> resolutions{ { 1280, 720 }, { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 } };
+	chrono::milliseconds minTime(500);
+
+	for (int i = 1; i < argc; i++)
+	{
+		const wstring option = argv[i];
+		const wchar_t *const value = i + 1 < argc ? argv[++i] : nullptr;
+		bool ok = true;
+		if (!value)
+			ok = false;
+		else if (option == L"--resolution")
+			ok = ParseResolutions(value, resolutions);
+		else if (option == L"--min-time")
+			minTime = chrono::milliseconds(wcstoul(value, nullptr, 10));
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			wcerr << L"Usage: Benchmark conversion [--resolution WxH,...] [--min-time ms]" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	av_force_cpu_flags(-1);
+	const int hostFlags = av_get_cpu_flags();
+	bool ok = true;
+	try
+	{
+		for (const auto &kernel : kernels)
+			for (const auto &resolution : resolutions)
+				for (const auto &simdLevel : simdLevels)
+				{
+					if (simdLevel.flags & ~hostFlags || simdLevel.imaging > Imaging::HostSIMDLevel())
+						continue;
+					wclog << kernel.name << L' ' << resolution.width << L'x' << resolution.height << L' ' << simdLevel.name << L"..." << endl;
+					ok &= Run(kernel, resolution, simdLevel, minTime);
+				}
+	}
+	catch (const exception &error)
+	{
+		av_force_cpu_flags(-1);
+		wcerr << L"Conversion benchmark failed: " << error.what() << endl;
+		return EXIT_FAILURE;
+	}
+	av_force_cpu_flags(-1);
+
+	if (!ok)
+		wcerr << L"Conversion output deviates from reference." << endl;
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
@@ -0,0 +1,277 @@
+/*
+	task dispatch microbenchmark, replicates worker queue handoff in isolation (tasks do no work, no FFmpeg involved):
+		virtual_deque	heap allocated virtual tasks in std::deque<std::unique_ptr<ITask>> (scheme before inline task ring)
+		variant_ring	tasks stored inline in fixed capacity ring of std::variant and dispatched with std::visit (CTaskQueue)
+	producer enqueues frame tasks (every 60th is start/stop like request carrying filename) under mutex and notifies worker which pops and runs them outside the lock
+	both queues are capped at recorder's task queue capacity, producer waits for free slot like EnqueueTask() does
+	enqueue is producer side cost per task (task construction + lock + push + notify), dispatch spans enqueue till task body starts on worker
+	paced run issues tasks at --fps rate like capture would, unpaced one saturates queue
+
+	usage: Benchmark dispatch [--tasks N] [--fps N] [--seconds N]
+	prints one JSON object per scheme/pacing to stdout
+*/
+
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <variant>
+#include <type_traits>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <exception>
+
+using namespace std;
+
+namespace
+{
+	typedef chrono::steady_clock Clock;
+
+	constexpr unsigned int capacity = 16 + 8;	// CVideoRecorder::taskQueueCapacity
+	constexpr unsigned int requestInterval = 60;
+
+	// collects dispatch latencies on worker thread
+	struct CSink
+	{
+		vector<uint32_t> dispatchNs;
+		uint_least64_t checksum = 0;	// keeps task bodies from being optimized out
+
+		void Dispatched(Clock::time_point enqueueTime, uint_least64_t value)
+		{
+			dispatchNs.push_back((uint32_t)chrono::duration_cast<chrono::nanoseconds>(Clock::now() - enqueueTime).count());
+			checksum += value;
+		}
+	};
+
+	// payloads mirror CFrameTask (refcounted frame + timestamp) and start/stop requests (filename)
+	struct CFrameTask
+	{
+		shared_ptr<const uint32_t> frame;
+		Clock::time_point enqueueTime;
+
+		void operator ()(CSink &sink) const { sink.Dispatched(enqueueTime, *frame); }
+	};
+
+	struct CRequest
+	{
+		wstring filename;
+		Clock::time_point enqueueTime;
+
+		void operator ()(CSink &sink) const { sink.Dispatched(enqueueTime, filename.size()); }
+	};
+
+	class CVirtualDeque
+	{
+		struct ITask
+		{
+			virtual ~ITask() = default;
+			virtual void operator ()(CSink &sink) = 0;
+		};
+
+		template<class Task>
+		class CTask final : public ITask
+		{
+			Task task;
+
+		public:
+			explicit CTask(Task &&task) : task(move(task)) {}
+			void operator ()(CSink &sink) override { task(sink); }
+		};
+
+		deque<unique_ptr<ITask>> tasks;
+
+	public:
+		typedef unique_ptr<ITask> Item;
+		static constexpr const char *name = "virtual_deque";
+
+	public:
+		bool empty() const noexcept { return tasks.empty(); }
+		bool full() const noexcept { return tasks.size() >= capacity; }
+		template<class Task>
+		void push_back(Task &&task) { tasks.push_back(make_unique<CTask<decay_t<Task>>>(move(task))); }
+		Item pop_front()
+		{
+			auto task = move(tasks.front());
+			tasks.pop_front();
+			return task;
+		}
+		static void Run(Item &task, CSink &sink) { (*task)(sink); }
+	};
+
+	class CVariantRing
+	{
+	public:
+		typedef variant<monostate, CFrameTask, CRequest> Item;
+		static constexpr const char *name = "variant_ring";
+
+	private:
+		Item items[capacity];
+		unsigned int head = 0, count = 0;
+
+	public:
+		bool empty() const noexcept { return !count; }
+		bool full() const noexcept { return count == capacity; }
+		template<class Task>
+		void push_back(Task &&task) noexcept { items[(head + count++) % capacity].emplace<decay_t<Task>>(move(task)); }
+		Item pop_front() noexcept
+		{
+			auto task = move(items[head]);
+			items[head].emplace<monostate>();
+			head = (head + 1) % capacity, count--;
+			return task;
+		}
+		static void Run(Item &task, CSink &sink)
+		{
+			visit([&sink](auto &task)
+			{
+				if constexpr (!is_same_v<decay_t<decltype(task)>, monostate>)
+					task(sink);
+			}, task);
+		}
+	};
+
+	struct Result
+	{
+		double enqueueP50, enqueueP99, dispatchP50, dispatchP99;
+	};
+
+	double Percentile(vector<uint32_t> &samples, double fraction)
+	{
+		if (samples.empty())
+			return 0;
+		const auto nth = samples.begin() + min(size_t(samples.size() * fraction), samples.size() - 1);
+		nth_element(samples.begin(), nth, samples.end());
+		return *nth;
+	}
+
+	// fps == 0 => unpaced
+	template<class Queue>
+	Result Measure(unsigned int tasks, unsigned int fps)
+	{
+		Queue queue;
+		mutex mtx;
+		condition_variable event;
+		bool finish = false;
+		CSink sink;
+		sink.dispatchNs.reserve(tasks);
+
+		thread worker([&]
+		{
+			unique_lock<decltype(mtx)> lck(mtx);
+			for (;;)
+			{
+				event.wait(lck, [&] { return finish || !queue.empty(); });
+				if (queue.empty())
+					return;
+				const bool wasFull = queue.full();
+				{
+					auto task = queue.pop_front();
+					if (wasFull)
+						event.notify_all();
+					lck.unlock();
+					Queue::Run(task, sink);
+				}	// task released outside the lock
+				lck.lock();
+			}
+		});
+
+		const auto frame = make_shared<const uint32_t>(1);
+		vector<uint32_t> enqueueNs;
+		enqueueNs.reserve(tasks);
+		const chrono::nanoseconds period(fps ? 1'000'000'000 / fps : 0);
+		auto next = Clock::now();
+		for (unsigned int i = 0; i < tasks; i++)
+		{
+			if (fps)
+				this_thread::sleep_until(next += period);
+			const auto start = Clock::now();
+			{
+				unique_lock<decltype(mtx)> lck(mtx);
+				event.wait(lck, [&] { return !queue.full(); });
+				if (i % requestInterval)
+					queue.push_back(CFrameTask{ frame, start });
+				else
+					queue.push_back(CRequest{ L"benchmark_capture.mp4", start });
+			}
+			event.notify_all();
+			enqueueNs.push_back((uint32_t)chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+		}
+		{
+			lock_guard<decltype(mtx)> lck(mtx);
+			finish = true;
+		}
+		event.notify_all();
+		worker.join();
+
+		return { Percentile(enqueueNs, .5), Percentile(enqueueNs, .99), Percentile(sink.dispatchNs, .5), Percentile(sink.dispatchNs, .99) };
+	}
+
+	template<class Queue>
+	void Print(unsigned int tasks, unsigned int fps)
+	{
+		wclog << Queue::name << L' ';
+		if (fps)
+			wclog << fps << L" fps..." << endl;
+		else
+			wclog << L"unpaced..." << endl;
+		const auto result = Measure<Queue>(tasks, fps);
+		cout << fixed << setprecision(0)
+			<< "{\"benchmark\":\"dispatch/" << Queue::name
+			<< "\",\"fps\":" << fps
+			<< ",\"tasks\":" << tasks
+			<< ",\"enqueue_p50_ns\":" << result.enqueueP50
+			<< ",\"enqueue_p99_ns\":" << result.enqueueP99
+			<< ",\"dispatch_p50_ns\":" << result.dispatchP50
+			<< ",\"dispatch_p99_ns\":" << result.dispatchP99 << '}' << endl;
+	}
+}
+
+int DispatchBenchmark(int argc, wchar_t *argv[])
+{
+	unsigned int tasks = 200'000, fps = 240, seconds = 5;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const wstring option = argv[i];
+		const wchar_t *const value = i + 1 < argc ? argv[++i] : nullptr;
+		bool ok = true;
+		if (!value)
+			ok = false;
+		else if (option == L"--tasks")
+			ok = (tasks = wcstoul(value, nullptr, 10)) > 0;
+		else if (option == L"--fps")
+			ok = (fps = wcstoul(value, nullptr, 10)) > 0;
+		else if (option == L"--seconds")
+			ok = (seconds = wcstoul(value, nullptr, 10)) > 0;
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			wcerr << L"Usage: Benchmark dispatch [--tasks N] [--fps N] [--seconds N]" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	try
+	{
+		Print<CVirtualDeque>(fps * seconds, fps);
+		Print<CVariantRing>(fps * seconds, fps);
+		Print<CVirtualDeque>(tasks, 0);
+		Print<CVariantRing>(tasks, 0);
+	}
+	catch (const exception &error)
+	{
+		wcerr << L"Dispatch benchmark failed: " << error.what() << endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
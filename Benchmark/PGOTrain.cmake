@@ -0,0 +1,45 @@
+#[[
+	PGO training run, invoked by pgo-train target on instrumented (VIDEO_RECORDER_PGO=GENERATE) build
+	inputs: BENCHMARK executable, PROFILE_DIR (GCC/Clang), LLVM_PROFDATA (Clang only), PIPELINE (OFF skips encoding run)
+	workload covers both source formats, several presets, conversion kernels at every SIMD level and task dispatch
+]]
+cmake_minimum_required(VERSION 3.13)
+
+if(NOT DEFINED PIPELINE)
+	set(PIPELINE ON)
+endif()
+
+# stale counters from previous training would skew profile
+if(PROFILE_DIR)
+	file(REMOVE_RECURSE ${PROFILE_DIR})
+	file(MAKE_DIRECTORY ${PROFILE_DIR})
+else()
+	get_filename_component(benchmarkDir ${BENCHMARK} DIRECTORY)
+	file(GLOB staleProfiles ${benchmarkDir}/*.pgc)
+	if(staleProfiles)
+		file(REMOVE ${staleProfiles})
+	endif()
+endif()
+
+if(PIPELINE)
+	execute_process(COMMAND ${BENCHMARK} --frames 120 --resolution 1280x720,1920x1080 --preset ultrafast,veryfast,medium OUTPUT_QUIET RESULT_VARIABLE result)
+	if(result)
+		message(FATAL_ERROR "Pipeline training run failed: ${result}")
+	endif()
+endif()
+execute_process(COMMAND ${BENCHMARK} conversion --resolution 1280x720,1920x1080 --min-time 100 OUTPUT_QUIET RESULT_VARIABLE result)
+if(result)
+	message(FATAL_ERROR "Conversion training run failed: ${result}")
+endif()
+execute_process(COMMAND ${BENCHMARK} dispatch --tasks 50000 --seconds 1 OUTPUT_QUIET RESULT_VARIABLE result)
+if(result)
+	message(FATAL_ERROR "Dispatch training run failed: ${result}")
+endif()
+
+if(LLVM_PROFDATA)
+	file(GLOB rawProfiles ${PROFILE_DIR}/*.profraw)
+	execute_process(COMMAND ${LLVM_PROFDATA} merge -output=${PROFILE_DIR}/default.profdata ${rawProfiles} RESULT_VARIABLE result)
+	if(result)
+		message(FATAL_ERROR "Fail to merge raw profiles: ${result}")
+	endif()
+endif()
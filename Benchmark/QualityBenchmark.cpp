@@ -0,0 +1,427 @@
+/*
+	quality vs speed regression harness
+	records clips through CVideoRecorder in offline mode, decodes result back and scores it against source end to end
+	(conversion + encoding): PSNR over 8 bit RGB and SSIM (8x8 windows, step 4) over BT.601 luma
+	synthetic clips are generated per resolution/format, recorded ones are raw frame dumps given as path:WxH:format
+
+	usage: Benchmark quality [--frames N] [--clip path:WxH:format,...] [--resolution WxH,...] [--format bgra,r10g10b10a2]
+		[--codec h264,h265] [--preset name,...] [--bitrate kbps,...] [--crf N,...] [--min-psnr dB] [--min-ssim value] [--out dir]
+	prints one JSON object per clip/codec/preset/rate control combination to stdout, exit code is non-zero if any score is below threshold
+	sessions run at fixed target bitrate by default (4000 kbps) so thresholds compare presets and codecs at matched bitrate, --crf adds (or with
+	no --bitrate replaces them by) constant quality runs; bitrate is set by Reconfigure() before first frame which reopens encoder => clips
+	are recorded to .ts (no global headers), achieved bitrate including container overhead is reported next to target
+	metrics run on Imaging kernels at host SIMD level
+*/
+
+#include <cstdlib>
+#include <cstdint>
+#include <cwchar>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <locale>
+#include <codecvt>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <filesystem>
+extern "C"
+{
+#	include <libavcodec/avcodec.h>
+#	include <libavformat/avformat.h>
+#	include <libswscale/swscale.h>
+}
+#include "VideoRecorder.h"
+#include "Imaging.h"
+#include "Common.h"
+
+using namespace std;
+typedef CVideoRecorder::CFrame::FrameData FrameData;
+
+namespace
+{
+	constexpr unsigned int fps = 60, syntheticLength = 8;
+
+	// frames are kept in memory and cycled if clip is shorter than requested frame count
+	class CClip
+	{
+	public:
+		const string name;
+		const FrameData::Format format;
+		const Resolution resolution;
+
+	private:
+		vector<vector<uint32_t>> frames;
+
+	public:
+		CClip(string name, FrameData::Format format, Resolution resolution) : name(move(name)), format(format), resolution(resolution) {}
+		static CClip Synthetic(const Named<FrameData::Format> &format, Resolution resolution);
+		static CClip Load(const wstring &spec, unsigned int maxFrames);
+
+	public:
+		unsigned int Length() const noexcept { return (unsigned int)frames.size(); }
+		FrameData GetFrameData(unsigned int i) const noexcept { return { format, resolution.width, resolution.height, resolution.width * sizeof(uint32_t), frames[i % frames.size()].data() }; }
+		uint32_t PixelRGB8(unsigned int i, unsigned int x, unsigned int y) const noexcept;
+	};
+
+	CClip CClip::Synthetic(const Named<FrameData::Format> &format, Resolution resolution)
+	{
+		CClip clip(string("synthetic_") + format.name + '_' + to_string(resolution.width) + 'x' + to_string(resolution.height), format.value, resolution);
+		for (unsigned int phase = 0; phase < syntheticLength; phase++)
+		{
+			const auto frameData = CPattern(format.value, resolution.width, resolution.height, phase).GetFrameData();
+			const auto pixels = static_cast<const uint32_t *>(frameData.pixels);
+			clip.frames.emplace_back(pixels, pixels + size_t(resolution.width) * resolution.height);
+		}
+		return clip;
+	}
+
+	// spec: path:WxH:format, path may contain ':' itself
+	CClip CClip::Load(const wstring &spec, unsigned int maxFrames)
+	{
+		const auto formatPos = spec.rfind(L':'), resolutionPos = formatPos == wstring::npos || formatPos == 0 ? wstring::npos : spec.rfind(L':', formatPos - 1);
+		if (resolutionPos == wstring::npos)
+			throw invalid_argument("Clip should be specified as path:WxH:format");
+		const wstring path = spec.substr(0, resolutionPos);
+
+		vector<Named<FrameData::Format>> format;
+		vector<Resolution> resolution;
+		if (!ParseNamed(spec.substr(formatPos + 1).c_str(), formats, format) || format.size() != 1 ||
+			!ParseResolutions(spec.substr(resolutionPos + 1, formatPos - resolutionPos - 1).c_str(), resolution) || resolution.size() != 1)
+			throw invalid_argument("Invalid clip format or resolution");
+
+		ifstream file(filesystem::path(path), ios::binary);
+		if (!file)
+			throw runtime_error("Fail to open clip");
+		CClip clip(wstring_convert<codecvt_utf8<wchar_t>>().to_bytes(path), format.front().value, resolution.front());
+		const size_t pixelCount = size_t(clip.resolution.width) * clip.resolution.height;
+		while (clip.frames.size() < maxFrames)
+		{
+			vector<uint32_t> frame(pixelCount);
+			if (!file.read(reinterpret_cast<char *>(frame.data()), pixelCount * sizeof(uint32_t)))
+				break;
+			clip.frames.push_back(move(frame));
+		}
+		if (clip.frames.empty())
+			throw runtime_error("Clip is shorter than 1 frame");
+		return clip;
+	}
+
+	// 0x00RRGGBB
+	uint32_t CClip::PixelRGB8(unsigned int i, unsigned int x, unsigned int y) const noexcept
+	{
+		const uint32_t pixel = frames[i % frames.size()][size_t(y) * resolution.width + x];
+		switch (format)
+		{
+		case FrameData::Format::B8G8R8A8:
+			return pixel & 0xFFFFFFu;
+		case FrameData::Format::R10G10B10A2:
+			return (pixel >> 2 & 0xFF) << 16 | (pixel >> 12 & 0xFF) << 8 | (pixel >> 22 & 0xFF);
+		default:
+			return 0;
+		}
+	}
+
+	inline uint8_t Luma(uint32_t rgb) noexcept
+	{
+		return (77 * (rgb >> 16 & 0xFF) + 150 * (rgb >> 8 & 0xFF) + 29 * (rgb & 0xFF) + 128) >> 8;
+	}
+
+	struct Scores
+	{
+		double psnr, ssim;
+		unsigned int frames;
+	};
+
+	class CComparer
+	{
+		const CClip &clip;
+		unique_ptr<SwsContext, void (*)(SwsContext *)> cvtCtx{ nullptr, sws_freeContext };
+		vector<uint32_t> decoded, srcRGB, dstRGB;
+		vector<uint8_t> srcLuma, dstLuma;
+		uint_least64_t squaredError = 0, samples = 0;
+		double ssimSum = 0;
+		unsigned int frames = 0;
+
+	public:
+		explicit CComparer(const CClip &clip) : clip(clip) {}
+
+	public:
+		void operator ()(const AVFrame &frame);
+		Scores Result() const;
+	};
+
+	void CComparer::operator ()(const AVFrame &frame)
+	{
+		const unsigned int width = min<unsigned int>(frame.width, clip.resolution.width), height = min<unsigned int>(frame.height, clip.resolution.height);
+		cvtCtx.reset(sws_getCachedContext(cvtCtx.release(), frame.width, frame.height, AVPixelFormat(frame.format), frame.width, frame.height, AV_PIX_FMT_BGRA, SWS_POINT, NULL, NULL, NULL));
+		if (!cvtCtx)
+			throw runtime_error("Fail to convert decoded frame");
+		decoded.resize(size_t(frame.width) * frame.height);
+		uint8_t *const dst[] = { reinterpret_cast<uint8_t *>(decoded.data()) };
+		const int dstStride[] = { frame.width * (int)sizeof(uint32_t) };
+		sws_scale(cvtCtx.get(), frame.data, frame.linesize, 0, frame.height, dst, dstStride);
+
+		// unused 4th byte is 0 in both => does not contribute to squared error
+		const size_t pixelCount = size_t(width) * height;
+		srcRGB.resize(pixelCount);
+		dstRGB.resize(pixelCount);
+		srcLuma.resize(pixelCount);
+		dstLuma.resize(pixelCount);
+		for (unsigned int y = 0; y < height; y++)
+			for (unsigned int x = 0; x < width; x++)
+			{
+				const size_t i = size_t(y) * width + x;
+				srcRGB[i] = clip.PixelRGB8(frames, x, y);
+				dstRGB[i] = decoded[size_t(y) * frame.width + x] & 0xFFFFFFu;
+				srcLuma[i] = Luma(srcRGB[i]);
+				dstLuma[i] = Luma(dstRGB[i]);
+			}
+		const auto level = Imaging::HostSIMDLevel();
+		const unsigned int rowBytes = width * sizeof(uint32_t);
+		squaredError += Imaging::SquaredError(reinterpret_cast<const uint8_t *>(srcRGB.data()), reinterpret_cast<const uint8_t *>(dstRGB.data()), rowBytes, rowBytes, height, level);
+		samples += pixelCount * 3;
+		ssimSum += Imaging::SSIM(srcLuma.data(), dstLuma.data(), width, width, height, level);
+		frames++;
+	}
+
+	Scores CComparer::Result() const
+	{
+		const double mse = samples ? double(squaredError) / samples : 0;
+		return { mse ? 10 * log10(255. * 255. / mse) : INFINITY, frames ? ssimSum / frames : 0, frames };
+	}
+
+	Scores Score(const wstring &filename, const CClip &clip)
+	{
+		struct InputDeleter
+		{
+			void operator ()(AVFormatContext *input) const { avformat_close_input(&input); }
+		};
+		struct ContextDeleter
+		{
+			void operator ()(AVCodecContext *context) const { avcodec_free_context(&context); }
+		};
+		struct FrameDeleter
+		{
+			void operator ()(AVFrame *frame) const { av_frame_free(&frame); }
+		};
+		struct PacketDeleter
+		{
+			void operator ()(AVPacket *packet) const { av_packet_free(&packet); }
+		};
+
+		unique_ptr<AVFormatContext, InputDeleter> input;
+		{
+			AVFormatContext *inputRaw = NULL;
+			if (avformat_open_input(&inputRaw, wstring_convert<codecvt_utf8<wchar_t>>().to_bytes(filename).c_str(), NULL, NULL) < 0)
+				throw runtime_error("Fail to open recorded video");
+			input.reset(inputRaw);
+		}
+		if (avformat_find_stream_info(input.get(), NULL) < 0)
+			throw runtime_error("Fail to read recorded video stream info");
+		const int streamIdx = av_find_best_stream(input.get(), AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+		if (streamIdx < 0)
+			throw runtime_error("Recorded file has no video stream");
+		const AVCodecParameters *const params = input->streams[streamIdx]->codecpar;
+		const AVCodec *const codec = avcodec_find_decoder(params->codec_id);
+		const unique_ptr<AVCodecContext, ContextDeleter> context(avcodec_alloc_context3(codec));
+		if (!codec || !context || avcodec_parameters_to_context(context.get(), params) < 0 || avcodec_open2(context.get(), codec, NULL) < 0)
+			throw runtime_error("Fail to init decoder");
+		const unique_ptr<AVFrame, FrameDeleter> frame(av_frame_alloc());
+		const unique_ptr<AVPacket, PacketDeleter> packet(av_packet_alloc());
+		if (!frame || !packet)
+			throw bad_alloc();
+
+		CComparer compare(clip);
+		const auto Drain = [&]
+		{
+			while (avcodec_receive_frame(context.get(), frame.get()) == 0)
+			{
+				compare(*frame);
+				av_frame_unref(frame.get());
+			}
+		};
+		while (av_read_frame(input.get(), packet.get()) >= 0)
+		{
+			if (packet->stream_index == streamIdx && avcodec_send_packet(context.get(), packet.get()) == 0)
+				Drain();
+			av_packet_unref(packet.get());
+		}
+		avcodec_send_packet(context.get(), NULL);
+		Drain();
+		return compare.Result();
+	}
+
+	// either crf or bitrate (kbps) is set, the other one is -1
+	struct Config
+	{
+		Named<CVideoRecorder::Codec> codec;
+		Named<CVideoRecorder::Preset> preset;
+		int64_t crf, bitrate;
+	};
+
+	bool Run(const CClip &clip, const Config &config, unsigned int frameCount, const wstring &outDir, double minPSNR, double minSSIM)
+	{
+		// pool outlives recorder
+		static CVideoRecorder::CFramePool<CSyntheticFrame, CVideoRecorder::maxFramesInFlight> pool;
+		const wstring filename = TempFilename(outDir, L"quality_", L".ts");
+		const auto format = clip.format == FrameData::Format::R10G10B10A2 ? CVideoRecorder::Format::_10bit : CVideoRecorder::Format::_8bit;
+
+		const auto start = chrono::steady_clock::now();
+		{
+			CVideoRecorder recorder;
+			recorder.SetOfflineMode(true);
+			recorder.StartRecord(filename, clip.resolution.width, clip.resolution.height, format, CVideoRecorder::FPS(fps), config.codec.value, config.crf, config.preset.value);
+			if (config.bitrate != -1)
+				recorder.Reconfigure(-1, config.bitrate * 1000);
+			for (unsigned int i = 0; i < frameCount; i++)
+				recorder.SampleFrame([&](CVideoRecorder::CFrame::Opaque opaque)
+				{
+					auto frame = pool.Acquire(move(opaque), clip.GetFrameData(i));
+					if (frame)
+						frame->Ready();
+					return frame;
+				});
+			recorder.StopRecord();
+		}
+		const chrono::duration<double> encodeTime = chrono::steady_clock::now() - start;
+
+		Scores scores;
+		try
+		{
+			scores = Score(filename, clip);
+		}
+		catch (...)
+		{
+			RemoveFile(filename);
+			throw;
+		}
+		const auto fileSize = FileSize(filename);
+		RemoveFile(filename);
+
+		const bool ok = scores.frames == frameCount && scores.psnr >= minPSNR && scores.ssim >= minSSIM;
+		cout << fixed << setprecision(4)
+			<< "{\"clip\":\"" << clip.name
+			<< "\",\"codec\":\"" << config.codec.name
+			<< "\",\"preset\":\"" << config.preset.name
+			<< "\",\"crf\":" << config.crf
+			<< ",\"target_kbps\":" << config.bitrate
+			<< ",\"width\":" << clip.resolution.width
+			<< ",\"height\":" << clip.resolution.height
+			<< ",\"frames\":" << scores.frames
+			<< ",\"encode_fps\":" << frameCount / encodeTime.count()
+			<< ",\"kbps\":" << fileSize * 8e-3 * fps / frameCount
+			<< ",\"psnr\":" << scores.psnr
+			<< ",\"ssim\":" << scores.ssim
+			<< ",\"ok\":" << (ok ? "true" : "false") << '}' << endl;
+		return ok;
+	}
+}
+
+int QualityBenchmark(int argc, wchar_t *argv[])
+{
+	unsigned int frameCount = 120;
+	vector<wstring> clipSpecs;
+	vector<Resolution> resolutions{ { 1280, 720 } };
+	vector<Named<FrameData::Format>> selectedFormats(begin(formats), end(formats));
+	vector<Named<CVideoRecorder::Codec>> selectedCodecs{ codecs[0] };
+	vector<Named<CVideoRecorder::Preset>> selectedPresets;
+	ParseNamed(L"veryfast", presets, selectedPresets);
+	vector<int64_t> crfs, bitrates;
+	double minPSNR = 35, minSSIM = .95;
+	wstring outDir = TempDir();
+
+	for (int i = 1; i < argc; i++)
+	{
+		const wstring option = argv[i];
+		const wchar_t *const value = i + 1 < argc ? argv[++i] : nullptr;
+		bool ok = true;
+		if (!value)
+			ok = false;
+		else if (option == L"--frames")
+			ok = (frameCount = wcstoul(value, nullptr, 10)) > 0;
+		else if (option == L"--clip")
+			clipSpecs = Split(value);
+		else if (option == L"--resolution")
+			ok = ParseResolutions(value, resolutions);
+		else if (option == L"--format")
+			ok = ParseNamed(value, formats, selectedFormats);
+		else if (option == L"--codec")
+			ok = ParseNamed(value, codecs, selectedCodecs);
+		else if (option == L"--preset")
+			ok = ParseNamed(value, presets, selectedPresets);
+		else if (option == L"--bitrate")
+		{
+			bitrates.clear();
+			for (const auto &item : Split(value))
+			{
+				bitrates.push_back(wcstoll(item.c_str(), nullptr, 10));
+				ok &= bitrates.back() > 0;
+			}
+		}
+		else if (option == L"--crf")
+		{
+			crfs.clear();
+			for (const auto &item : Split(value))
+				crfs.push_back(wcstoll(item.c_str(), nullptr, 10));
+		}
+		else if (option == L"--min-psnr")
+			minPSNR = wcstod(value, nullptr);
+		else if (option == L"--min-ssim")
+			minSSIM = wcstod(value, nullptr);
+		else if (option == L"--out")
+			outDir = value;
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			wcerr << L"Usage: Benchmark quality [--frames N] [--clip path:WxH:format,...] [--resolution WxH,...] [--format bgra,r10g10b10a2]"
+				L" [--codec h264,h265] [--preset name,...] [--bitrate kbps,...] [--crf N,...] [--min-psnr dB] [--min-ssim value] [--out dir]" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+	if (bitrates.empty() && crfs.empty())
+		bitrates.push_back(4000);
+
+	bool ok = true;
+	try
+	{
+		vector<CClip> clips;
+		for (const auto &format : selectedFormats)
+			for (const auto &resolution : resolutions)
+				clips.push_back(CClip::Synthetic(format, resolution));
+		for (const auto &spec : clipSpecs)
+			clips.push_back(CClip::Load(spec, frameCount));
+
+		for (const auto &clip : clips)
+			for (const auto &codec : selectedCodecs)
+				for (const auto &preset : selectedPresets)
+				{
+					for (const auto bitrate : bitrates)
+					{
+						wclog << clip.name.c_str() << L' ' << codec.name << L' ' << preset.name << L' ' << bitrate << L" kbps..." << endl;
+						ok &= Run(clip, { codec, preset, -1, bitrate }, frameCount, outDir, minPSNR, minSSIM);
+					}
+					for (const auto crf : crfs)
+					{
+						wclog << clip.name.c_str() << L' ' << codec.name << L' ' << preset.name << L" crf " << crf << L"..." << endl;
+						ok &= Run(clip, { codec, preset, crf, -1 }, frameCount, outDir, minPSNR, minSSIM);
+					}
+				}
+	}
+	catch (const exception &error)
+	{
+		wcerr << L"Quality benchmark failed: " << error.what() << endl;
+		return EXIT_FAILURE;
+	}
+
+	if (!ok)
+		wcerr << L"Quality is below threshold." << endl;
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
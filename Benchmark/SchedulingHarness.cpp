@@ -0,0 +1,915 @@
+/*
+	deterministic scheduling harness for recorder built with VIDEO_RECORDER_TEST_HOOKS
+	(manual clock, rawvideo stub encoder, in-memory sink => no wall time and no external encoder involved)
+	drives seeded random start/stop/sample/cancel/retry sequences, deferred frames are readied/canceled on separate thread like render thread would
+	and checks SampleFrame() pacing against reference model plus frame, memory and event accounting once recorder is idle
+	recorder destroyed without ever getting a task is checked to go down cleanly and report SIMD level
+	encoder fallback chain is checked against stub backends reported missing or failing to open on purpose, failed encoder reopen is checked to keep session going
+	steady state SampleFrame() with pooled frames is checked to make no heap allocations on producer thread (global operator new is replaced to count them)
+	spool is checked to replay whole and from seeked pts, both finished and with index rebuilt after writer termination
+	spill file size cap is checked to turn further frames into repeats
+	luma histogram and scene score are checked on hand made planes, detected cuts are checked to reach encoder as forced keyframes both directly and through spill
+	intended to run under ThreadSanitizer (VIDEO_RECORDER_HARNESS_TSAN)
+
+	usage: SchedulingHarness [--sequences N] [--steps N] [--seed N] [--verbose]
+	sequence i runs with seed + i, failing one is reproduced by --seed <reported seed> --sequences 1
+	prints summary JSON object to stdout, failures go to stderr, exit code reflects check results (registered as CTest test with default options)
+*/
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <deque>
+#include <array>
+#include <memory>
+#include <functional>
+#include <random>
+#include <chrono>
+#include <ratio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sstream>
+#include <iostream>
+#include <locale>
+#include <codecvt>
+#include <iomanip>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include <fstream>
+#include <filesystem>
+#include "VideoRecorder.h"
+#include "Imaging.h"
+#include "Spool.h"
+#include "Common.h"
+
+#ifndef VIDEO_RECORDER_TEST_HOOKS
+#	error SchedulingHarness requires recorder built with VIDEO_RECORDER_TEST_HOOKS
+#endif
+
+using namespace std;
+typedef CVideoRecorder::CFrame::FrameData FrameData;
+typedef CVideoRecorder::CTestClock Clock;
+typedef CVideoRecorder::FrameLossReason FrameLossReason;
+
+namespace
+{
+	// counted on thread which sets the flag only => worker and logger threads do not disturb producer figures
+	thread_local bool countAllocations = false;
+	thread_local uint_least64_t allocations = 0;
+}
+
+// array, nothrow and sized variants forward here or to free()
+void *operator new(size_t size)
+{
+	if (countAllocations)
+		allocations++;
+	if (void *const block = malloc(size ? size : 1))
+		return block;
+	throw bad_alloc();
+}
+
+void operator delete(void *block) noexcept
+{
+	free(block);
+}
+
+void operator delete(void *block, size_t) noexcept
+{
+	free(block);
+}
+
+namespace
+{
+	constexpr unsigned int width = 16, height = 16;
+	constexpr size_t frameBytes = width * height * sizeof(uint32_t);
+	// memory session takes by itself (test sink IO buffer, encoder side frame with alignment slack), random budgets are drawn above it
+	constexpr size_t sessionFloor = 4096 + 4 * frameBytes;
+	constexpr CVideoRecorder::FPS fpsValues[] = { CVideoRecorder::FPS::_25, CVideoRecorder::FPS::_30, CVideoRecorder::FPS::_60 };
+
+	// completes deferred frames in FIFO order on its own thread
+	class CCompleter
+	{
+		mutex mtx;
+		condition_variable event;
+		deque<function<void ()>> actions;
+		bool finish = false;
+		thread worker;
+
+	private:
+		void Run()
+		{
+			unique_lock<decltype(mtx)> lck(mtx);
+			for (;;)
+			{
+				event.wait(lck, [this] { return finish || !actions.empty(); });
+				if (actions.empty())
+					return;
+				const auto action = move(actions.front());
+				actions.pop_front();
+				lck.unlock();
+				action();
+				lck.lock();
+			}
+		}
+
+	public:
+		CCompleter() : worker(&CCompleter::Run, this) {}
+		~CCompleter()
+		{
+			{
+				lock_guard<decltype(mtx)> lck(mtx);
+				finish = true;
+			}
+			event.notify_one();
+			worker.join();
+		}
+
+	public:
+		void Push(function<void ()> action)
+		{
+			{
+				lock_guard<decltype(mtx)> lck(mtx);
+				actions.push_back(move(action));
+			}
+			event.notify_one();
+		}
+	};
+
+	// reference pacing: slots passed since next frame time plus current one
+	template<unsigned int fps>
+	uint_least64_t AdvanceModel(Clock::time_point now, Clock::time_point &nextFrame)
+	{
+		typedef chrono::duration<Clock::rep, ratio<1, fps>> FrameDuration;
+		const auto delta = chrono::duration_cast<FrameDuration>(now - nextFrame) + FrameDuration(1);
+		nextFrame += chrono::duration_cast<Clock::duration>(delta);
+		return delta.count();
+	}
+
+	struct Model
+	{
+		CVideoRecorder::FPS fps;
+		bool recording = false, offline = false;
+		Clock::time_point nextFrame;
+		uint_least64_t slots = 0, late = 0, framesEnqueued = 0, canceledSlots = 0;
+		unsigned int sessions = 0;
+
+		uint_least64_t PendingFrames(Clock::time_point now)
+		{
+			if (!recording)
+				return 0;
+			if (offline)
+				return 1;
+			if (now < nextFrame)
+				return 0;
+			switch (fps)
+			{
+			case CVideoRecorder::FPS::_25:
+				return AdvanceModel<25>(now, nextFrame);
+			case CVideoRecorder::FPS::_30:
+				return AdvanceModel<30>(now, nextFrame);
+			case CVideoRecorder::FPS::_60:
+				return AdvanceModel<60>(now, nextFrame);
+			default:
+				throw logic_error("Invalid fps");
+			}
+		}
+	};
+
+	class CSequence
+	{
+		mt19937_64 rng;
+		vector<CPattern> patterns;
+		Model model;
+		ostringstream failures;
+		uint_least64_t lateEvents = 0, droppedEvents = 0;
+		bool eventsLost = false;
+
+	private:
+		unsigned int Uniform(unsigned int n) { return (unsigned int)(rng() % n); }
+		bool Chance(unsigned int percent) { return Uniform(100) < percent; }
+
+		template<typename Value>
+		void Check(bool ok, const char what[], Value actual, Value expected)
+		{
+			if (!ok)
+				failures << "\t" << what << ": " << actual << " (expected " << expected << ")\n";
+		}
+
+		void TakeEvents(CVideoRecorder &recorder)
+		{
+			const auto events = recorder.TakeFrameEvents();
+			eventsLost |= events.size() >= 256;	// log capacity
+			for (const auto &event : events)
+				switch (event.type)
+				{
+				case CVideoRecorder::FrameEventType::Late:
+					lateEvents += event.frames;
+					break;
+				case CVideoRecorder::FrameEventType::Dropped:
+					droppedEvents += event.frames;
+					break;
+				default:
+					break;
+				}
+		}
+
+		template<class Acquire>
+		void Sample(CVideoRecorder &recorder, CCompleter &completer, Acquire &acquire)
+		{
+			const auto backup = model.nextFrame;
+			const auto expected = model.PendingFrames(Clock::now());
+			// only producer enqueues frames => none can appear in flight till SampleFrame() decides
+			const bool framesInFlight = recorder.GetStats().queueDepth;
+			// 0 - frame, 1 - no frame (exhausted pool), 2 - throw once (retried), 3 - throw twice
+			const unsigned int behavior = Chance(80) ? 0 : 1 + Uniform(3);
+			unsigned int calls = 0;
+			uint_least64_t pendingFrames = 0;
+			decltype(acquire(declval<CVideoRecorder::CFrame::Opaque>(), declval<const CPattern &>())) frame;
+			recorder.SampleFrame([&](CVideoRecorder::CFrame::Opaque opaque)
+			{
+				pendingFrames = get<2>(opaque);
+				if (const unsigned int attempt = calls++; behavior >= 2 && attempt < behavior - 1)
+					throw runtime_error("scripted failure");
+				auto result = behavior == 1 ? decltype(frame)() : acquire(move(opaque), patterns[Uniform((unsigned int)patterns.size())]);
+				frame = result;
+				return result;
+			});
+
+			if (!calls)
+			{
+				// frame not requested: either no slot or slots folded into frame in flight (frames in flight limit, memory budget)
+				if (expected)
+				{
+					Check(!model.offline, "offline sample not requested", calls, 1u);
+					Check(framesInFlight, "sample not requested with no frame in flight", calls, 1u);
+				}
+				model.slots += expected;
+				model.late += expected ? expected - 1 : 0;
+				return;
+			}
+			Check(expected > 0, "frame requested without slot", expected, uint_least64_t(1));
+			Check(pendingFrames == expected, "video pending frames", pendingFrames, expected);
+			// retry may repeat last frame without calling back (memory budget) => slots are consumed as usual
+			if (behavior == 3 && calls == 2)
+			{
+				// both attempts failed => slots are not consumed
+				model.nextFrame = backup;
+				return;
+			}
+			model.slots += expected;
+			model.late += expected - 1;
+			if (!frame)
+				return;
+			model.framesEnqueued++;
+
+			const unsigned int action = Uniform(10);
+			if (action < 5)
+				frame->Ready();
+			else if (action < 6)
+			{
+				// not ready => still queued => cancel always takes effect
+				frame->Cancel();
+				model.canceledSlots += expected;
+			}
+			else if (action < 9)
+				completer.Push([frame] { frame->Ready(); });
+			else
+			{
+				completer.Push([frame] { frame->Cancel(); });
+				model.canceledSlots += expected;
+			}
+		}
+
+		template<class Acquire>
+		void Run(CVideoRecorder &recorder, unsigned int steps, Acquire &&acquire)
+		{
+			CCompleter completer;
+			model.offline = Chance(25);
+			recorder.SetOfflineMode(model.offline);
+			if (Chance(25))
+				recorder.SetMemoryBudget(sessionFloor + Uniform(CVideoRecorder::maxFramesInFlight * frameBytes));
+
+			for (unsigned int step = 0; step < steps; step++)
+			{
+				const unsigned int op = Uniform(100);
+				if (op < 30)
+					Clock::Advance(chrono::microseconds(Uniform(60000)));
+				else if (op < 78)
+					Sample(recorder, completer, acquire);
+				else if (op < 86)
+				{
+					model.fps = fpsValues[Uniform(3)];
+					model.recording = true;
+					model.nextFrame = Clock::now();
+					model.sessions++;
+					recorder.StartRecord(L"harness.nut", width, height, CVideoRecorder::Format::_8bit, model.fps, CVideoRecorder::Codec::H264);
+				}
+				else if (op < 96)
+				{
+					model.recording = false;
+					recorder.StopRecord();
+				}
+				else
+					recorder.WaitIdle();
+				TakeEvents(recorder);
+			}
+			recorder.StopRecord();
+			recorder.WaitIdle();
+			TakeEvents(recorder);
+		}
+
+		void Verify(const CVideoRecorder &recorder)
+		{
+			const auto stats = recorder.GetStats();
+			Check(stats.framesEncoded + stats.framesDropped == model.slots, "encoded + dropped frames", stats.framesEncoded + stats.framesDropped, model.slots);
+			Check(stats.framesLate == model.late, "late frames", stats.framesLate, model.late);
+			Check(stats.framesSampled == model.framesEnqueued, "sampled frames", stats.framesSampled, model.framesEnqueued);
+			Check(stats.framesDroppedBy[(unsigned int)FrameLossReason::Error] == 0, "frames dropped by error", stats.framesDroppedBy[(unsigned int)FrameLossReason::Error], uint_least64_t(0));
+			const auto canceled = stats.framesDroppedBy[(unsigned int)FrameLossReason::Canceled];
+			Check(model.canceledSlots ? canceled >= model.canceledSlots : canceled == 0, "frames dropped by cancel", canceled, model.canceledSlots);
+			Check(stats.queueDepth == 0, "queue depth", stats.queueDepth, 0u);
+			Check(stats.encoderLag == 0, "encoder lag", stats.encoderLag, 0u);
+			for (unsigned int category = 0; category < CVideoRecorder::memoryCategoryCount; category++)
+				Check(stats.memory[category].current == 0, "tracked memory", stats.memory[category].current, size_t(0));
+			Check(stats.memoryTotal.current == 0, "tracked memory total", stats.memoryTotal.current, size_t(0));
+			if (!eventsLost)
+			{
+				Check(lateEvents == stats.framesLate, "late events", lateEvents, stats.framesLate);
+				Check(droppedEvents == stats.framesDropped, "dropped events", droppedEvents, stats.framesDropped);
+			}
+			if (model.sessions)
+				Check(!recorder.TestSink().empty(), "sink size", recorder.TestSink().size(), size_t(1));
+		}
+
+	public:
+		explicit CSequence(uint_least64_t seed) : rng(seed)
+		{
+			for (const auto &format : formats)
+				for (unsigned int phase = 0; phase < 2; phase++)
+					patterns.emplace_back(format.value, width, height, phase);
+		}
+
+	public:
+		// returns failure description, empty if all checks passed
+		string operator ()(unsigned int steps)
+		{
+			// pool outlives recorder
+			CVideoRecorder::CFramePool<CSyntheticFrame, 4> pool;
+			CVideoRecorder recorder;
+			if (Chance(50))
+				Run(recorder, steps, [](CVideoRecorder::CFrame::Opaque opaque, const CPattern &pattern)
+				{
+					return make_shared<CSyntheticFrame>(move(opaque), pattern.GetFrameData());
+				});
+			else
+				Run(recorder, steps, [&pool](CVideoRecorder::CFrame::Opaque opaque, const CPattern &pattern)
+				{
+					return pool.Acquire(move(opaque), pattern.GetFrameData());
+				});
+			Verify(recorder);
+			return failures.str();
+		}
+	};
+
+	// recorder which never gets a task has no worker thread => destruction must not try to join one (would abort), SIMD level is known without session
+	string IdleScript()
+	{
+		ostringstream failures;
+		CVideoRecorder::SIMDLevel idleLevel;
+		{
+			const CVideoRecorder recorder;
+			idleLevel = recorder.GetStats().simdLevel;
+		}
+		CVideoRecorder recorder;
+		recorder.StartRecord(L"harness.nut", width, height, CVideoRecorder::Format::_8bit, CVideoRecorder::FPS::_30, CVideoRecorder::Codec::H264);
+		recorder.StopRecord();
+		recorder.WaitIdle();
+		if (const auto level = recorder.GetStats().simdLevel; level != idleLevel)
+			failures << "\tidle script: SIMD level " << (unsigned int)idleLevel << " reported by idle recorder (expected " << (unsigned int)level << ")\n";
+		return failures.str();
+	}
+
+	// fixed script with exact expectations, guards reference model against sharing implementation's mistakes
+	string PacingScript()
+	{
+		static const struct
+		{
+			unsigned int advanceMs;
+			uint_least64_t expected;
+		} script[] = { { 0, 1 }, { 0, 0 }, { 39, 0 }, { 1, 1 }, { 130, 3 }, { 29, 0 }, { 1, 1 } };	// 25 fps => 40 ms slots
+
+		ostringstream failures;
+		const CPattern pattern(FrameData::Format::B8G8R8A8, width, height, 0);
+		CVideoRecorder recorder;
+		recorder.StartRecord(L"harness.nut", width, height, CVideoRecorder::Format::_8bit, CVideoRecorder::FPS::_25, CVideoRecorder::Codec::H264);
+		for (const auto &step : script)
+		{
+			Clock::Advance(chrono::milliseconds(step.advanceMs));
+			uint_least64_t pendingFrames = 0;
+			recorder.SampleFrame([&](CVideoRecorder::CFrame::Opaque opaque)
+			{
+				pendingFrames = get<2>(opaque);
+				auto frame = make_shared<CSyntheticFrame>(move(opaque), pattern.GetFrameData());
+				frame->Ready();
+				return frame;
+			});
+			if (pendingFrames != step.expected)
+				failures << "\tpacing script step +" << step.advanceMs << " ms: " << pendingFrames << " pending frames (expected " << step.expected << ")\n";
+		}
+		recorder.StopRecord();
+		recorder.WaitIdle();
+		const auto stats = recorder.GetStats();
+		if (stats.framesEncoded != 6 || stats.framesLate != 2)
+			failures << "\tpacing script: " << stats.framesEncoded << " encoded / " << stats.framesLate << " late frames (expected 6 / 2)\n";
+		return failures.str();
+	}
+
+	// stub NVENC H.264 is missing or fails to open => requested encoder and first fallback entry fail, second entry takes over
+	string FallbackScript()
+	{
+		typedef CVideoRecorder::Codec Codec;
+		ostringstream failures;
+		const CPattern pattern(FrameData::Format::B8G8R8A8, width, height, 0);
+		CVideoRecorder::FailEncoder(Codec::H264, true, true);
+		CVideoRecorder recorder;
+		const auto Session = [&](const char name[], const char *expectedEncoder, unsigned int expectedFallback, uint_least64_t expectedFrames)
+		{
+			const auto framesEncoded = recorder.GetStats().framesEncoded;
+			recorder.StartRecordNV(L"harness.nut", width, height, CVideoRecorder::Format::_8bit, CVideoRecorder::FPS::_30, Codec::H264);
+			recorder.SampleFrame([&](CVideoRecorder::CFrame::Opaque opaque)
+			{
+				auto frame = make_shared<CSyntheticFrame>(move(opaque), pattern.GetFrameData());
+				frame->Ready();
+				return frame;
+			});
+			recorder.WaitIdle();
+			auto stats = recorder.GetStats();
+			if (!stats.encoder != !expectedEncoder || (stats.encoder && strcmp(stats.encoder, expectedEncoder) != 0) || stats.encoderFallback != expectedFallback)
+				failures << "\tfallback script " << name << ": encoder " << (stats.encoder ? stats.encoder : "none") << " #" << stats.encoderFallback
+					<< " (expected " << (expectedEncoder ? expectedEncoder : "none") << " #" << expectedFallback << ")\n";
+			recorder.StopRecord();
+			recorder.WaitIdle();
+			stats = recorder.GetStats();
+			if (stats.encoder)
+				failures << "\tfallback script " << name << ": encoder " << stats.encoder << " reported after stop\n";
+			if (stats.framesEncoded - framesEncoded != expectedFrames)
+				failures << "\tfallback script " << name << ": " << stats.framesEncoded - framesEncoded << " encoded frames (expected " << expectedFrames << ")\n";
+		};
+		const vector<CVideoRecorder::EncoderFallback> chain = { { Codec::H264, -1, CVideoRecorder::PresetNV::Default }, { Codec::HEVC } };
+		Session("without chain", nullptr, 0, 0);
+		recorder.SetEncoderFallback(chain);
+		Session("with chain", "rawvideo", 2, 1);
+		recorder.SetEncoderFallback({});
+		Session("with chain cleared", nullptr, 0, 0);
+		CVideoRecorder::FailEncoder(Codec::H264, true, false);
+		Session("with encoder restored", "rawvideo", 0, 1);
+		// found but failing avcodec_open2() takes the same fallback path as missing one
+		CVideoRecorder::FailEncoderOpen(Codec::H264, true, true);
+		Session("failing to open without chain", nullptr, 0, 0);
+		recorder.SetEncoderFallback(chain);
+		Session("failing to open with chain", "rawvideo", 2, 1);
+		recorder.SetEncoderFallback({});
+		CVideoRecorder::FailEncoderOpen(Codec::H264, true, false);
+		return failures.str();
+	}
+
+	// pooled frames, one slot per sample and drained queue => producer side of SampleFrame() has nothing to allocate for
+	string AllocationScript()
+	{
+		constexpr unsigned int warmupFrames = 8, countedFrames = 64;
+		ostringstream failures;
+		const CPattern pattern(FrameData::Format::B8G8R8A8, width, height, 0);
+		// pool outlives recorder
+		CVideoRecorder::CFramePool<CSyntheticFrame, 4> pool;
+		CVideoRecorder recorder;
+		recorder.StartRecord(L"harness.nut", width, height, CVideoRecorder::Format::_8bit, CVideoRecorder::FPS::_25, CVideoRecorder::Codec::H264);
+		const auto Sample = [&]
+		{
+			recorder.SampleFrame([&](CVideoRecorder::CFrame::Opaque opaque)
+			{
+				auto frame = pool.Acquire(move(opaque), pattern.GetFrameData());
+				if (frame)
+					frame->Ready();
+				return frame;
+			});
+			Clock::Advance(chrono::milliseconds(40));	// 25 fps => single slot per sample
+		};
+		for (unsigned int i = 0; i < warmupFrames; i++)
+		{
+			Sample();
+			recorder.WaitIdle();
+		}
+		allocations = 0;
+		for (unsigned int i = 0; i < countedFrames; i++)
+		{
+			countAllocations = true;
+			Sample();
+			countAllocations = false;
+			recorder.WaitIdle();
+		}
+		if (allocations)
+			failures << "\tallocation script: " << allocations << " heap allocations in " << countedFrames << " steady state samples (expected 0)\n";
+		recorder.StopRecord();
+		recorder.WaitIdle();
+		const auto stats = recorder.GetStats();
+		if (stats.framesEncoded != warmupFrames + countedFrames)
+			failures << "\tallocation script: " << stats.framesEncoded << " encoded frames (expected " << warmupFrames + countedFrames << ")\n";
+		return failures.str();
+	}
+
+	// stub backend can not be changed in place and has no private options to carry over => reopen fails, session goes on with old encoder
+	string ReconfigureScript()
+	{
+		constexpr unsigned int framesBefore = 2, framesAfter = 3;
+		ostringstream failures;
+		const CPattern pattern(FrameData::Format::B8G8R8A8, width, height, 0);
+		CVideoRecorder recorder;
+		// container without global headers => reopen is attempted
+		recorder.StartRecord(L"harness.ts", width, height, CVideoRecorder::Format::_8bit, CVideoRecorder::FPS::_25, CVideoRecorder::Codec::H264);
+		const auto Sample = [&]
+		{
+			recorder.SampleFrame([&](CVideoRecorder::CFrame::Opaque opaque)
+			{
+				auto frame = make_shared<CSyntheticFrame>(move(opaque), pattern.GetFrameData());
+				frame->Ready();
+				return frame;
+			});
+			Clock::Advance(chrono::milliseconds(40));	// 25 fps => single slot per sample
+		};
+		for (unsigned int i = 0; i < framesBefore; i++)
+			Sample();
+		recorder.Reconfigure(-1, 1'000'000);
+		for (unsigned int i = 0; i < framesAfter; i++)
+			Sample();
+		recorder.WaitIdle();
+		auto stats = recorder.GetStats();
+		if (!stats.encoder || strcmp(stats.encoder, "rawvideo") != 0)
+			failures << "\treconfigure script: encoder " << (stats.encoder ? stats.encoder : "none") << " after failed reopen (expected rawvideo)\n";
+		recorder.StopRecord();
+		recorder.WaitIdle();
+		stats = recorder.GetStats();
+		if (stats.framesEncoded != framesBefore + framesAfter)
+			failures << "\treconfigure script: " << stats.framesEncoded << " encoded frames (expected " << framesBefore + framesAfter << ")\n";
+		if (recorder.TestSink().empty())
+			failures << "\treconfigure script: nothing written\n";
+		return failures.str();
+	}
+
+	// spill capped at two records, first frame held back until all are queued => frames 1 and 2 are spilled, later ones become repeats of frame 2
+	string SpillScript()
+	{
+		constexpr unsigned int frames = 5, capRecords = 2;
+		constexpr size_t recordBytes = 448;	// 16 byte record header + 4:2:0 8 bit planes, 64 byte aligned
+		ostringstream failures;
+		const CPattern pattern(FrameData::Format::B8G8R8A8, width, height, 0);
+		CVideoRecorder recorder;
+		recorder.SetSpill(TempFilename(TempDir(), L"harness_spill"), 1, capRecords * recordBytes);
+		recorder.StartRecord(L"harness.nut", width, height, CVideoRecorder::Format::_8bit, CVideoRecorder::FPS::_25, CVideoRecorder::Codec::H264);
+		shared_ptr<CSyntheticFrame> heldBack;
+		for (unsigned int i = 0; i < frames; i++)
+		{
+			recorder.SampleFrame([&](CVideoRecorder::CFrame::Opaque opaque)
+			{
+				auto frame = make_shared<CSyntheticFrame>(move(opaque), pattern.GetFrameData());
+				if (!heldBack)
+					heldBack = frame;
+				else
+					frame->Ready();
+				return frame;
+			});
+			Clock::Advance(chrono::milliseconds(40));	// 25 fps => single slot per sample
+		}
+		heldBack->Ready();
+		recorder.StopRecord();
+		recorder.WaitIdle();
+		const auto stats = recorder.GetStats();
+		const auto capDuplicates = stats.framesDuplicatedBy[(unsigned int)CVideoRecorder::FrameLossReason::MemoryBudget];
+		if (stats.framesEncoded != frames || stats.framesSpilled != frames || capDuplicates != frames - capRecords)
+			failures << "\tspill script: " << stats.framesEncoded << " encoded / " << stats.framesSpilled << " spilled / " << capDuplicates << " repeated at cap frames (expected "
+				<< frames << " / " << frames << " / " << frames - capRecords << ")\n";
+		if (stats.spillBacklog)
+			failures << "\tspill script: " << stats.spillBacklog << " spilled frames left after stop\n";
+		return failures.str();
+	}
+
+	// drops index like writer terminated before finishing spool => reader has to rebuild it from record headers
+	void Unfinish(const wstring &filename)
+	{
+		Spool::Header header;
+		{
+			fstream file(filesystem::path(filename), ios::binary | ios::in | ios::out);
+			file.read(reinterpret_cast<char *>(&header), sizeof header);
+			header.indexOffset = 0;
+			file.seekp(0);
+			file.write(reinterpret_cast<const char *>(&header), sizeof header);
+		}
+		filesystem::resize_file(filesystem::path(filename), header.headerSize + header.frameCount * header.recordSize);
+	}
+
+	// spool of 5 gray levels, third one covering 2 slots (sampled late), is replayed whole and from pts 3 to 4, both finished and with rebuilt index
+	string SpoolScript()
+	{
+		static const struct
+		{
+			uint32_t gray;
+			unsigned int advanceMs;	// before sample
+		} script[] = { { 0x00, 0 }, { 0x40, 40 }, { 0x80, 80 }, { 0xC0, 40 }, { 0xFF, 40 } };	// 25 fps => 40 ms slots
+
+		ostringstream failures;
+		const auto spoolFilename = TempFilename(TempDir(), L"harness_spool");
+		{
+			CVideoRecorder recorder;
+			recorder.StartSpool(spoolFilename, width, height, CVideoRecorder::Format::_8bit, CVideoRecorder::FPS::_25);
+			for (const auto &step : script)
+			{
+				const vector<uint32_t> pixels(width * height, 0xFF000000u | step.gray * 0x010101u);
+				Clock::Advance(chrono::milliseconds(step.advanceMs));
+				recorder.SampleFrame([&](CVideoRecorder::CFrame::Opaque opaque)
+				{
+					auto frame = make_shared<CSyntheticFrame>(move(opaque), FrameData{ FrameData::Format::B8G8R8A8, width, height, width * sizeof(uint32_t), pixels.data() });
+					frame->Ready();
+					return frame;
+				});
+				recorder.WaitIdle();	// pixels go out of scope
+			}
+			recorder.StopRecord();
+			recorder.WaitIdle();
+		}
+
+		CVideoRecorder recorder;
+		const auto Encode = [&](int64_t firstPts, int64_t lastPts)
+		{
+			recorder.EncodeSpool(spoolFilename, L"harness.nut", CVideoRecorder::Codec::H264, -1, CVideoRecorder::Preset::Default, firstPts, lastPts);
+			recorder.WaitIdle();
+			return recorder.TestFrames();
+		};
+		const auto Print = [&failures](const vector<pair<int64_t, uint8_t>> &frames)
+		{
+			for (const auto &frame : frames)
+				failures << " " << frame.first << ':' << (unsigned int)frame.second;
+		};
+		const auto whole = Encode(0, INT64_MAX);
+		bool ok = whole.size() == 6;
+		for (unsigned int i = 0; ok && i < whole.size(); i++)
+			ok = whole[i].first == i && (i == 3 ? whole[i].second == whole[i - 1].second : !i || whole[i].second > whole[i - 1].second);
+		if (!ok)
+		{
+			failures << "\tspool script: whole finished spool replayed as";
+			Print(whole);
+			failures << " (expected pts 0 - 5 with increasing luma repeated at pts 3)\n";
+			RemoveFile(spoolFilename);
+			return failures.str();
+		}
+		const vector<pair<int64_t, uint8_t>> expectedRange = { { 0, whole[3].second }, { 1, whole[4].second } };
+		const auto Check = [&](const char name[], const vector<pair<int64_t, uint8_t>> &frames, const vector<pair<int64_t, uint8_t>> &expected)
+		{
+			if (frames == expected)
+				return;
+			failures << "\tspool script " << name << ":";
+			Print(frames);
+			failures << " (expected";
+			Print(expected);
+			failures << ")\n";
+		};
+		Check("finished range", Encode(3, 4), expectedRange);
+		Unfinish(spoolFilename);
+		Check("unfinished whole", Encode(0, INT64_MAX), whole);
+		Check("unfinished range", Encode(3, 4), expectedRange);
+		Check("unfinished tail", Encode(5, INT64_MAX), { { 0, whole[5].second } });
+		RemoveFile(spoolFilename);
+		return failures.str();
+	}
+
+	constexpr unsigned int lumaStride = width + 8;	// in samples, padding holds outliers which must not be sampled
+
+	// 10 bit plane holds same content as 8 bit one
+	template<typename Sample, class Luma>
+	vector<Sample> LumaPlane(Luma luma)
+	{
+		constexpr unsigned int shift = sizeof(Sample) > 1 ? 2 : 0;
+		vector<Sample> plane(lumaStride * height, Sample(255 << shift));
+		for (unsigned int y = 0; y < height; y++)
+			for (unsigned int x = 0; x < width; x++)
+				plane[y * lumaStride + x] = Sample(luma(x, y) << shift);
+		return plane;
+	}
+
+	// histogram and scene score of hand made luma planes, limited range black (16) and white (235) share no bin
+	string SceneScoreScript()
+	{
+		constexpr uint32_t samples = (width / 2) * (height / 2);
+		ostringstream failures;
+		const auto Constant = [](unsigned int luma) { return [luma](unsigned int, unsigned int) { return luma; }; };
+		const auto Gradient = [](unsigned int offset) { return [offset](unsigned int x, unsigned int y) { return 16 + offset + x * 8 + y; }; };
+		const auto Score = [](const auto &prevPlane, const auto &plane)
+		{
+			typedef typename decay_t<decltype(plane)>::value_type Sample;
+			return CVideoRecorder::SceneScore(prevPlane.data(), plane.data(), lumaStride * sizeof(Sample), width, height, sizeof(Sample) > 1);
+		};
+
+		uint32_t bins[Imaging::lumaBins], deepBins[Imaging::lumaBins];
+		const auto gray = LumaPlane<uint8_t>(Constant(100));
+		Imaging::LumaHistogram(gray.data(), lumaStride, width, height, false, bins);
+		for (unsigned int bin = 0; bin < Imaging::lumaBins; bin++)
+			if (bins[bin] != (bin == 100 / 4 ? samples : 0))
+				failures << "\tscene score script: gray plane has " << bins[bin] << " samples in bin " << bin << " (expected " << (bin == 100 / 4 ? samples : 0) << ")\n";
+		const auto gradient = LumaPlane<uint8_t>(Gradient(0));
+		const auto deepGradient = LumaPlane<uint16_t>(Gradient(0));
+		Imaging::LumaHistogram(gradient.data(), lumaStride, width, height, false, bins);
+		Imaging::LumaHistogram(deepGradient.data(), lumaStride * sizeof(uint16_t), width, height, true, deepBins);
+		if (!equal(begin(bins), end(bins), begin(deepBins)))
+			failures << "\tscene score script: 8 bit and 10 bit gradient histograms differ\n";
+
+		const auto black = LumaPlane<uint8_t>(Constant(16)), white = LumaPlane<uint8_t>(Constant(235));
+		const auto deepBlack = LumaPlane<uint16_t>(Constant(16)), deepWhite = LumaPlane<uint16_t>(Constant(235));
+		const auto shiftedGradient = LumaPlane<uint8_t>(Gradient(40));
+		const auto deepShiftedGradient = LumaPlane<uint16_t>(Gradient(40));
+		const struct
+		{
+			const char *name;
+			double score, expected;
+		} checks[] =
+		{
+			{ "identical 8 bit frames", Score(gradient, gradient), 0 },
+			{ "identical 10 bit frames", Score(deepGradient, deepGradient), 0 },
+			{ "8 bit black then white", Score(black, white), 1 },
+			{ "10 bit black then white", Score(deepBlack, deepWhite), 1 },
+			{ "10 bit shifted gradient", Score(deepGradient, deepShiftedGradient), Score(gradient, shiftedGradient) },
+		};
+		for (const auto &check : checks)
+			if (check.score != check.expected)
+				failures << "\tscene score script " << check.name << ": score " << check.score << " (expected " << check.expected << ")\n";
+		if (const double score = Score(gradient, shiftedGradient); score <= 0 || score >= 1)
+			failures << "\tscene score script 8 bit shifted gradient: score " << score << " (expected partial change)\n";
+		return failures.str();
+	}
+
+	// black, black, white, white, black => cuts at frames 2 and 4
+	// spilled session holds first frame back until queue exceeds spill depth => all frames go through scratch file
+	string SceneCutScript()
+	{
+		ostringstream failures;
+		const vector<uint32_t> black(width * height, 0xFF000000u), white(width * height, 0xFFFFFFFFu);
+		const vector<uint32_t> *const script[] = { &black, &black, &white, &white, &black };
+		const vector<int64_t> expectedKeyframes = { 2, 4 };
+		const auto Session = [&](const char name[], bool spilled)
+		{
+			CVideoRecorder recorder;
+			recorder.SetSceneCutDetection(.5);
+			if (spilled)
+				recorder.SetSpill(TempFilename(TempDir(), L"harness_spill"), 1);
+			recorder.StartRecord(L"harness.nut", width, height, CVideoRecorder::Format::_8bit, CVideoRecorder::FPS::_25, CVideoRecorder::Codec::H264);
+			shared_ptr<CSyntheticFrame> heldBack;
+			for (const auto pixels : script)
+			{
+				recorder.SampleFrame([&](CVideoRecorder::CFrame::Opaque opaque)
+				{
+					auto frame = make_shared<CSyntheticFrame>(move(opaque), FrameData{ FrameData::Format::B8G8R8A8, width, height, width * sizeof(uint32_t), pixels->data() });
+					if (spilled && !heldBack)
+						heldBack = frame;
+					else
+						frame->Ready();
+					return frame;
+				});
+				Clock::Advance(chrono::milliseconds(40));	// 25 fps => single slot per sample
+			}
+			if (heldBack)
+				heldBack->Ready();
+			recorder.StopRecord();
+			recorder.WaitIdle();
+			const auto stats = recorder.GetStats();
+			if (stats.sceneCuts != expectedKeyframes.size())
+				failures << "\tscene cut script " << name << ": " << stats.sceneCuts << " scene cuts (expected " << expectedKeyframes.size() << ")\n";
+			if (recorder.TestKeyframes() != expectedKeyframes)
+			{
+				failures << "\tscene cut script " << name << ": keyframes forced at";
+				for (const auto pts : recorder.TestKeyframes())
+					failures << ' ' << pts;
+				failures << " (expected 2 4)\n";
+			}
+			if (stats.framesEncoded != size(script) || stats.framesSpilled != (spilled ? size(script) : 0))
+				failures << "\tscene cut script " << name << ": " << stats.framesEncoded << " encoded / " << stats.framesSpilled << " spilled frames (expected "
+					<< size(script) << " / " << (spilled ? size(script) : 0) << ")\n";
+		};
+		Session("direct", false);
+		Session("spilled", true);
+		return failures.str();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int sequences = 2000, steps = 64;
+	uint_least64_t seed = 1;
+	bool verbose = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const string option = argv[i];
+		bool ok = true;
+		if (option == "--verbose")
+			verbose = true;
+		else if (i + 1 >= argc)
+			ok = false;
+		else if (option == "--sequences")
+			ok = (sequences = strtoul(argv[++i], nullptr, 10)) > 0;
+		else if (option == "--steps")
+			ok = (steps = strtoul(argv[++i], nullptr, 10)) > 0;
+		else if (option == "--seed")
+			seed = strtoull(argv[++i], nullptr, 10);
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			cerr << "Usage: SchedulingHarness [--sequences N] [--steps N] [--seed N] [--verbose]" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// harness output is narrow => library log is routed to narrow streams instead of default wclog/wcerr sink
+	if (verbose)
+		CVideoRecorder::SetLogSink([](const CVideoRecorder::LogRecord &record)
+		{
+			(record.severity == CVideoRecorder::LogSeverity::Info ? clog : cerr) << wstring_convert<codecvt_utf8<wchar_t>>().to_bytes(record.message) << '\n';
+		});
+	else
+		CVideoRecorder::SetLogSink([](const CVideoRecorder::LogRecord &) {});
+
+	const auto start = chrono::steady_clock::now();
+	unsigned int failed = 0;
+	try
+	{
+		if (const auto failures = IdleScript(); !failures.empty())
+		{
+			cerr << "Idle script failed:\n" << failures;
+			failed++;
+		}
+		if (const auto failures = PacingScript(); !failures.empty())
+		{
+			cerr << "Pacing script failed:\n" << failures;
+			failed++;
+		}
+		if (const auto failures = FallbackScript(); !failures.empty())
+		{
+			cerr << "Fallback script failed:\n" << failures;
+			failed++;
+		}
+		if (const auto failures = AllocationScript(); !failures.empty())
+		{
+			cerr << "Allocation script failed:\n" << failures;
+			failed++;
+		}
+		if (const auto failures = ReconfigureScript(); !failures.empty())
+		{
+			cerr << "Reconfigure script failed:\n" << failures;
+			failed++;
+		}
+		if (const auto failures = SpoolScript(); !failures.empty())
+		{
+			cerr << "Spool script failed:\n" << failures;
+			failed++;
+		}
+		if (const auto failures = SpillScript(); !failures.empty())
+		{
+			cerr << "Spill script failed:\n" << failures;
+			failed++;
+		}
+		if (const auto failures = SceneScoreScript(); !failures.empty())
+		{
+			cerr << "Scene score script failed:\n" << failures;
+			failed++;
+		}
+		if (const auto failures = SceneCutScript(); !failures.empty())
+		{
+			cerr << "Scene cut script failed:\n" << failures;
+			failed++;
+		}
+		for (unsigned int sequence = 0; sequence < sequences; sequence++)
+			if (const auto failures = CSequence(seed + sequence)(steps); !failures.empty())
+			{
+				cerr << "Sequence " << sequence << " (seed " << seed + sequence << ") failed:\n" << failures;
+				failed++;
+			}
+	}
+	catch (const exception &error)
+	{
+		cerr << "Scheduling harness failed: " << error.what() << endl;
+		return EXIT_FAILURE;
+	}
+	const chrono::duration<double> time = chrono::steady_clock::now() - start;
+
+	cout << fixed << setprecision(3)
+		<< "{\"sequences\":" << sequences
+		<< ",\"steps\":" << steps
+		<< ",\"seed\":" << seed
+		<< ",\"failed\":" << failed
+		<< ",\"seconds\":" << time.count() << '}' << endl;
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/*
+	startup cost of recorder, tools create CVideoRecorder on every launch but most runs never record
+		idle		construction + destruction of recorder which never gets a task (no worker thread expected), first one pays one-time library init (SIMD level resolution)
+		first		first short session in process: pays worker thread start, encoder open and FFmpeg's own first use costs
+		warm		same session repeated with fresh recorder: worker thread start and encoder open only
+	"first" - "warm" approximates one-time costs paid on first session
+
+	usage: Benchmark startup [--iterations N] [--codec h264,h265]
+	prints one JSON object per measurement to stdout, run in fresh process for meaningful "first" figure
+*/
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <exception>
+#include "VideoRecorder.h"
+#include "Common.h"
+
+using namespace std;
+typedef CVideoRecorder::CFrame::FrameData FrameData;
+
+namespace
+{
+	constexpr Resolution resolution{ 320, 180 };
+
+	// pool outlives recorders
+	CVideoRecorder::CFramePool<CSyntheticFrame, CVideoRecorder::maxFramesInFlight> pool;
+
+	// single frame session, returns once recorder is destroyed (file finalized)
+	chrono::duration<double> Session(const Named<CVideoRecorder::Codec> &codec, const CPattern &pattern, const wstring &filename)
+	{
+		const auto start = chrono::steady_clock::now();
+		{
+			CVideoRecorder recorder;
+			recorder.SetOfflineMode(true);
+			recorder.StartRecord(filename, resolution.width, resolution.height, CVideoRecorder::Format::_8bit, CVideoRecorder::FPS::_30, codec.value, 23, CVideoRecorder::Preset::ultrafast);
+			recorder.SampleFrame([&](CVideoRecorder::CFrame::Opaque opaque)
+			{
+				auto frame = pool.Acquire(move(opaque), pattern.GetFrameData());
+				if (frame)
+					frame->Ready();
+				return frame;
+			});
+			recorder.StopRecord();
+		}
+		const chrono::duration<double> time = chrono::steady_clock::now() - start;
+		RemoveFile(filename);
+		return time;
+	}
+
+	void Print(const char name[], const char codec[], unsigned int iterations, chrono::duration<double> time)
+	{
+		cout << fixed << setprecision(3)
+			<< "{\"benchmark\":\"startup/" << name
+			<< "\",\"codec\":\"" << codec
+			<< "\",\"iterations\":" << iterations
+			<< ",\"us_per_iteration\":" << time.count() * 1e6 / iterations << '}' << endl;
+	}
+}
+
+int StartupBenchmark(int argc, wchar_t *argv[])
+{
+	unsigned int iterations = 1000;
+	vector<Named<CVideoRecorder::Codec>> selectedCodecs{ codecs[0] };
+
+	for (int i = 1; i < argc; i++)
+	{
+		const wstring option = argv[i];
+		const wchar_t *const value = i + 1 < argc ? argv[++i] : nullptr;
+		bool ok = true;
+		if (!value)
+			ok = false;
+		else if (option == L"--iterations")
+			ok = (iterations = wcstoul(value, nullptr, 10)) > 0;
+		else if (option == L"--codec")
+			ok = ParseNamed(value, codecs, selectedCodecs);
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			wcerr << L"Usage: Benchmark startup [--iterations N] [--codec h264,h265]" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	try
+	{
+		// before anything else touches library
+		wclog << L"idle..." << endl;
+		const auto idleStart = chrono::steady_clock::now();
+		for (unsigned int i = 0; i < iterations; i++)
+			CVideoRecorder recorder;
+		Print("idle", "none", iterations, chrono::steady_clock::now() - idleStart);
+
+		const CPattern pattern(FrameData::Format::B8G8R8A8, resolution.width, resolution.height, 0);
+		const wstring filename = TempFilename(TempDir(), L"startup_");
+		for (const auto &codec : selectedCodecs)
+		{
+			wclog << codec.name << L" first..." << endl;
+			Print("first", codec.name, 1, Session(codec, pattern, filename));
+
+			// sessions are heavier than idle recorders => fewer repetitions
+			const unsigned int sessions = max(iterations / 100, 1u);
+			wclog << codec.name << L" warm..." << endl;
+			chrono::duration<double> warm{};
+			for (unsigned int i = 0; i < sessions; i++)
+				warm += Session(codec, pattern, filename);
+			Print("warm", codec.name, sessions, warm);
+		}
+	}
+	catch (const exception &error)
+	{
+		wcerr << L"Startup benchmark failed: " << error.what() << endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,736 @@
+#include "Imaging.h"
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+extern "C"
+{
+#	include <libavcodec/avcodec.h>
+#	include <libswscale/swscale.h>
+#	include <libavutil/error.h>
+}
+#if defined _M_X64 || defined _M_IX86 && _M_IX86_FP >= 2 || defined __SSE2__
+#	include <immintrin.h>
+#	define ENABLE_SSE2 1
+#	if defined _MSC_VER && !defined __clang__
+#		include <intrin.h>
+#		define TARGET(isa)
+#	else
+#		define TARGET(isa) __attribute__((target(isa)))
+#	endif
+#else
+#	define ENABLE_SSE2 0
+#endif
+
+typedef Imaging::FrameData::Format FrameFormat;
+
+#pragma region Convert
+namespace
+{
+	// x / 1023 truncated, exact for x < 2^26 (covers 10 -> 16 bit scaling with rounding bias)
+	inline uint32_t Div1023(uint32_t x) noexcept
+	{
+		return (x + (x >> 10) + (x >> 20) + 1) >> 10;
+	}
+
+	inline uint32_t Unorm10To8(uint32_t v) noexcept
+	{
+		return Div1023((v << 8) - v + 511);
+	}
+
+	inline uint32_t Unorm10To16(uint32_t v) noexcept
+	{
+		return Div1023((v << 16) - v + 511);
+	}
+
+	inline uint32_t ToB8G8R8A8(uint32_t pixel) noexcept
+	{
+		return Unorm10To8(pixel >> 20 & 0x3FF) | Unorm10To8(pixel >> 10 & 0x3FF) << 8 | Unorm10To8(pixel & 0x3FF) << 16 | (pixel >> 30) * 0x55u << 24;
+	}
+
+	inline uint64_t ToR16G16B16A16(uint32_t pixel) noexcept
+	{
+		return Unorm10To16(pixel & 0x3FF) | Unorm10To16(pixel >> 10 & 0x3FF) << 16 | uint64_t(Unorm10To16(pixel >> 20 & 0x3FF)) << 32 | uint64_t((pixel >> 30) * 0x5555u) << 48;
+	}
+
+	// row kernels return number of pixels processed, remaining tail is converted by scalar code
+	template<typename DstPixel>
+	unsigned int ConvertRowScalar(const uint32_t *, DstPixel *, unsigned int) noexcept
+	{
+		return 0;
+	}
+
+	// 4x4 block sums of a, b, a², b² and ab over 4 row strip, SSIM windows are assembled from 2x2 blocks
+	typedef uint32_t *const BlockSums[5];
+
+	inline void SumBlock(const uint8_t *a, const uint8_t *b, ptrdiff_t stride, unsigned int block, BlockSums sums) noexcept
+	{
+		uint32_t sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+		for (unsigned int y = 0; y < 4; y++)
+			for (unsigned int x = block * 4; x < block * 4 + 4; x++)
+			{
+				const uint32_t pa = a[y * stride + x], pb = b[y * stride + x];
+				sa += pa, sb += pb, saa += pa * pa, sbb += pb * pb, sab += pa * pb;
+			}
+		sums[0][block] = sa, sums[1][block] = sb, sums[2][block] = saa, sums[3][block] = sbb, sums[4][block] = sab;
+	}
+
+	// metric row kernels return number of samples (blocks) processed as well
+	unsigned int SquaredErrorRowScalar(const uint8_t *, const uint8_t *, unsigned int, uint64_t &) noexcept
+	{
+		return 0;
+	}
+
+	unsigned int SumBlocksScalar(const uint8_t *, const uint8_t *, ptrdiff_t, unsigned int, BlockSums) noexcept
+	{
+		return 0;
+	}
+
+#if ENABLE_SSE2
+#pragma region SSE2
+	inline __m128i Div1023(__m128i x) noexcept
+	{
+		return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, _mm_srli_epi32(x, 10)), _mm_add_epi32(_mm_srli_epi32(x, 20), _mm_set1_epi32(1))), 10);
+	}
+
+	inline __m128i Unorm10To8(__m128i v) noexcept
+	{
+		return Div1023(_mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(v, 8), v), _mm_set1_epi32(511)));
+	}
+
+	inline __m128i Unorm10To16(__m128i v) noexcept
+	{
+		return Div1023(_mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(v, 16), v), _mm_set1_epi32(511)));
+	}
+
+	// 4 pixels per iteration, channels are split into 32 bit lanes
+	struct Channels
+	{
+		__m128i r, g, b, a;
+
+		explicit Channels(const void *src) noexcept
+		{
+			const __m128i pixels = _mm_loadu_si128(static_cast<const __m128i *>(src)), mask = _mm_set1_epi32(0x3FF);
+			r = _mm_and_si128(pixels, mask);
+			g = _mm_and_si128(_mm_srli_epi32(pixels, 10), mask);
+			b = _mm_and_si128(_mm_srli_epi32(pixels, 20), mask);
+			a = _mm_srli_epi32(pixels, 30);
+		}
+	};
+
+	unsigned int ToB8G8R8A8SSE2(const uint32_t *src, uint32_t *dst, unsigned int width) noexcept
+	{
+		unsigned int x = 0;
+		for (; x + 4 <= width; x += 4)
+		{
+			const Channels channels(src + x);
+			const __m128i alpha = _mm_mullo_epi16(channels.a, _mm_set1_epi32(0x55));	// upper halves of 32 bit lanes are 0
+			const __m128i result = _mm_or_si128(
+				_mm_or_si128(Unorm10To8(channels.b), _mm_slli_epi32(Unorm10To8(channels.g), 8)),
+				_mm_or_si128(_mm_slli_epi32(Unorm10To8(channels.r), 16), _mm_slli_epi32(alpha, 24)));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), result);
+		}
+		return x;
+	}
+
+	unsigned int ToR16G16B16A16SSE2(const uint32_t *src, uint64_t *dst, unsigned int width) noexcept
+	{
+		unsigned int x = 0;
+		for (; x + 4 <= width; x += 4)
+		{
+			const Channels channels(src + x);
+			const __m128i alpha = _mm_mullo_epi16(channels.a, _mm_set1_epi32(0x5555));
+			const __m128i rg = _mm_or_si128(Unorm10To16(channels.r), _mm_slli_epi32(Unorm10To16(channels.g), 16));
+			const __m128i ba = _mm_or_si128(Unorm10To16(channels.b), _mm_slli_epi32(alpha, 16));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_unpacklo_epi32(rg, ba));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x + 2), _mm_unpackhi_epi32(rg, ba));
+		}
+		return x;
+	}
+
+	// 16 samples per iteration, squares of 16 bit differences are pair summed by madd and widened to 64 bit lanes
+	unsigned int SquaredErrorRowSSE2(const uint8_t *a, const uint8_t *b, unsigned int width, uint64_t &sum) noexcept
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i acc = zero;
+		unsigned int x = 0;
+		for (; x + 16 <= width; x += 16)
+		{
+			const __m128i pa = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + x)), pb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + x));
+			const __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(pa, zero), _mm_unpacklo_epi8(pb, zero)), hi = _mm_sub_epi16(_mm_unpackhi_epi8(pa, zero), _mm_unpackhi_epi8(pb, zero));
+			const __m128i squares = _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+			acc = _mm_add_epi64(acc, _mm_add_epi64(_mm_unpacklo_epi32(squares, zero), _mm_unpackhi_epi32(squares, zero)));
+		}
+		alignas(16) uint64_t lanes[2];	// no 64 bit extract on x86
+		_mm_store_si128(reinterpret_cast<__m128i *>(lanes), acc);
+		sum += lanes[0] + lanes[1];
+		return x;
+	}
+
+	// 32 bit lanes hold column pair sums, adjacent pairs are added and packed => 4 block sums
+	inline __m128i PackBlocks(__m128i lo, __m128i hi) noexcept
+	{
+		lo = _mm_shuffle_epi32(_mm_add_epi32(lo, _mm_srli_epi64(lo, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+		hi = _mm_shuffle_epi32(_mm_add_epi32(hi, _mm_srli_epi64(hi, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+		return _mm_unpacklo_epi64(lo, hi);
+	}
+
+	// 4 blocks (16 columns) per iteration, plain sums stay 16 bit over 4 rows
+	unsigned int SumBlocksSSE2(const uint8_t *a, const uint8_t *b, ptrdiff_t stride, unsigned int blocks, BlockSums sums) noexcept
+	{
+		const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+		unsigned int block = 0;
+		for (; block + 4 <= blocks; block += 4)
+		{
+			__m128i sa[2] = { zero, zero }, sb[2] = { zero, zero }, saa[2] = { zero, zero }, sbb[2] = { zero, zero }, sab[2] = { zero, zero };
+			for (unsigned int y = 0; y < 4; y++)
+			{
+				const __m128i pa = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + y * stride + block * 4)), pb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + y * stride + block * 4));
+				const __m128i wa[2] = { _mm_unpacklo_epi8(pa, zero), _mm_unpackhi_epi8(pa, zero) }, wb[2] = { _mm_unpacklo_epi8(pb, zero), _mm_unpackhi_epi8(pb, zero) };
+				for (unsigned int half = 0; half < 2; half++)
+				{
+					sa[half] = _mm_add_epi16(sa[half], wa[half]);
+					sb[half] = _mm_add_epi16(sb[half], wb[half]);
+					saa[half] = _mm_add_epi32(saa[half], _mm_madd_epi16(wa[half], wa[half]));
+					sbb[half] = _mm_add_epi32(sbb[half], _mm_madd_epi16(wb[half], wb[half]));
+					sab[half] = _mm_add_epi32(sab[half], _mm_madd_epi16(wa[half], wb[half]));
+				}
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(sums[0] + block), PackBlocks(_mm_madd_epi16(sa[0], ones), _mm_madd_epi16(sa[1], ones)));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(sums[1] + block), PackBlocks(_mm_madd_epi16(sb[0], ones), _mm_madd_epi16(sb[1], ones)));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(sums[2] + block), PackBlocks(saa[0], saa[1]));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(sums[3] + block), PackBlocks(sbb[0], sbb[1]));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(sums[4] + block), PackBlocks(sab[0], sab[1]));
+		}
+		return block;
+	}
+#pragma endregion
+
+#pragma region AVX2
+	TARGET("avx2") inline __m256i Div1023(__m256i x) noexcept
+	{
+		return _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(x, _mm256_srli_epi32(x, 10)), _mm256_add_epi32(_mm256_srli_epi32(x, 20), _mm256_set1_epi32(1))), 10);
+	}
+
+	TARGET("avx2") inline __m256i Unorm10To8(__m256i v) noexcept
+	{
+		return Div1023(_mm256_add_epi32(_mm256_sub_epi32(_mm256_slli_epi32(v, 8), v), _mm256_set1_epi32(511)));
+	}
+
+	TARGET("avx2") inline __m256i Unorm10To16(__m256i v) noexcept
+	{
+		return Div1023(_mm256_add_epi32(_mm256_sub_epi32(_mm256_slli_epi32(v, 16), v), _mm256_set1_epi32(511)));
+	}
+
+	// 8 pixels per iteration
+	struct ChannelsAVX2
+	{
+		__m256i r, g, b, a;
+
+		TARGET("avx2") explicit ChannelsAVX2(const void *src) noexcept
+		{
+			const __m256i pixels = _mm256_loadu_si256(static_cast<const __m256i *>(src)), mask = _mm256_set1_epi32(0x3FF);
+			r = _mm256_and_si256(pixels, mask);
+			g = _mm256_and_si256(_mm256_srli_epi32(pixels, 10), mask);
+			b = _mm256_and_si256(_mm256_srli_epi32(pixels, 20), mask);
+			a = _mm256_srli_epi32(pixels, 30);
+		}
+	};
+
+	TARGET("avx2") unsigned int ToB8G8R8A8AVX2(const uint32_t *src, uint32_t *dst, unsigned int width) noexcept
+	{
+		unsigned int x = 0;
+		for (; x + 8 <= width; x += 8)
+		{
+			const ChannelsAVX2 channels(src + x);
+			const __m256i alpha = _mm256_mullo_epi16(channels.a, _mm256_set1_epi32(0x55));
+			const __m256i result = _mm256_or_si256(
+				_mm256_or_si256(Unorm10To8(channels.b), _mm256_slli_epi32(Unorm10To8(channels.g), 8)),
+				_mm256_or_si256(_mm256_slli_epi32(Unorm10To8(channels.r), 16), _mm256_slli_epi32(alpha, 24)));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x), result);
+		}
+		return x;
+	}
+
+	TARGET("avx2") unsigned int ToR16G16B16A16AVX2(const uint32_t *src, uint64_t *dst, unsigned int width) noexcept
+	{
+		unsigned int x = 0;
+		for (; x + 8 <= width; x += 8)
+		{
+			const ChannelsAVX2 channels(src + x);
+			const __m256i alpha = _mm256_mullo_epi16(channels.a, _mm256_set1_epi32(0x5555));
+			const __m256i rg = _mm256_or_si256(Unorm10To16(channels.r), _mm256_slli_epi32(Unorm10To16(channels.g), 16));
+			const __m256i ba = _mm256_or_si256(Unorm10To16(channels.b), _mm256_slli_epi32(alpha, 16));
+			// unpack works within 128 bit lanes: lo = pixels 0, 1, 4, 5, hi = 2, 3, 6, 7
+			const __m256i lo = _mm256_unpacklo_epi32(rg, ba), hi = _mm256_unpackhi_epi32(rg, ba);
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x), _mm256_permute2x128_si256(lo, hi, 0x20));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x + 4), _mm256_permute2x128_si256(lo, hi, 0x31));
+		}
+		return x;
+	}
+
+	// 32 samples per iteration
+	TARGET("avx2") unsigned int SquaredErrorRowAVX2(const uint8_t *a, const uint8_t *b, unsigned int width, uint64_t &sum) noexcept
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		__m256i acc = zero;
+		unsigned int x = 0;
+		for (; x + 32 <= width; x += 32)
+		{
+			const __m256i pa = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + x)), pb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + x));
+			const __m256i lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(pa, zero), _mm256_unpacklo_epi8(pb, zero)), hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(pa, zero), _mm256_unpackhi_epi8(pb, zero));
+			const __m256i squares = _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi));
+			acc = _mm256_add_epi64(acc, _mm256_add_epi64(_mm256_unpacklo_epi32(squares, zero), _mm256_unpackhi_epi32(squares, zero)));
+		}
+		alignas(16) uint64_t lanes[2];
+		_mm_store_si128(reinterpret_cast<__m128i *>(lanes), _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+		sum += lanes[0] + lanes[1];
+		return x;
+	}
+
+	// PackBlocks() within 128 bit lanes, unpack order keeps blocks in sequence
+	TARGET("avx2") inline __m256i PackBlocks(__m256i lo, __m256i hi) noexcept
+	{
+		lo = _mm256_shuffle_epi32(_mm256_add_epi32(lo, _mm256_srli_epi64(lo, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+		hi = _mm256_shuffle_epi32(_mm256_add_epi32(hi, _mm256_srli_epi64(hi, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+		return _mm256_unpacklo_epi64(lo, hi);
+	}
+
+	// 8 blocks (32 columns) per iteration
+	TARGET("avx2") unsigned int SumBlocksAVX2(const uint8_t *a, const uint8_t *b, ptrdiff_t stride, unsigned int blocks, BlockSums sums) noexcept
+	{
+		const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi16(1);
+		unsigned int block = 0;
+		for (; block + 8 <= blocks; block += 8)
+		{
+			__m256i sa[2] = { zero, zero }, sb[2] = { zero, zero }, saa[2] = { zero, zero }, sbb[2] = { zero, zero }, sab[2] = { zero, zero };
+			for (unsigned int y = 0; y < 4; y++)
+			{
+				const __m256i pa = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + y * stride + block * 4)), pb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + y * stride + block * 4));
+				const __m256i wa[2] = { _mm256_unpacklo_epi8(pa, zero), _mm256_unpackhi_epi8(pa, zero) }, wb[2] = { _mm256_unpacklo_epi8(pb, zero), _mm256_unpackhi_epi8(pb, zero) };
+				for (unsigned int half = 0; half < 2; half++)
+				{
+					sa[half] = _mm256_add_epi16(sa[half], wa[half]);
+					sb[half] = _mm256_add_epi16(sb[half], wb[half]);
+					saa[half] = _mm256_add_epi32(saa[half], _mm256_madd_epi16(wa[half], wa[half]));
+					sbb[half] = _mm256_add_epi32(sbb[half], _mm256_madd_epi16(wb[half], wb[half]));
+					sab[half] = _mm256_add_epi32(sab[half], _mm256_madd_epi16(wa[half], wb[half]));
+				}
+			}
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(sums[0] + block), PackBlocks(_mm256_madd_epi16(sa[0], ones), _mm256_madd_epi16(sa[1], ones)));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(sums[1] + block), PackBlocks(_mm256_madd_epi16(sb[0], ones), _mm256_madd_epi16(sb[1], ones)));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(sums[2] + block), PackBlocks(saa[0], saa[1]));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(sums[3] + block), PackBlocks(sbb[0], sbb[1]));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(sums[4] + block), PackBlocks(sab[0], sab[1]));
+		}
+		return block;
+	}
+#pragma endregion
+
+#pragma region AVX-512
+#if defined __GNUC__ && !defined __clang__
+#	pragma GCC diagnostic push
+#	pragma GCC diagnostic ignored "-Wmaybe-uninitialized"	// false positive inside GCC 12 avx512fintrin.h shifts
+#endif
+	TARGET("avx512f") inline __m512i Div1023(__m512i x) noexcept
+	{
+		return _mm512_srli_epi32(_mm512_add_epi32(_mm512_add_epi32(x, _mm512_srli_epi32(x, 10)), _mm512_add_epi32(_mm512_srli_epi32(x, 20), _mm512_set1_epi32(1))), 10);
+	}
+
+	TARGET("avx512f") inline __m512i Unorm10To8(__m512i v) noexcept
+	{
+		return Div1023(_mm512_add_epi32(_mm512_sub_epi32(_mm512_slli_epi32(v, 8), v), _mm512_set1_epi32(511)));
+	}
+
+	TARGET("avx512f") inline __m512i Unorm10To16(__m512i v) noexcept
+	{
+		return Div1023(_mm512_add_epi32(_mm512_sub_epi32(_mm512_slli_epi32(v, 16), v), _mm512_set1_epi32(511)));
+	}
+
+	// 16 pixels per iteration, AVX-512F only (16 bit multiply would require BW)
+	struct ChannelsAVX512
+	{
+		__m512i r, g, b, a;
+
+		TARGET("avx512f") explicit ChannelsAVX512(const void *src) noexcept
+		{
+			const __m512i pixels = _mm512_loadu_si512(src), mask = _mm512_set1_epi32(0x3FF);
+			r = _mm512_and_si512(pixels, mask);
+			g = _mm512_and_si512(_mm512_srli_epi32(pixels, 10), mask);
+			b = _mm512_and_si512(_mm512_srli_epi32(pixels, 20), mask);
+			a = _mm512_srli_epi32(pixels, 30);
+		}
+	};
+
+	TARGET("avx512f") unsigned int ToB8G8R8A8AVX512(const uint32_t *src, uint32_t *dst, unsigned int width) noexcept
+	{
+		unsigned int x = 0;
+		for (; x + 16 <= width; x += 16)
+		{
+			const ChannelsAVX512 channels(src + x);
+			const __m512i alpha = _mm512_mullo_epi32(channels.a, _mm512_set1_epi32(0x55));
+			const __m512i result = _mm512_or_si512(
+				_mm512_or_si512(Unorm10To8(channels.b), _mm512_slli_epi32(Unorm10To8(channels.g), 8)),
+				_mm512_or_si512(_mm512_slli_epi32(Unorm10To8(channels.r), 16), _mm512_slli_epi32(alpha, 24)));
+			_mm512_storeu_si512(dst + x, result);
+		}
+		return x;
+	}
+
+	TARGET("avx512f") unsigned int ToR16G16B16A16AVX512(const uint32_t *src, uint64_t *dst, unsigned int width) noexcept
+	{
+		unsigned int x = 0;
+		for (; x + 16 <= width; x += 16)
+		{
+			const ChannelsAVX512 channels(src + x);
+			const __m512i alpha = _mm512_mullo_epi32(channels.a, _mm512_set1_epi32(0x5555));
+			const __m512i rg = _mm512_or_si512(Unorm10To16(channels.r), _mm512_slli_epi32(Unorm10To16(channels.g), 16));
+			const __m512i ba = _mm512_or_si512(Unorm10To16(channels.b), _mm512_slli_epi32(alpha, 16));
+			// lo = pixels 0, 1, 4, 5, 8, 9, 12, 13, hi = 2, 3, 6, 7, 10, 11, 14, 15
+			const __m512i lo = _mm512_unpacklo_epi32(rg, ba), hi = _mm512_unpackhi_epi32(rg, ba);
+			_mm512_storeu_si512(dst + x, _mm512_permutex2var_epi64(lo, _mm512_set_epi64(11, 10, 3, 2, 9, 8, 1, 0), hi));
+			_mm512_storeu_si512(dst + x + 8, _mm512_permutex2var_epi64(lo, _mm512_set_epi64(15, 14, 7, 6, 13, 12, 5, 4), hi));
+		}
+		return x;
+	}
+#if defined __GNUC__ && !defined __clang__
+#	pragma GCC diagnostic pop
+#endif
+#pragma endregion
+#endif
+
+	template<typename DstPixel, DstPixel ConvertPixel(uint32_t), unsigned int ConvertRow(const uint32_t *, DstPixel *, unsigned int) noexcept>
+	void ConvertImage(const Imaging::FrameData &src, void *dst, size_t dstStride) noexcept
+	{
+		assert(src.format == FrameFormat::R10G10B10A2);
+		for (unsigned int y = 0; y < src.height; y++)
+		{
+			const auto srcRow = reinterpret_cast<const uint32_t *>(static_cast<const uint8_t *>(src.pixels) + src.stride * y);
+			const auto dstRow = reinterpret_cast<DstPixel *>(static_cast<uint8_t *>(dst) + dstStride * y);
+			for (unsigned int x = ConvertRow(srcRow, dstRow, src.width); x < src.width; x++)
+				dstRow[x] = ConvertPixel(srcRow[x]);
+		}
+	}
+
+	template<unsigned int SquaredErrorRow(const uint8_t *, const uint8_t *, unsigned int, uint64_t &) noexcept>
+	uint64_t SquaredErrorImage(const uint8_t *a, const uint8_t *b, ptrdiff_t stride, unsigned int width, unsigned int height) noexcept
+	{
+		uint64_t sum = 0;
+		for (unsigned int y = 0; y < height; y++, a += stride, b += stride)
+			for (unsigned int x = SquaredErrorRow(a, b, width, sum); x < width; x++)
+			{
+				const int delta = int(a[x]) - int(b[x]);
+				sum += unsigned(delta * delta);
+			}
+		return sum;
+	}
+
+	// 8x8 windows at step 4 are 2x2 blocks of adjacent strips => every sample is summed once rather than 4 times
+	template<unsigned int SumBlocks(const uint8_t *, const uint8_t *, ptrdiff_t, unsigned int, BlockSums) noexcept>
+	double SSIMImage(const uint8_t *a, const uint8_t *b, ptrdiff_t stride, unsigned int width, unsigned int height)
+	{
+		constexpr double n = 8 * 8, c1 = (.01 * 255) * (.01 * 255), c2 = (.03 * 255) * (.03 * 255);
+		const unsigned int blocks = width / 4;
+		std::vector<uint32_t> storage(size_t(blocks) * 10);
+		uint32_t *prev[5], *cur[5];
+		for (unsigned int i = 0; i < 5; i++)
+			prev[i] = storage.data() + size_t(blocks) * i, cur[i] = storage.data() + size_t(blocks) * (5 + i);
+		const auto Strip = [&](unsigned int y, BlockSums sums)
+		{
+			const uint8_t *const rowA = a + y * stride, *const rowB = b + y * stride;
+			for (unsigned int block = SumBlocks(rowA, rowB, stride, blocks, sums); block < blocks; block++)
+				SumBlock(rowA, rowB, stride, block, sums);
+		};
+
+		double sum = 0;
+		unsigned int count = 0;
+		if (height >= 4)
+			Strip(0, prev);
+		for (unsigned int y = 4; y + 4 <= height; y += 4)
+		{
+			Strip(y, cur);
+			for (unsigned int block = 0; block + 1 < blocks; block++)
+			{
+				const auto Window = [&](unsigned int i) { return double(prev[i][block] + prev[i][block + 1] + cur[i][block] + cur[i][block + 1]); };
+				const double ma = Window(0) / n, mb = Window(1) / n, va = Window(2) / n - ma * ma, vb = Window(3) / n - mb * mb, cov = Window(4) / n - ma * mb;
+				sum += (2 * ma * mb + c1) * (2 * cov + c2) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+				count++;
+			}
+			std::swap(prev, cur);
+		}
+		return count ? sum / count : 1;
+	}
+
+	typedef void ConvertFunction(const Imaging::FrameData &src, void *dst, size_t dstStride) noexcept;
+	typedef uint64_t SquaredErrorFunction(const uint8_t *a, const uint8_t *b, ptrdiff_t stride, unsigned int width, unsigned int height) noexcept;
+	typedef double SSIMFunction(const uint8_t *a, const uint8_t *b, ptrdiff_t stride, unsigned int width, unsigned int height);
+	struct Kernels
+	{
+		ConvertFunction *toB8G8R8A8, *toR16G16B16A16;
+		SquaredErrorFunction *squaredError;
+		SSIMFunction *ssim;
+	};
+
+	// indexed by SIMDLevel, levels not compiled in fall back to best available one, metrics have no AVX-512 variant
+	const Kernels kernels[] =
+	{
+		{ ConvertImage<uint32_t, ToB8G8R8A8, ConvertRowScalar<uint32_t>>,		ConvertImage<uint64_t, ToR16G16B16A16, ConvertRowScalar<uint64_t>>,		SquaredErrorImage<SquaredErrorRowScalar>,	SSIMImage<SumBlocksScalar>	},
+#if ENABLE_SSE2
+		{ ConvertImage<uint32_t, ToB8G8R8A8, ToB8G8R8A8SSE2>,		ConvertImage<uint64_t, ToR16G16B16A16, ToR16G16B16A16SSE2>,		SquaredErrorImage<SquaredErrorRowSSE2>,	SSIMImage<SumBlocksSSE2>	},
+		{ ConvertImage<uint32_t, ToB8G8R8A8, ToB8G8R8A8AVX2>,		ConvertImage<uint64_t, ToR16G16B16A16, ToR16G16B16A16AVX2>,		SquaredErrorImage<SquaredErrorRowAVX2>,	SSIMImage<SumBlocksAVX2>	},
+		{ ConvertImage<uint32_t, ToB8G8R8A8, ToB8G8R8A8AVX512>,		ConvertImage<uint64_t, ToR16G16B16A16, ToR16G16B16A16AVX512>,	SquaredErrorImage<SquaredErrorRowAVX2>,	SSIMImage<SumBlocksAVX2>	},
+#endif
+	};
+
+	inline const Kernels &SelectKernels(Imaging::SIMDLevel level) noexcept
+	{
+		assert(level <= Imaging::HostSIMDLevel());
+		return kernels[std::min<size_t>((size_t)level, std::size(kernels) - 1)];
+	}
+
+	Imaging::SIMDLevel DetectSIMDLevel() noexcept
+	{
+		using Imaging::SIMDLevel;
+#if ENABLE_SSE2
+#	if defined _MSC_VER && !defined __clang__
+		int info[4];
+		__cpuid(info, 0);
+		const int maxLeaf = info[0];
+		__cpuid(info, 1);
+		constexpr int osxsave = 1 << 27, avx = 1 << 28;
+		if ((info[2] & (osxsave | avx)) != (osxsave | avx) || maxLeaf < 7)
+			return SIMDLevel::SSE2;
+		const auto xcr0 = _xgetbv(0);	// OS saves YMM (bits 1-2) and ZMM (bits 5-7) state
+		if ((xcr0 & 0x6) != 0x6)
+			return SIMDLevel::SSE2;
+		__cpuidex(info, 7, 0);
+		if (info[1] & 1 << 16 && (xcr0 & 0xE6) == 0xE6)
+			return SIMDLevel::AVX512;
+		return info[1] & 1 << 5 ? SIMDLevel::AVX2 : SIMDLevel::SSE2;
+#	else
+		__builtin_cpu_init();	// checks OS support as well
+		if (__builtin_cpu_supports("avx512f"))
+			return SIMDLevel::AVX512;
+		if (__builtin_cpu_supports("avx2"))
+			return SIMDLevel::AVX2;
+		return SIMDLevel::SSE2;
+#	endif
+#else
+		return SIMDLevel::Scalar;
+#endif
+	}
+}
+
+auto Imaging::HostSIMDLevel() noexcept -> SIMDLevel
+{
+	static const SIMDLevel level = DetectSIMDLevel();
+	return level;
+}
+
+void Imaging::ConvertToB8G8R8A8(const FrameData &src, void *dst, size_t dstStride, SIMDLevel level) noexcept
+{
+	SelectKernels(level).toB8G8R8A8(src, dst, dstStride);
+}
+
+void Imaging::ConvertToR16G16B16A16(const FrameData &src, void *dst, size_t dstStride, SIMDLevel level) noexcept
+{
+	SelectKernels(level).toR16G16B16A16(src, dst, dstStride);
+}
+
+uint64_t Imaging::SquaredError(const uint8_t *a, const uint8_t *b, ptrdiff_t stride, unsigned int width, unsigned int height, SIMDLevel level) noexcept
+{
+	return SelectKernels(level).squaredError(a, b, stride, width, height);
+}
+
+double Imaging::SSIM(const uint8_t *a, const uint8_t *b, ptrdiff_t stride, unsigned int width, unsigned int height, SIMDLevel level)
+{
+	return SelectKernels(level).ssim(a, b, stride, width, height);
+}
+
+// interleaved partial histograms avoid store-to-load stalls on runs of equal samples
+void Imaging::LumaHistogram(const void *plane, ptrdiff_t stride, unsigned int width, unsigned int height, bool deep, uint32_t (&bins)[lumaBins]) noexcept
+{
+	uint32_t partial[4][lumaBins] = {};
+	const auto Accumulate = [&](const auto *row, unsigned int shift)
+	{
+		// mask keeps out of range 10 bit samples in bounds
+		const auto Bin = [=](unsigned int sample) { return sample >> shift & (lumaBins - 1); };
+		unsigned int x = 0;
+		for (; x + 8 <= width; x += 8)
+		{
+			partial[0][Bin(row[x])]++;
+			partial[1][Bin(row[x + 2])]++;
+			partial[2][Bin(row[x + 4])]++;
+			partial[3][Bin(row[x + 6])]++;
+		}
+		for (; x < width; x += 2)
+			partial[0][Bin(row[x])]++;
+	};
+	for (unsigned int y = 0; y < height; y += 2)
+	{
+		const auto row = static_cast<const uint8_t *>(plane) + y * stride;
+		if (deep)
+			Accumulate(reinterpret_cast<const uint16_t *>(row), 4);
+		else
+			Accumulate(row, 2);
+	}
+	for (unsigned int bin = 0; bin < lumaBins; bin++)
+		bins[bin] = partial[0][bin] + partial[1][bin] + partial[2][bin] + partial[3][bin];
+}
+#pragma endregion
+
+
+#pragma region Save
+namespace
+{
+	struct ContextDeleter
+	{
+		void operator ()(AVCodecContext *context) const { avcodec_free_context(&context); }
+	};
+	struct FrameDeleter
+	{
+		void operator ()(AVFrame *frame) const { av_frame_free(&frame); }
+	};
+	struct PacketDeleter
+	{
+		void operator ()(AVPacket *packet) const { av_packet_free(&packet); }
+	};
+
+	std::runtime_error AVError(const char prefix[], int error)
+	{
+		char buf[AV_ERROR_MAX_STRING_SIZE];
+		av_strerror(error, buf, sizeof buf);
+		return std::runtime_error(std::string(prefix) + ": " + buf);
+	}
+
+	std::ofstream Create(const std::filesystem::path &filename)
+	{
+		std::ofstream file(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!file)
+			throw std::runtime_error("Fail to create file");
+		return file;
+	}
+
+	void Close(std::ofstream &file)
+	{
+		file.close();
+		if (!file)
+			throw std::runtime_error("Fail to write file");
+	}
+
+	// legacy header for B8G8R8A8, DX10 extension for R10G10B10A2 to avoid ambiguous A2B10G10R10 masks
+	void SaveDDS(const Imaging::FrameData &frame, const std::filesystem::path &filename)
+	{
+		struct Header
+		{
+			uint32_t magic, size, flags, height, width, pitch, depth, mipMapCount, reserved1[11];
+			struct
+			{
+				uint32_t size, flags, fourCC, rgbBitCount, rBitMask, gBitMask, bBitMask, aBitMask;
+			} pixelFormat;
+			uint32_t caps, caps2, caps3, caps4, reserved2;
+		} header{ 0x20534444 /*"DDS "*/, 124, 0x100F /*CAPS | HEIGHT | WIDTH | PITCH | PIXELFORMAT*/, frame.height, frame.width, frame.width * 4u, 0, 0, {}, { 32 } };
+		struct HeaderDX10
+		{
+			uint32_t dxgiFormat, resourceDimension, miscFlag, arraySize, miscFlags2;
+		};
+		static constexpr HeaderDX10 headerDX10{ 24 /*DXGI_FORMAT_R10G10B10A2_UNORM*/, 3 /*TEXTURE2D*/, 0, 1, 0 };
+		static_assert(sizeof(Header) == 128 && sizeof(HeaderDX10) == 20, "DDS header layout mismatch");
+
+		header.caps = 0x1000;	// TEXTURE
+		switch (frame.format)
+		{
+		case FrameFormat::B8G8R8A8:
+			header.pixelFormat = { 32, 0x41 /*RGB | ALPHAPIXELS*/, 0, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000 };
+			break;
+		case FrameFormat::R10G10B10A2:
+			header.pixelFormat = { 32, 0x4 /*FOURCC*/, 0x30315844 /*"DX10"*/ };
+			break;
+		default:
+			throw std::logic_error("Invalid frame format");
+		}
+
+		auto file = Create(filename);
+		file.write(reinterpret_cast<const char *>(&header), sizeof header);
+		if (frame.format == FrameFormat::R10G10B10A2)
+			file.write(reinterpret_cast<const char *>(&headerDX10), sizeof headerDX10);
+		for (unsigned int y = 0; y < frame.height; y++)
+			file.write(static_cast<const char *>(frame.pixels) + frame.stride * y, header.pitch);
+		Close(file);
+	}
+}
+
+void Imaging::Save(const FrameData &frame, Codec codec, const std::filesystem::path &filename, SIMDLevel level)
+{
+	static constexpr AVCodecID codecIDs[] = { AV_CODEC_ID_BMP, AV_CODEC_ID_MJPEG, AV_CODEC_ID_PNG, AV_CODEC_ID_TIFF, AV_CODEC_ID_TARGA };
+	if (codec == Codec::DDS)
+		return SaveDDS(frame, filename);
+
+	const AVCodec *const encoder = avcodec_find_encoder(codecIDs[(unsigned int)codec]);
+	if (!encoder)
+		throw std::runtime_error("Image encoder is not available");
+
+	// 10 bit source goes through 16 bit intermediate so that PNG/TIFF keep full precision
+	const uint8_t *srcPixels = static_cast<const uint8_t *>(frame.pixels);
+	int srcStride = frame.stride;
+	AVPixelFormat srcFormat = AV_PIX_FMT_BGRA;
+	std::vector<uint8_t> converted;
+	if (frame.format == FrameFormat::R10G10B10A2)
+	{
+		srcStride = frame.width * 8;
+		converted.resize(size_t(srcStride) * frame.height);
+		ConvertToR16G16B16A16(frame, converted.data(), srcStride, level);
+		srcPixels = converted.data();
+		srcFormat = AV_PIX_FMT_RGBA64;
+	}
+
+	const std::unique_ptr<AVCodecContext, ContextDeleter> context(avcodec_alloc_context3(encoder));
+	const std::unique_ptr<AVFrame, FrameDeleter> image(av_frame_alloc());
+	const std::unique_ptr<AVPacket, PacketDeleter> packet(av_packet_alloc());
+	if (!context || !image || !packet)
+		throw std::bad_alloc();
+	context->width = image->width = frame.width;
+	context->height = image->height = frame.height;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100)
+	const void *pixFormats = NULL;
+	avcodec_get_supported_config(NULL, encoder, AV_CODEC_CONFIG_PIX_FORMAT, 0, &pixFormats, NULL);
+#else
+	const void *const pixFormats = encoder->pix_fmts;
+#endif
+	context->pix_fmt = avcodec_find_best_pix_fmt_of_list(static_cast<const AVPixelFormat *>(pixFormats), srcFormat, 1, NULL);
+	context->time_base = { 1, 1 };
+	image->format = context->pix_fmt;
+	if (const int result = avcodec_open2(context.get(), encoder, NULL))
+		throw AVError("Fail to open image encoder", result);
+	if (const int result = av_frame_get_buffer(image.get(), 0))
+		throw AVError("Fail to allocate image", result);
+
+	const std::unique_ptr<SwsContext, void (*)(SwsContext *)> cvtCtx(sws_getContext(frame.width, frame.height, srcFormat,
+		frame.width, frame.height, context->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL), sws_freeContext);
+	if (!cvtCtx)
+		throw std::runtime_error("Fail to convert image");
+	sws_scale(cvtCtx.get(), &srcPixels, &srcStride, 0, frame.height, image->data, image->linesize);
+
+	int result = avcodec_send_frame(context.get(), image.get());
+	if (result == 0)
+		result = avcodec_send_frame(context.get(), NULL);
+	if (result < 0)
+		throw AVError("Fail to encode image", result);
+	auto file = Create(filename);
+	while ((result = avcodec_receive_packet(context.get(), packet.get())) == 0)
+	{
+		file.write(reinterpret_cast<const char *>(packet->data), packet->size);
+		av_packet_unref(packet.get());
+	}
+	if (result != AVERROR_EOF)
+		throw AVError("Fail to encode image", result);
+	Close(file);
+}
+#pragma endregion
@@ -0,0 +1,395 @@
+#include "Spool.h"
+#include <system_error>
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include <cassert>
+#include <cstring>
+extern "C"
+{
+#	include <libavutil/frame.h>
+#	include <libavutil/imgutils.h>
+}
+#ifdef _WIN32
+#	define NOMINMAX
+#	define WIN32_LEAN_AND_MEAN
+#	include <Windows.h>
+#else
+#	include <cerrno>
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#endif
+
+using namespace Spool;
+
+static constexpr size_t alignment = 64;
+
+static inline size_t Align(size_t size) noexcept
+{
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Y, U, V of 4:2:0 image, returns total size
+static size_t GetPlaneSizes(unsigned int width, unsigned int height, Format format, size_t (&rowSizes)[3], size_t (&planeSizes)[3])
+{
+	size_t bytesPerSample;
+	switch (format)
+	{
+	case Format::_8bit:
+		bytesPerSample = 1;
+		break;
+	case Format::_10bit:
+		bytesPerSample = 2;
+		break;
+	default:
+		throw std::invalid_argument("invalid spool format");
+	}
+	rowSizes[0] = width * bytesPerSample;
+	planeSizes[0] = rowSizes[0] * height;
+	rowSizes[1] = rowSizes[2] = width / 2 * bytesPerSample;
+	planeSizes[1] = planeSizes[2] = rowSizes[1] * (height / 2);
+	return planeSizes[0] + planeSizes[1] + planeSizes[2];
+}
+
+static void WriteRecord(uint8_t *record, const AVFrame &frame, int64_t pts, unsigned int repeats, uint32_t flags, const size_t (&rowSizes)[3], const size_t (&planeSizes)[3]) noexcept
+{
+	const RecordHeader recordHeader = { pts, repeats, flags };
+	std::memcpy(record, &recordHeader, sizeof recordHeader);
+	record += sizeof recordHeader;
+	for (unsigned int plane = 0; plane < std::size(planeSizes); plane++)
+	{
+		av_image_copy_plane(record, int(rowSizes[plane]), frame.data[plane], frame.linesize[plane], int(rowSizes[plane]), int(planeSizes[plane] / rowSizes[plane]));
+		record += planeSizes[plane];
+	}
+}
+
+static void ReadRecord(const uint8_t *record, AVFrame &frame, const size_t (&rowSizes)[3], const size_t (&planeSizes)[3]) noexcept
+{
+	record += sizeof(RecordHeader);
+	for (unsigned int plane = 0; plane < std::size(planeSizes); plane++)
+	{
+		av_image_copy_plane(frame.data[plane], frame.linesize[plane], record, int(rowSizes[plane]), int(rowSizes[plane]), int(planeSizes[plane] / rowSizes[plane]));
+		record += planeSizes[plane];
+	}
+}
+
+#pragma region CMapping
+#ifdef _WIN32
+CMapping::CMapping(const std::filesystem::path &filename, bool writable) : writable(writable)
+{
+	file = CreateFileW(filename.c_str(), writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+		writable ? CREATE_ALWAYS : OPEN_EXISTING, writable ? FILE_ATTRIBUTE_NORMAL : FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::system_error(GetLastError(), std::system_category(), "Fail to open spool file");
+	if (!writable)
+	{
+		try
+		{
+			LARGE_INTEGER fileSize;
+			if (!GetFileSizeEx(file, &fileSize))
+				throw std::system_error(GetLastError(), std::system_category(), "Fail to get spool file size");
+			size = fileSize.QuadPart;
+			if (size)
+				data = Map(size, mapping);
+		}
+		catch (...)
+		{
+			CloseHandle(file);
+			throw;
+		}
+	}
+}
+
+CMapping::~CMapping()
+{
+	Unmap();
+	CloseHandle(file);
+}
+
+// writable mapping grows file to mapping size
+uint8_t *CMapping::Map(size_t size, void *&mapping) const
+{
+	mapping = CreateFileMappingW(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, DWORD(uint64_t(size) >> 32), DWORD(size), NULL);
+	if (!mapping)
+		throw std::system_error(GetLastError(), std::system_category(), "Fail to map spool file");
+	const auto view = static_cast<uint8_t *>(MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size));
+	if (!view)
+	{
+		const auto error = GetLastError();
+		CloseHandle(mapping);
+		throw std::system_error(error, std::system_category(), "Fail to map spool file");
+	}
+	return view;
+}
+
+void CMapping::Unmap() noexcept
+{
+	if (data)
+	{
+		UnmapViewOfFile(data);
+		data = nullptr;
+	}
+	if (mapping)
+	{
+		CloseHandle(mapping);
+		mapping = nullptr;
+	}
+}
+
+// mapped file can not be truncated => shrink unmaps first, growth maps new view before releasing old one
+void CMapping::Resize(size_t size)
+{
+	assert(writable);
+	if (size < this->size)
+	{
+		Unmap();
+		this->size = 0;
+		LARGE_INTEGER pos;
+		pos.QuadPart = size;
+		if (!SetFilePointerEx(file, pos, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+			throw std::system_error(GetLastError(), std::system_category(), "Fail to resize spool file");
+	}
+	void *newMapping = nullptr;
+	uint8_t *const view = size ? Map(size, newMapping) : nullptr;
+	Unmap();
+	mapping = newMapping;
+	data = view;
+	this->size = size;
+}
+#else
+CMapping::CMapping(const std::filesystem::path &filename, bool writable) : writable(writable)
+{
+	file = open(filename.c_str(), writable ? O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+	if (file < 0)
+		throw std::system_error(errno, std::generic_category(), "Fail to open spool file");
+	if (!writable)
+	{
+		try
+		{
+			struct stat fileStat;
+			if (fstat(file, &fileStat))
+				throw std::system_error(errno, std::generic_category(), "Fail to get spool file size");
+			size = fileStat.st_size;
+			if (size)
+				data = Map(size);
+		}
+		catch (...)
+		{
+			close(file);
+			throw;
+		}
+	}
+}
+
+CMapping::~CMapping()
+{
+	Unmap();
+	close(file);
+}
+
+uint8_t *CMapping::Map(size_t size) const
+{
+	void *const view = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+	if (view == MAP_FAILED)
+		throw std::system_error(errno, std::generic_category(), "Fail to map spool file");
+	if (!writable)
+		posix_madvise(view, size, POSIX_MADV_SEQUENTIAL);	// replay reads records in order
+	return static_cast<uint8_t *>(view);
+}
+
+void CMapping::Unmap() noexcept
+{
+	if (data)
+	{
+		munmap(data, size);
+		data = nullptr;
+	}
+}
+
+// new view is mapped before old one is released => failed growth leaves mapping intact
+void CMapping::Resize(size_t size)
+{
+	assert(writable);
+	if (ftruncate(file, size))
+		throw std::system_error(errno, std::generic_category(), "Fail to resize spool file");
+	uint8_t *const view = size ? Map(size) : nullptr;
+	Unmap();
+	data = view;
+	this->size = size;
+}
+#endif
+#pragma endregion
+
+#pragma region CSpoolWriter
+CVideoRecorder::CSpoolWriter::CSpoolWriter(const std::filesystem::path &filename, unsigned int width, unsigned int height, Format format, FPS fps) :
+	mapping(filename, true)
+{
+	recordSize = Align(sizeof(RecordHeader) + GetPlaneSizes(width, height, format, rowSizes, planeSizes));
+	mapping.Resize(sizeof(Header));
+
+	Header &header = GetHeader();
+	std::memcpy(header.magic, magic, sizeof magic);
+	header.version = version;
+	header.headerSize = sizeof(Header);
+	header.recordSize = recordSize;
+	header.width = width;
+	header.height = height;
+	header.format = uint32_t(format);
+	header.fps = uint32_t(fps);
+}
+
+void CVideoRecorder::CSpoolWriter::Append(const AVFrame &frame, int64_t pts, unsigned int repeats)
+{
+	assert(repeats);
+	const uint64_t frameCount = GetHeader().frameCount;
+	if (frameCount == capacity)
+	{
+		// mapping moves on growth => grow geometrically to keep remaps rare, excess is trimmed by Finish()
+		const auto newCapacity = capacity + capacity / 2 + 16;
+		mapping.Resize(sizeof(Header) + newCapacity * recordSize);
+		capacity = newCapacity;
+	}
+	index.push_back(pts);
+	WriteRecord(mapping.Data() + sizeof(Header) + frameCount * recordSize, frame, pts, repeats, 0, rowSizes, planeSizes);
+
+	// record is complete => make it visible to reader of unfinished spool
+	GetHeader().frameCount = frameCount + 1;
+}
+
+void CVideoRecorder::CSpoolWriter::Finish()
+{
+	const uint64_t frameCount = GetHeader().frameCount;
+	const size_t indexOffset = sizeof(Header) + frameCount * recordSize;
+	mapping.Resize(indexOffset + frameCount * sizeof(int64_t));
+	std::memcpy(mapping.Data() + indexOffset, index.data(), frameCount * sizeof(int64_t));
+	GetHeader().indexOffset = indexOffset;
+}
+#pragma endregion
+
+#pragma region CSpoolReader
+CVideoRecorder::CSpoolReader::CSpoolReader(const std::filesystem::path &filename) : mapping(filename, false)
+{
+	if (mapping.Size() < sizeof(Header) || std::memcmp(GetHeader().magic, magic, sizeof magic) != 0)
+		throw std::runtime_error("not a spool file");
+	const Header &header = GetHeader();
+	if (header.version != version)
+		throw std::runtime_error("unsupported spool version");
+	switch (FPS(header.fps))
+	{
+	case FPS::_25:
+	case FPS::_30:
+	case FPS::_60:
+		break;
+	default:
+		throw std::runtime_error("corrupted spool header");
+	}
+	if (header.headerSize < sizeof(Header) || !header.width || !header.height || header.width % 2 || header.height % 2 ||
+		header.recordSize < sizeof(RecordHeader) + GetPlaneSizes(header.width, header.height, Format(header.format), rowSizes, planeSizes) ||
+		header.headerSize > mapping.Size() || header.frameCount > (mapping.Size() - header.headerSize) / header.recordSize)
+		throw std::runtime_error("corrupted spool header");
+
+	if (header.indexOffset)
+	{
+		const uint64_t recordsEnd = header.headerSize + header.frameCount * header.recordSize;
+		if (header.indexOffset < recordsEnd || header.indexOffset % alignof(int64_t) || header.frameCount > (mapping.Size() - header.indexOffset) / sizeof(int64_t))
+			throw std::runtime_error("corrupted spool index");
+		index = reinterpret_cast<const int64_t *>(mapping.Data() + header.indexOffset);
+	}
+	else
+	{
+		// unfinished spool (writer terminated)
+		rebuiltIndex.reserve(header.frameCount);
+		for (uint_least64_t idx = 0; idx < header.frameCount; idx++)
+			rebuiltIndex.push_back((*this)[idx].pts);
+		index = rebuiltIndex.data();
+	}
+}
+
+auto CVideoRecorder::CSpoolReader::Find(int64_t pts) const noexcept -> uint_least64_t
+{
+	const auto end = index + Size();
+	const auto next = std::upper_bound(index, end, pts);
+	if (next == index)
+		return Size();
+	const uint_least64_t idx = std::prev(next) - index;
+	return pts < (*this)[idx].pts + (*this)[idx].repeats ? idx : Size();
+}
+
+void CVideoRecorder::CSpoolReader::CopyTo(uint_least64_t idx, AVFrame &frame) const noexcept
+{
+	ReadRecord(GetRecord(idx), frame, rowSizes, planeSizes);
+}
+#pragma endregion
+
+#pragma region CSpill
+CVideoRecorder::CSpill::CRemover::~CRemover()
+{
+	std::error_code error;
+	std::filesystem::remove(filename, error);
+}
+
+CVideoRecorder::CSpill::CSpill(const std::filesystem::path &filename, unsigned int width, unsigned int height, Format format, unsigned int depth, size_t maxBytes) :
+	remover{ filename }, mapping(filename, true), depth(depth)
+{
+	recordSize = Align(sizeof(RecordHeader) + GetPlaneSizes(width, height, format, rowSizes, planeSizes));
+	maxCapacity = std::max<uint_least64_t>(maxBytes / recordSize, 1);
+}
+
+void CVideoRecorder::CSpill::Push(const AVFrame &frame, int64_t pts, unsigned int repeats, uint32_t flags)
+{
+	assert(repeats);
+	if (count == capacity)
+	{
+		if (Full())
+			throw std::length_error("spill file size limit reached");
+		const auto newCapacity = std::min(capacity + capacity / 2 + 16, maxCapacity);
+		mapping.Resize(newCapacity * recordSize);
+		// wrapped records at file start stay, ones from head to old end move to new end
+		if (head)
+		{
+			const auto growth = newCapacity - capacity;
+			std::memmove(mapping.Data() + (head + growth) * recordSize, mapping.Data() + head * recordSize, (capacity - head) * recordSize);
+			head += growth;
+		}
+		capacity = newCapacity;
+	}
+	WriteRecord(GetRecord(count), frame, pts, repeats, flags, rowSizes, planeSizes);
+	count++;
+	pendingFrames += repeats;
+}
+
+void CVideoRecorder::CSpill::Repeat(unsigned int repeats) noexcept
+{
+	assert(!Empty());
+	uint8_t *const record = GetRecord(count - 1);
+	RecordHeader recordHeader;
+	std::memcpy(&recordHeader, record, sizeof recordHeader);
+	recordHeader.repeats += repeats;
+	std::memcpy(record, &recordHeader, sizeof recordHeader);
+	pendingFrames += repeats;
+}
+
+auto CVideoRecorder::CSpill::Front(AVFrame &frame) const noexcept -> RecordHeader
+{
+	assert(!Empty());
+	const uint8_t *const record = GetRecord(0);
+	ReadRecord(record, frame, rowSizes, planeSizes);
+	RecordHeader recordHeader;
+	std::memcpy(&recordHeader, record, sizeof recordHeader);
+	return recordHeader;
+}
+
+void CVideoRecorder::CSpill::Pop() noexcept
+{
+	assert(!Empty());
+	RecordHeader recordHeader;
+	std::memcpy(&recordHeader, GetRecord(0), sizeof recordHeader);
+	pendingFrames -= recordHeader.repeats;
+	head = (head + 1) % capacity;
+	// restart from file start once backlog is gone => fewer pages touched
+	if (!--count)
+		head = 0;
+}
+#pragma endregion
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <filesystem>
+#include "VideoRecorder/include/VideoRecorder.h"
+
+/*
+	raw capture spool ("record now, encode later"), written by StartSpool() session and replayed by EncodeSpool()
+
+	file layout (little endian, sections start at 64 byte boundary):
+		Header			64 bytes
+		records			Header::frameCount fixed size records of Header::recordSize bytes:
+							RecordHeader followed by Y, U, V planes of 4:2:0 image, rows tightly packed,
+							1 byte per sample for 8 bit format, 2 bytes (10 significant bits) for 10 bit one
+		index			Header::frameCount int64 pts of records, present once spool is finished (Header::indexOffset != 0)
+
+	record i lives at Header::headerSize + i * Header::recordSize => seek by record number is direct, seek by pts (EncodeSpool() range start) is binary search over index
+	pts is in 1/fps units starting at 0, record covers [pts, pts + repeats) video frames (slots missed by application are stored once)
+	Header::frameCount is bumped only after record is complete => spool of terminated application is readable up to last complete record,
+	index is then rebuilt from record headers
+*/
+namespace Spool
+{
+	typedef CVideoRecorder::Format Format;
+	typedef CVideoRecorder::FPS FPS;
+
+	constexpr char magic[8] = { 'V', 'R', 'S', 'P', 'O', 'O', 'L', '\0' };
+	constexpr uint32_t version = 1;
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version, headerSize, recordSize;
+		uint32_t width, height;		// even
+		uint32_t format;			// Format
+		uint32_t fps;
+		uint32_t reserved;
+		uint64_t frameCount;		// complete records
+		uint64_t indexOffset;		// 0 while spool is being written
+		uint8_t padding[8];
+	};
+	static_assert(sizeof(Header) == 64, "spool header layout");
+
+	struct RecordHeader
+	{
+		int64_t pts;
+		uint32_t repeats;
+		uint32_t flags;	// 0 in spool files
+	};
+	constexpr uint32_t forceKeyframe = 1;	// RecordHeader::flags of spilled scene cut
+	static_assert(sizeof(RecordHeader) == 16, "spool record header layout");
+
+	// read-only or read/write mapping of whole file, writable one can be resized (file is resized accordingly, mapping moves)
+	class CMapping
+	{
+#ifdef _WIN32
+		void *file, *mapping = nullptr;	// HANDLE
+#else
+		int file;
+#endif
+		uint8_t *data = nullptr;
+		size_t size = 0;
+		const bool writable;
+
+	private:
+#ifdef _WIN32
+		uint8_t *Map(size_t size, void *&mapping) const;
+#else
+		uint8_t *Map(size_t size) const;
+#endif
+		void Unmap() noexcept;
+
+	public:
+		// writable mapping creates (truncates) file, read-only one maps it as is, both throw std::system_error
+		CMapping(const std::filesystem::path &filename, bool writable);
+		CMapping(CMapping &) = delete;
+		void operator =(CMapping &) = delete;
+		~CMapping();
+
+	public:
+		uint8_t *Data() const noexcept { return data; }
+		size_t Size() const noexcept { return size; }
+		void Resize(size_t size);	// failed growth leaves mapping intact, failed shrink may leave it empty
+	};
+}
+
+// destroyed without Finish() leaves unfinished spool (complete records, no index)
+class CVideoRecorder::CSpoolWriter
+{
+	Spool::CMapping mapping;
+	size_t planeSizes[3], rowSizes[3], recordSize;
+	uint_least64_t capacity = 0;	// records
+	std::vector<int64_t> index;
+
+private:
+	Spool::Header &GetHeader() const noexcept { return *reinterpret_cast<Spool::Header *>(mapping.Data()); }
+
+public:
+	// throws std::exception
+	CSpoolWriter(const std::filesystem::path &filename, unsigned int width, unsigned int height, Format format, FPS fps);
+
+public:
+	size_t RecordSize() const noexcept { return recordSize; }
+	// frame should match spool dimensions and format, throws std::exception
+	void Append(const struct AVFrame &frame, int64_t pts, unsigned int repeats);
+	// writes index and trims file, throws std::exception
+	void Finish();
+};
+
+class CVideoRecorder::CSpoolReader
+{
+	Spool::CMapping mapping;
+	size_t planeSizes[3], rowSizes[3];
+	std::vector<int64_t> rebuiltIndex;	// for unfinished spool only
+	const int64_t *index;
+
+private:
+	const Spool::Header &GetHeader() const noexcept { return *reinterpret_cast<const Spool::Header *>(mapping.Data()); }
+	const uint8_t *GetRecord(uint_least64_t idx) const noexcept { return mapping.Data() + GetHeader().headerSize + idx * GetHeader().recordSize; }
+
+public:
+	// validates header and record area, throws std::exception
+	explicit CSpoolReader(const std::filesystem::path &filename);
+
+public:
+	unsigned int GetWidth() const noexcept { return GetHeader().width; }
+	unsigned int GetHeight() const noexcept { return GetHeader().height; }
+	Format GetFormat() const noexcept { return Format(GetHeader().format); }
+	FPS GetFPS() const noexcept { return FPS(GetHeader().fps); }
+	uint_least64_t Size() const noexcept { return GetHeader().frameCount; }
+	bool Finished() const noexcept { return GetHeader().indexOffset; }
+	const Spool::RecordHeader &operator [](uint_least64_t idx) const noexcept { return *reinterpret_cast<const Spool::RecordHeader *>(GetRecord(idx)); }
+	// record covering pts, Size() if none
+	uint_least64_t Find(int64_t pts) const noexcept;
+	// frame should be writable and match spool dimensions and format
+	void CopyTo(uint_least64_t idx, struct AVFrame &frame) const noexcept;
+};
+
+/*
+	FIFO of frames parked in scratch file while encoder falls behind, records are laid out as in spool (no header, no index, flags may be set), file is removed on destruction
+	records are stored uncompressed on purpose: spill is written by worker thread exactly when it has no CPU time to spare (encoder behind),
+	4:2:0 already stores 1.5 bytes per pixel instead of 4 of application frame and fixed record size keeps ring addressing direct,
+	mapped scratch file is backed by page cache => its size costs disk/page cache rather than tracked heap memory
+	file is ring of records which grows only when full and never beyond maxBytes => sustained partial backlog reuses space instead of growing file
+*/
+class CVideoRecorder::CSpill
+{
+	typedef Spool::RecordHeader RecordHeader;
+
+	struct CRemover
+	{
+		const std::filesystem::path filename;
+		~CRemover();
+	} remover;	// after mapping is released
+	Spool::CMapping mapping;
+	size_t planeSizes[3], rowSizes[3], recordSize;
+	uint_least64_t head = 0, count = 0, capacity = 0;	// records, oldest one at head, ring wraps at capacity
+	uint_least64_t maxCapacity;	// records
+	uint_least64_t pendingFrames = 0;	// sum of repeats
+	const unsigned int depth;
+
+private:
+	uint8_t *GetRecord(uint_least64_t idx) const noexcept { return mapping.Data() + (head + idx) % capacity * recordSize; }
+
+public:
+	// at least single record fits regardless of maxBytes, throws std::exception
+	CSpill(const std::filesystem::path &filename, unsigned int width, unsigned int height, Format format, unsigned int depth, size_t maxBytes);
+
+public:
+	unsigned int Depth() const noexcept { return depth; }	// spill threshold (queued frames)
+	bool Empty() const noexcept { return !count; }
+	bool Full() const noexcept { return count == maxCapacity; }	// size cap reached, Push() would fail
+	uint_least64_t PendingFrames() const noexcept { return pendingFrames; }
+	// frame should match spill dimensions and format, throws std::exception leaving spill unchanged
+	void Push(const struct AVFrame &frame, int64_t pts, unsigned int repeats, uint32_t flags = 0);
+	// extends newest record by repeats, spill should not be empty
+	void Repeat(unsigned int repeats) noexcept;
+	// copies oldest record to writable frame
+	RecordHeader Front(struct AVFrame &frame) const noexcept;
+	void Pop() noexcept;
+};
@@ -1,15 +1,22 @@
 #define VIDEO_RECORDER_IMPLEMENTATION
 #include "VideoRecorder/include/VideoRecorder.h"
 #include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
 #include <locale>
 #include <codecvt>
 #include <filesystem>
 #include <algorithm>
 #include <iterator>
+#include <variant>
 #include <new>
 #include <cstdlib>
 #include <cassert>
+#include <climits>
 #include <cctype>
+#include <cwchar>
+#include <cstring>
 extern "C"
 {
 #	include <libavcodec/avcodec.h>
@@ -17,20 +24,327 @@ extern "C"
 #	include <libavformat/avformat.h>
 #	include <libavutil/imgutils.h>
 #	include <libavutil/opt.h>
+#	include <libavutil/cpu.h>
 }
-#include "DirectXTex.h"
+#include "Imaging.h"
+#include "Spool.h"
+#ifdef _WIN32
+#	include "DirectXTex.h"
+#else
+#	include <unistd.h>
+#endif
 
 #define ENABLE_10BIT_TARGET_FORMAT 0
 
-using std::wclog;
-using std::wcerr;
-using std::endl;
+#ifdef _MSC_VER
+#	define UNREACHABLE __assume(false)
+#else
+#	define UNREACHABLE __builtin_unreachable()
+#endif
+
+typedef CVideoRecorder::LogSeverity LogSeverity;
+
+#pragma region Log
+namespace
+{
+	/*
+		bounded MPSC ring (per-slot sequence numbers), producers never block: message is dropped if the ring is full
+		flood protection: per-severity GCRA rate limiter, suppressed messages are reported in summary
+	*/
+	class CLogger
+	{
+	public:
+		static constexpr unsigned int messageCapacity = 512;
+
+	private:
+		static constexpr unsigned int ringCapacity = 128, severityCount = (unsigned int)LogSeverity::Fatal + 1;
+		static constexpr std::chrono::steady_clock::duration rateInterval = std::chrono::milliseconds(100), rateBurst = std::chrono::seconds(2);	// 10 msg/s sustained, 20 msg burst
+		static_assert((ringCapacity & (ringCapacity - 1)) == 0, "ring capacity should be power of 2");
+
+		struct Slot
+		{
+			std::atomic<size_t> seq;
+			CVideoRecorder::LogRecord record;
+			wchar_t text[messageCapacity];
+		} slots[ringCapacity];
+		std::atomic<size_t> enqueuePos{};
+		size_t dequeuePos = 0;
+		std::atomic<std::chrono::steady_clock::rep> theoreticalArrival[severityCount]{};
+		std::atomic<unsigned int> suppressed{}, overflowed{};
+		std::atomic<LogSeverity> minSeverity{ LogSeverity::Info };
+
+		std::mutex drainMtx;	// held by consumer while passing messages to sink
+		CVideoRecorder::LogSink sink;
+		std::mutex wakeMtx;
+		std::condition_variable wakeEvent;
+		bool finish = false;
+		std::thread thread;
+
+	private:
+		CLogger();
+		~CLogger();
+
+	private:
+		static void DefaultSink(const CVideoRecorder::LogRecord &record);
+		void Emit(const CVideoRecorder::LogRecord &record) noexcept;
+		void Drain();
+		void Run();
+
+	public:
+		static CLogger &Instance();	// started on first use
+
+	public:
+		bool Admit(LogSeverity severity) noexcept;
+		void Push(LogSeverity severity, const wchar_t text[], unsigned int length) noexcept;
+		void Flush();
+		void SetSink(CVideoRecorder::LogSink &&sink);
+		void SetMinSeverity(LogSeverity severity) noexcept { minSeverity.store(severity, std::memory_order_relaxed); }
+	};
+
+	// formats message in place (no heap), submits it on destruction
+	class CLogMessage
+	{
+		const LogSeverity severity;
+		const bool admitted;
+		unsigned int length = 0;
+		wchar_t text[CLogger::messageCapacity];
+
+	private:
+		template<typename Value>
+		CLogMessage &Print(const wchar_t format[], Value value) noexcept;
+
+	public:
+		explicit CLogMessage(LogSeverity severity) noexcept : severity(severity), admitted(CLogger::Instance().Admit(severity)) { text[0] = L'\0'; }
+		CLogMessage(CLogMessage &) = delete;
+		void operator =(CLogMessage &) = delete;
+		~CLogMessage() { if (admitted) CLogger::Instance().Push(severity, text, length); }
+
+	public:
+		CLogMessage &operator <<(const char str[]) noexcept;
+		CLogMessage &operator <<(const wchar_t str[]) noexcept;
+		CLogMessage &operator <<(const std::wstring &str) noexcept { return *this << str.c_str(); }
+		CLogMessage &operator <<(char c) noexcept { const char str[] = { c, '\0' }; return *this << str; }
+		CLogMessage &operator <<(wchar_t c) noexcept { const wchar_t str[] = { c, L'\0' }; return *this << str; }
+		CLogMessage &operator <<(double value) noexcept { return Print(L"%g", value); }
+		template<typename Integer>
+		std::enable_if_t<std::is_integral<Integer>::value, CLogMessage &> operator <<(Integer value) noexcept
+		{
+			return std::is_signed<Integer>::value ? Print(L"%lld", (long long)value) : Print(L"%llu", (unsigned long long)value);
+		}
+	};
+
+	inline CLogMessage Log(LogSeverity severity) noexcept
+	{
+		return CLogMessage(severity);
+	}
+
+	CLogger::CLogger() : thread(std::mem_fn(&CLogger::Run), this)
+	{
+		for (size_t idx = 0; idx < ringCapacity; idx++)
+			slots[idx].seq.store(idx, std::memory_order_relaxed);
+	}
+
+	CLogger::~CLogger()
+	{
+		{
+			std::lock_guard<decltype(wakeMtx)> lck(wakeMtx);
+			finish = true;
+		}
+		wakeEvent.notify_all();
+		thread.join();
+	}
+
+	CLogger &CLogger::Instance()
+	{
+		static CLogger logger;
+		return logger;
+	}
+
+	void CLogger::DefaultSink(const CVideoRecorder::LogRecord &record)
+	{
+		(record.severity == LogSeverity::Info ? std::wclog : std::wcerr) << record.message << L'\n';
+	}
+
+	void CLogger::Emit(const CVideoRecorder::LogRecord &record) noexcept
+	{
+		try
+		{
+			if (sink)
+				sink(record);
+			else
+				DefaultSink(record);
+		}
+		catch (...)	// sink must not bring the logger down
+		{
+		}
+	}
+
+	// GCRA: admit if theoretical arrival time does not run ahead of now more than burst
+	bool CLogger::Admit(LogSeverity severity) noexcept
+	{
+		if (severity < minSeverity.load(std::memory_order_relaxed))
+			return false;
+		if (severity == LogSeverity::Fatal)
+			return true;
+		auto &tat = theoreticalArrival[(unsigned int)severity];
+		const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+		auto current = tat.load(std::memory_order_relaxed);
+		std::chrono::steady_clock::rep next;
+		do
+		{
+			next = std::max(current, now) + rateInterval.count();
+			if (next - now > rateBurst.count())
+			{
+				suppressed.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		} while (!tat.compare_exchange_weak(current, next, std::memory_order_relaxed));
+		return true;
+	}
+
+	void CLogger::Push(LogSeverity severity, const wchar_t text[], unsigned int length) noexcept
+	{
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		Slot *slot;
+		for (;;)
+		{
+			slot = &slots[pos & (ringCapacity - 1)];
+			const auto diff = intptr_t(slot->seq.load(std::memory_order_acquire)) - intptr_t(pos);
+			if (diff == 0)
+			{
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				overflowed.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			else
+				pos = enqueuePos.load(std::memory_order_relaxed);
+		}
+		slot->record = { severity, std::chrono::steady_clock::now(), std::this_thread::get_id(), slot->text };
+		std::copy_n(text, length + 1, slot->text);
+		slot->seq.store(pos + 1, std::memory_order_release);
+		if (severity == LogSeverity::Fatal)
+			Flush();
+		else
+			wakeEvent.notify_one();
+	}
+
+	void CLogger::Drain()
+	{
+		std::lock_guard<decltype(drainMtx)> lck(drainMtx);
+		for (;;)
+		{
+			Slot &slot = slots[dequeuePos & (ringCapacity - 1)];
+			if (slot.seq.load(std::memory_order_acquire) != dequeuePos + 1)
+				break;
+			Emit(slot.record);
+			slot.seq.store(dequeuePos + ringCapacity, std::memory_order_release);
+			dequeuePos++;
+		}
+
+		const auto suppressed = this->suppressed.exchange(0, std::memory_order_relaxed), overflowed = this->overflowed.exchange(0, std::memory_order_relaxed);
+		if (suppressed || overflowed)
+		{
+			wchar_t text[messageCapacity];
+			swprintf(text, messageCapacity, L"%u log message(s) suppressed by rate limiter, %u lost due to log queue overflow.", suppressed, overflowed);
+			Emit({ LogSeverity::Warning, std::chrono::steady_clock::now(), std::this_thread::get_id(), text });
+		}
+
+		if (!sink)
+		{
+			std::wclog.flush();
+			std::wcerr.flush();
+		}
+	}
+
+	void CLogger::Flush()
+	{
+		try
+		{
+			Drain();
+		}
+		catch (const std::system_error &)	// nothing can be reported
+		{
+		}
+	}
+
+	void CLogger::Run()
+	{
+		std::unique_lock<decltype(wakeMtx)> lck(wakeMtx);
+		while (!finish)
+		{
+			// timeout recovers from notifications missed between Drain() and wait
+			wakeEvent.wait_for(lck, std::chrono::milliseconds(100));
+			lck.unlock();
+			Drain();
+			lck.lock();
+		}
+		lck.unlock();
+		Drain();
+	}
+
+	void CLogger::SetSink(CVideoRecorder::LogSink &&sink)
+	{
+		std::lock_guard<decltype(drainMtx)> lck(drainMtx);
+		this->sink = std::move(sink);
+	}
+
+	template<typename Value>
+	CLogMessage &CLogMessage::Print(const wchar_t format[], Value value) noexcept
+	{
+		if (admitted && length + 1 < CLogger::messageCapacity)
+		{
+			const int printed = swprintf(text + length, CLogger::messageCapacity - length, format, value);
+			if (printed > 0)
+				length += printed;
+		}
+		return *this;
+	}
+
+	// widen byte-by-byte as wide streams do for narrow strings in "C" locale
+	CLogMessage &CLogMessage::operator <<(const char str[]) noexcept
+	{
+		if (admitted)
+		{
+			for (; *str && length + 1 < CLogger::messageCapacity; str++)
+				text[length++] = (unsigned char)*str;
+			text[length] = L'\0';
+		}
+		return *this;
+	}
+
+	CLogMessage &CLogMessage::operator <<(const wchar_t str[]) noexcept
+	{
+		if (admitted)
+		{
+			const unsigned int copied = (unsigned int)std::min<size_t>(wcslen(str), CLogger::messageCapacity - 1 - length);
+			std::copy_n(str, copied, text + length);
+			text[length += copied] = L'\0';
+		}
+		return *this;
+	}
+}
+
+void CVideoRecorder::SetLogSink(LogSink sink)
+{
+	CLogger::Instance().SetSink(std::move(sink));
+}
+
+void CVideoRecorder::SetLogLevel(LogSeverity minSeverity)
+{
+	CLogger::Instance().SetMinSeverity(minSeverity);
+}
+#pragma endregion
 
 static constexpr unsigned int cache_line = 64;	// for common x86 CPUs
 static constexpr const char *const screenshotErrorMsgPrefix = "Fail to save screenshot \"";
 
 typedef CVideoRecorder::CFrame::FrameData::Format FrameFormat;
 
+#ifdef _WIN32
 static inline void AssertHR(HRESULT hr) noexcept
 {
 	assert(SUCCEEDED(hr));
@@ -52,21 +366,10 @@ static inline DXGI_FORMAT GetDXGIFormat(CVideoRecorder::CFrame::FrameData::Forma
 		return DXGI_FORMAT_R10G10B10A2_UNORM;
 	default:
 		assert(false);
-		__assume(false);
+		UNREACHABLE;
 	}
 }
-
-namespace
-{
-	const struct Init
-	{
-		Init()
-		{
-			av_register_all();
-			avcodec_register_all();
-		}
-	} init;
-}
+#endif
 
 static inline auto GetAVFormat(CVideoRecorder::Format format)
 {
@@ -79,8 +382,37 @@ static inline auto GetAVFormat(CVideoRecorder::Format format)
 	}
 }
 
-static inline AVCodec *FindEncoder(CVideoRecorder::Codec codec, bool nv)
+#ifdef VIDEO_RECORDER_TEST_HOOKS
+static std::atomic<unsigned int> failingEncoders;	// bit (codec * 2 + nv), see FailEncoder()
+
+void CVideoRecorder::FailEncoder(Codec codec, bool nv, bool fail) noexcept
+{
+	const unsigned int bit = 1u << ((unsigned int)codec * 2 + nv);
+	if (fail)
+		failingEncoders.fetch_or(bit, std::memory_order_relaxed);
+	else
+		failingEncoders.fetch_and(~bit, std::memory_order_relaxed);
+}
+
+static std::atomic<unsigned int> unopenableEncoders;	// bit (codec * 2 + nv), see FailEncoderOpen()
+
+void CVideoRecorder::FailEncoderOpen(Codec codec, bool nv, bool fail) noexcept
+{
+	const unsigned int bit = 1u << ((unsigned int)codec * 2 + nv);
+	if (fail)
+		unopenableEncoders.fetch_or(bit, std::memory_order_relaxed);
+	else
+		unopenableEncoders.fetch_and(~bit, std::memory_order_relaxed);
+}
+#endif
+
+static inline const AVCodec *FindEncoder(CVideoRecorder::Codec codec, bool nv)
 {
+#ifdef VIDEO_RECORDER_TEST_HOOKS
+	if (failingEncoders.load(std::memory_order_relaxed) >> ((unsigned int)codec * 2 + nv) & 1)
+		return NULL;
+	return avcodec_find_encoder(AV_CODEC_ID_RAWVIDEO);	// stub backend: built in, no lookahead, cheap
+#endif
 	switch (codec)
 	{
 	case CVideoRecorder::Codec::H264:
@@ -92,6 +424,13 @@ static inline AVCodec *FindEncoder(CVideoRecorder::Codec codec, bool nv)
 	}
 }
 
+static AVPacket *AllocPacket()
+{
+	if (AVPacket *const packet = av_packet_alloc())
+		return packet;
+	throw std::bad_alloc();
+}
+
 inline void CVideoRecorder::ContextDeleter::operator()(AVCodecContext *context) const
 {
 	avcodec_free_context(&context);
@@ -102,6 +441,11 @@ void CVideoRecorder::FrameDeleter::operator()(AVFrame *frame) const
 	av_frame_free(&frame);
 }
 
+void CVideoRecorder::PacketDeleter::operator()(AVPacket *packet) const
+{
+	av_packet_free(&packet);
+}
+
 inline void CVideoRecorder::OutputContextDeleter::operator()(AVFormatContext *output) const
 {
 	avformat_free_context(output);
@@ -159,212 +503,887 @@ inline void CVideoRecorder::CheckAVResult(int result, int expected, const char e
 	CheckAVResultImpl(result, error);
 }
 
-bool CVideoRecorder::Encode()
+// logs failure, caller aborts session its own way
+bool CVideoRecorder::MakeWritable(AVFrame &frame)
 {
-	int result = avcodec_send_frame(context.get(), dstFrame.get());
+	const int result = av_frame_make_writable(&frame);
 	assert(result == 0);
 	if (result < 0)
 	{
-		wcerr << "Fail to " << (dstFrame ? "send frame to" : "flush") << " the encoder: " << AVErrorString(result) << '.' << endl;
-		return false;
-	}
-	while ((result = avcodec_receive_packet(context.get(), packet.get())) == 0)
-	{
-		av_packet_rescale_ts(packet.get(), context->time_base, videoStream->time_base);
-		packet->stream_index = videoStream->index;
-		result = av_interleaved_write_frame(videoFile.get(), packet.get());
-		assert(result == 0);
-		av_packet_unref(packet.get());
-		if (result < 0)
-		{
-			wcerr << "Fail to write video data to file: " << AVErrorString(result) << '.' << endl;
-			return false;
-		}
-	}
-	switch (result)
-	{
-	case AVERROR(EAGAIN):
-	case AVERROR_EOF:
-		return true;
-	default:
-		wcerr << "Fail to receive packet from the encoder: " << AVErrorString(result) << '.' << endl;
+		Log(LogSeverity::Error) << "Fail to prepare video frame for writing: " << AVErrorString(result) << '.';
 		return false;
 	}
+	return true;
 }
 
-void CVideoRecorder::Cleanup()
+#pragma region CLatencyHistogram
+/*
+	HDR-style log-linear histogram: values below 2^subBucketBits are exact, above that every power of 2 range is split into 2^subBucketBits linear buckets (~12% relative error)
+	single writer (worker thread), relaxed atomics allow concurrent readers without locks
+*/
+class CVideoRecorder::CLatencyHistogram
 {
-	context.reset();
-	dstFrame.reset();
-	if (videoFile && videoFile->pb)
-		avio_closep(&videoFile->pb);
-	videoFile.reset();
+	static constexpr unsigned int subBucketBits = 3, subBuckets = 1u << subBucketBits, maxMSB = 40 /*~18 min in ns*/, bucketCount = (maxMSB - subBucketBits + 2) * subBuckets;
+
+private:
+	std::atomic<uint_least32_t> buckets[bucketCount];
+	std::atomic<uint_least64_t> count, sum, max, intervalEMA;	// ns
+	clock::time_point lastFinish;
+
+private:
+	static unsigned int BucketIdx(uint_least64_t value) noexcept;
+	static uint_least64_t BucketValue(unsigned int idx) noexcept;
+	uint_least64_t Percentile(double percentile, uint_least64_t total) const noexcept;
+
+public:
+	CLatencyHistogram() noexcept { Reset(); }
+
+public:
+	void Reset() noexcept;
+	void Record(clock::time_point start, clock::time_point finish) noexcept;
+	Stats::StageStats GetStats() const noexcept;
+};
+
+inline unsigned int CVideoRecorder::CLatencyHistogram::BucketIdx(uint_least64_t value) noexcept
+{
+	if (value < subBuckets)
+		return (unsigned int)value;
+	value = std::min<uint_least64_t>(value, (UINT64_C(2) << maxMSB) - 1);
+	unsigned int msb = subBucketBits;
+	while (value >> (msb + 1))
+		msb++;
+	const unsigned int shift = msb - subBucketBits;
+	return (shift + 1) * subBuckets + (unsigned int)((value >> shift) - subBuckets);
 }
 
-/*
-	NOTE: exceptions related to mutex locks
-		- aren't handled in worker thread which leads to terminate()
-		- calls abort() in main thread
-*/
+// middle of bucket range
+inline uint_least64_t CVideoRecorder::CLatencyHistogram::BucketValue(unsigned int idx) noexcept
+{
+	if (idx < subBuckets)
+		return idx;
+	const unsigned int shift = idx / subBuckets - 1;
+	return (uint_least64_t(subBuckets + idx % subBuckets) << shift) + (UINT64_C(1) << shift >> 1);
+}
 
-[[noreturn]]
-void CVideoRecorder::Error(const std::system_error &error)
+void CVideoRecorder::CLatencyHistogram::Reset() noexcept
 {
-	wcerr << "System error occured: " << error.what() << endl;
-	abort();
+	for (auto &bucket : buckets)
+		bucket.store(0, std::memory_order_relaxed);
+	count.store(0, std::memory_order_relaxed);
+	sum.store(0, std::memory_order_relaxed);
+	max.store(0, std::memory_order_relaxed);
+	intervalEMA.store(0, std::memory_order_relaxed);
+	lastFinish = {};
 }
 
-void CVideoRecorder::Error(const std::exception &error, const char errorMsgPrefix[], const std::wstring *filename)
+void CVideoRecorder::CLatencyHistogram::Record(clock::time_point start, clock::time_point finish) noexcept
 {
-	try
-	{
-		// wait to establish character order for wcerr and to free memory
-		std::unique_lock<decltype(mtx)> lck(mtx);
-		workerEvent.wait(lck, [this] { return taskQueue.empty(); });
-		wcerr << errorMsgPrefix;
-		if (filename)
-			wcerr << '\"' << filename << '\"';
-		wcerr << ": " << error.what() << '.';
-		switch (status)
-		{
-		case Status::OK:
-			wcerr << " Try again...";
-			break;
-		case Status::CLEAN:
-			if (videoFile)
-			{
-				Cleanup();
-				taskQueue.clear();
-			}
-			break;
-		}
-		wcerr << endl;
-	}
-	catch (const std::system_error &error)
+	using std::chrono::duration_cast;
+	using std::chrono::nanoseconds;
+	const uint_least64_t latency = duration_cast<nanoseconds>(finish - start).count();
+	auto &bucket = buckets[BucketIdx(latency)];
+	bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	sum.store(sum.load(std::memory_order_relaxed) + latency, std::memory_order_relaxed);
+	if (latency > max.load(std::memory_order_relaxed))
+		max.store(latency, std::memory_order_relaxed);
+	if (count.load(std::memory_order_relaxed))
 	{
-		Error(error);
+		// EMA with 1/16 weight
+		const int_least64_t interval = duration_cast<nanoseconds>(finish - lastFinish).count(), ema = intervalEMA.load(std::memory_order_relaxed);
+		intervalEMA.store(ema ? ema + (interval - ema) / 16 : interval, std::memory_order_relaxed);
 	}
+	lastFinish = finish;
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
 }
 
-static constexpr std::underlying_type<DirectX::WICCodecs>::type CODEC_DDS = 0xFFFF0001, CODEC_TGA = 0xFFFF0002;
-static constexpr std::pair<const wchar_t *, DirectX::WICCodecs> pictureFormats[] =
+uint_least64_t CVideoRecorder::CLatencyHistogram::Percentile(double percentile, uint_least64_t total) const noexcept
 {
-	{ L".bmp",	DirectX::WIC_CODEC_BMP			},
-	{ L".jpg",	DirectX::WIC_CODEC_JPEG			},
-	{ L".jpeg",	DirectX::WIC_CODEC_JPEG			},
-	{ L".png",	DirectX::WIC_CODEC_PNG			},
-	{ L".tif",	DirectX::WIC_CODEC_TIFF			},
-	{ L".tiff",	DirectX::WIC_CODEC_TIFF			},
-	{ L".gif",	DirectX::WIC_CODEC_GIF			},
-	{ L".hdp",	DirectX::WIC_CODEC_WMP			},
-	{ L".jxr",	DirectX::WIC_CODEC_WMP			},
-	{ L".wdp",	DirectX::WIC_CODEC_WMP			},
-	{ L".ico",	DirectX::WIC_CODEC_ICO			},
-	{ L".dds",	DirectX::WICCodecs(CODEC_DDS)	},
-	{ L".tga",	DirectX::WICCodecs(CODEC_TGA)	},
-};
+	const uint_least64_t threshold = std::max<uint_least64_t>(uint_least64_t(total * percentile + .5), 1);
+	uint_least64_t accumulated = 0;
+	for (unsigned int idx = 0; idx < bucketCount; idx++)
+		if ((accumulated += buckets[idx].load(std::memory_order_relaxed)) >= threshold)
+			return BucketValue(idx);
+	return max.load(std::memory_order_relaxed);
+}
 
-static DirectX::WICCodecs GetScreenshotCodec(std::wstring &&ext)
+auto CVideoRecorder::CLatencyHistogram::GetStats() const noexcept -> Stats::StageStats
 {
-	std::transform(ext.begin(), ext.end(), ext.begin(), tolower);
-	const auto found = std::find_if(std::begin(pictureFormats), std::end(pictureFormats), [&ext](const std::remove_extent<decltype(pictureFormats)>::type &format)
-	{
-		return ext == format.first;
-	});
-	if (found == std::end(pictureFormats))
+	using std::chrono::nanoseconds;
+	Stats::StageStats stats{};
+	stats.count = count.load(std::memory_order_acquire);
+	if (stats.count)
 	{
-		wcerr << "Unrecognized screenshot format \"" << ext << "\". Using \"tga\" as fallback." << endl;
-		return DirectX::WICCodecs(CODEC_TGA);
+		// percentiles can't exceed max (bucket middle can)
+		const uint_least64_t max = this->max.load(std::memory_order_relaxed);
+		stats.p50 = nanoseconds(std::min(Percentile(.5, stats.count), max));
+		stats.p99 = nanoseconds(std::min(Percentile(.99, stats.count), max));
+		stats.max = nanoseconds(max);
+		stats.sum = nanoseconds(sum.load(std::memory_order_relaxed));
+		if (const auto interval = intervalEMA.load(std::memory_order_relaxed))
+			stats.fps = 1e9 / interval;
 	}
-	else
-		return found->second;
+	return stats;
 }
+#pragma endregion
 
-#pragma region Task
-struct CVideoRecorder::ITask
+inline void CVideoRecorder::RecordLatency(Stage stage, clock::time_point start, clock::time_point finish)
 {
-	virtual void operator ()(CVideoRecorder &parent) = 0;
-	virtual operator bool() const { return true; }	// is task ready to handle
-	virtual ~ITask() noexcept = default;
-};
+	latencyHistograms[(unsigned int)stage].Record(start, finish);
+}
 
-#pragma region CFrameTask
-class CVideoRecorder::CFrameTask final : public ITask
+#pragma region CFrameEventLog
+// bounded ring overwriting oldest events, they are rare (anomalies only) => plain mutex is fine
+class CVideoRecorder::CFrameEventLog
 {
-	friend void CFrame::Cancel();
-
-private:
-	std::shared_ptr<CFrame> srcFrame;
+	static constexpr unsigned int capacity = 256;
+	std::mutex mtx;	// leaf lock, may be taken under recorder's one
+	FrameEvent events[capacity];
+	unsigned int head = 0, count = 0;
 
 public:
-	CFrameTask(std::shared_ptr<CFrame> &&frame) noexcept : srcFrame(std::move(frame)) { assert(srcFrame); }
-	CFrameTask(CFrameTask &&) noexcept = default;
-
-public:
-	void operator ()(CVideoRecorder &parent) override;
-	operator bool() const override { return srcFrame->ready; }
+	void Push(const FrameEvent &event);
+	std::vector<FrameEvent> Take();
 };
-#pragma endregion
 
-#pragma region CStartVideoRecordRequest
-class CVideoRecorder::CStartVideoRecordRequest final : public ITask
+void CVideoRecorder::CFrameEventLog::Push(const FrameEvent &event)
 {
-	const std::wstring filename;
-	const unsigned int width, height;
-	const Codec codecID;
-	const EncoderConfig config;
-	const Format format;
-	const FPS fps;
-	const bool matchedStop;
+	std::lock_guard<decltype(mtx)> lck(mtx);
+	events[(head + count) % capacity] = event;
+	if (count < capacity)
+		count++;
+	else
+		head = (head + 1) % capacity;
+}
 
-public:
-	const std::wstring &GetFilename() const noexcept { return filename; }
+auto CVideoRecorder::CFrameEventLog::Take() -> std::vector<FrameEvent>
+{
+	std::vector<FrameEvent> result;
+	result.reserve(capacity);
+	std::lock_guard<decltype(mtx)> lck(mtx);
+	for (unsigned int idx = 0; idx < count; idx++)
+		result.push_back(events[(head + idx) % capacity]);
+	head = count = 0;
+	return result;
+}
+#pragma endregion
+
+#pragma region CQualityGovernor
+/*
+	worker load (busy time per video frame relative to frame period) and backlog are evaluated once per window (~1 s of video)
+	CRF steps up when load exceeds 1 - margin or frames pile up, steps down when load stays below 1 - 2 * margin with empty backlog
+	one step per window gives encoder time to settle => no oscillation around threshold
+*/
+class CVideoRecorder::CQualityGovernor
+{
+	const int64_t minCRF, maxCRF;
+	const clock::duration period;
+	const double margin;
+	int64_t crf;
+	clock::duration busy{};
+	unsigned int frames = 0;
+	const unsigned int window;
 
 public:
-	CStartVideoRecordRequest(std::wstring &&filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, EncoderConfig config, bool matchedStop) noexcept :
-		filename(std::move(filename)), width(width), height(height),
-		format(format), fps(fps), codecID(codec), config(config), matchedStop(matchedStop) {}
-	CStartVideoRecordRequest(CStartVideoRecordRequest &&) noexcept = default;
+	CQualityGovernor(const GovernorConfig &config, int64_t crf, FPS fps) noexcept;
 
 public:
-	void operator ()(CVideoRecorder &parent) override;
+	int64_t CRF() const noexcept { return crf; }
+	// true if CRF should be changed
+	bool Update(clock::duration busy, unsigned int frames, uint_least64_t backlog);
 };
-#pragma endregion
 
-#pragma region CStopVideoRecordRequest
-class CVideoRecorder::CStopVideoRecordRequest final : public ITask
+CVideoRecorder::CQualityGovernor::CQualityGovernor(const GovernorConfig &config, int64_t crf, FPS fps) noexcept :
+	minCRF(config.minCRF), maxCRF(config.maxCRF),
+	period(std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1. / (int)fps))), margin(config.margin),
+	crf(std::clamp(crf, config.minCRF, config.maxCRF)), window((unsigned int)fps)
 {
-	const bool matchedStart;
+}
+
+bool CVideoRecorder::CQualityGovernor::Update(clock::duration busy, unsigned int frames, uint_least64_t backlog)
+{
+	this->busy += busy;
+	if ((this->frames += frames) < window)
+		return false;
+
+	const double load = std::chrono::duration<double>(this->busy).count() / (std::chrono::duration<double>(period).count() * this->frames);
+	this->busy = {};
+	this->frames = 0;
+	const auto prevCRF = crf;
+	if (load > 1 - margin || backlog > frameQueueDepth / 2)
+		crf = std::min(crf + 1, maxCRF);
+	else if (load < 1 - 2 * margin && !backlog)
+		crf = std::max(crf - 1, minCRF);
+	if (crf == prevCRF)
+		return false;
+	Log(LogSeverity::Info) << "Adjusting video quality: crf " << prevCRF << " -> " << crf << " (worker load " << int(load * 100 + .5) << "%, backlog " << backlog << " frame(s)).";
+	return true;
+}
+#pragma endregion
+
+#pragma region CSceneDetector
+// histogram ignores motion within scene, hard cut changes luma distribution at once
+class CVideoRecorder::CSceneDetector
+{
+	uint32_t histograms[2][Imaging::lumaBins];
+	unsigned int current = 0;
+	bool primed = false;
+	const double threshold;
+
+public:
+	explicit CSceneDetector(double threshold) noexcept : threshold(threshold) {}
+
+public:
+	// half of L1 distance between normalized histograms of frame and previous one, 0 for first frame
+	double Score(const AVFrame &frame) noexcept;
+	bool Cut(double score) const noexcept { return score >= threshold; }
+};
+
+double CVideoRecorder::CSceneDetector::Score(const AVFrame &frame) noexcept
+{
+	current ^= 1;
+	const auto &bins = histograms[current], &prevBins = histograms[current ^ 1];
+	Imaging::LumaHistogram(frame.data[0], frame.linesize[0], frame.width, frame.height, frame.format == AV_PIX_FMT_YUV420P10, histograms[current]);
+	if (!std::exchange(primed, true))
+		return 0;
+	uint_least64_t difference = 0, samples = 0;
+	for (unsigned int bin = 0; bin < Imaging::lumaBins; bin++)
+	{
+		difference += bins[bin] > prevBins[bin] ? bins[bin] - prevBins[bin] : prevBins[bin] - bins[bin];
+		samples += bins[bin];
+	}
+	return samples ? double(difference) / (2 * samples) : 0;
+}
+#pragma endregion
+
+void CVideoRecorder::RecordFrameEvent(FrameEventType type, FrameLossReason reason, decltype(CFrame::videoPendingFrames) frames)
+{
+	try
+	{
+		frameEventLog->Push({ type, reason, (unsigned int)std::min<decltype(frames)>(frames, UINT_MAX), clock::now() });
+	}
+	catch (const std::system_error &error)
+	{
+		Error(error);
+	}
+}
+
+static void UpdatePeak(std::atomic<size_t> &peak, size_t value) noexcept
+{
+	for (size_t prev = peak.load(std::memory_order_relaxed); prev < value && !peak.compare_exchange_weak(prev, value, std::memory_order_relaxed);) {}
+}
+
+// queued frames are charged/released by different threads, other categories are owned by worker thread
+void CVideoRecorder::AccountMemory(MemoryCategory category, ptrdiff_t delta) noexcept
+{
+	UpdatePeak(memoryPeak[(unsigned int)category], memoryCurrent[(unsigned int)category].fetch_add(delta, std::memory_order_relaxed) + delta);
+	UpdatePeak(memoryTotalPeak, memoryTotal.fetch_add(delta, std::memory_order_relaxed) + delta);
+}
+
+// single writer categories only
+void CVideoRecorder::SetMemory(MemoryCategory category, size_t bytes) noexcept
+{
+	AccountMemory(category, bytes - memoryCurrent[(unsigned int)category].load(std::memory_order_relaxed));
+}
+
+void CVideoRecorder::DropFrames(decltype(CFrame::videoPendingFrames) frames, FrameLossReason reason)
+{
+	framesDroppedBy[(unsigned int)reason].fetch_add(frames, std::memory_order_relaxed);
+	RecordFrameEvent(FrameEventType::Dropped, reason, frames);
+}
+
+#pragma region CTracer
+/*
+	every recording thread appends complete ('X') events to its own fixed size buffer without locks
+	buffer lookup is cached in thread_local storage, mutex is taken only on first event from a thread and on dump
+*/
+class CVideoRecorder::CTracer
+{
+	struct Event
+	{
+		const char *name;	// string literals only
+		clock::time_point start, finish;
+	};
+
+	struct Buffer
+	{
+		static constexpr unsigned int capacity = 1u << 16;
+		const std::thread::id thread;
+		const char *const threadName;
+		std::atomic<unsigned int> count{};
+		Event events[capacity];
+
+		Buffer(std::thread::id thread, const char threadName[]) noexcept : thread(thread), threadName(threadName) {}
+	};
+
+	static std::atomic<unsigned int> lastID;
+	const unsigned int id = ++lastID;
+	std::mutex mtx;
+	std::vector<std::unique_ptr<Buffer>> buffers;
+	std::wstring filename;
+	std::atomic<uint_least64_t> lost{};
+
+private:
+	Buffer *GetBuffer(const CVideoRecorder &recorder);
+
+public:
+	void Start(std::wstring &&filename);
+	void Record(const CVideoRecorder &recorder, const char name[], clock::time_point start, clock::time_point finish) noexcept;
+	void Dump();
+};
+
+std::atomic<unsigned int> CVideoRecorder::CTracer::lastID;
+
+auto CVideoRecorder::CTracer::GetBuffer(const CVideoRecorder &recorder) -> Buffer *
+{
+	static thread_local struct
+	{
+		unsigned int tracerID;
+		Buffer *buffer;
+	} cache{};
+
+	if (cache.tracerID != id)
+	{
+		const auto thread = std::this_thread::get_id();
+		std::lock_guard<decltype(mtx)> lck(mtx);
+		const auto found = std::find_if(buffers.cbegin(), buffers.cend(), [thread](const std::unique_ptr<Buffer> &buffer) { return buffer->thread == thread; });
+		if (found == buffers.cend())
+		{
+			buffers.push_back(std::make_unique<Buffer>(thread, thread == recorder.worker.get_id() ? "VideoRecorder worker" : nullptr));
+			cache = { id, buffers.back().get() };
+		}
+		else
+			cache = { id, found->get() };
+	}
+	return cache.buffer;
+}
+
+void CVideoRecorder::CTracer::Start(std::wstring &&filename)
+{
+	std::lock_guard<decltype(mtx)> lck(mtx);
+	this->filename = std::move(filename);
+	for (const auto &buffer : buffers)
+		buffer->count.store(0, std::memory_order_relaxed);
+	lost.store(0, std::memory_order_relaxed);
+}
+
+void CVideoRecorder::CTracer::Record(const CVideoRecorder &recorder, const char name[], clock::time_point start, clock::time_point finish) noexcept
+{
+	try
+	{
+		Buffer &buffer = *GetBuffer(recorder);
+		const unsigned int count = buffer.count.load(std::memory_order_relaxed);
+		if (count < Buffer::capacity)
+		{
+			buffer.events[count] = { name, start, finish };
+			buffer.count.store(count + 1, std::memory_order_release);
+		}
+		else
+			lost.fetch_add(1, std::memory_order_relaxed);
+	}
+	catch (const std::exception &)	// buffer allocation failed
+	{
+		lost.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+// timestamps are steady clock microseconds as is => can be correlated with application's own steady clock timeline
+void CVideoRecorder::CTracer::Dump()
+{
+	using std::chrono::duration;
+	std::lock_guard<decltype(mtx)> lck(mtx);
+	std::ofstream out(std::filesystem::path(filename), std::ios::out | std::ios::trunc);
+	out.imbue(std::locale::classic());
+	out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+#ifdef _WIN32
+	const unsigned long pid = GetCurrentProcessId();
+#else
+	const unsigned long pid = getpid();
+#endif
+	bool first = true;
+	for (unsigned int tid = 1; tid <= buffers.size(); tid++)
+	{
+		const Buffer &buffer = *buffers[tid - 1];
+		out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << tid << ",\"args\":{\"name\":\"";
+		if (buffer.threadName)
+			out << buffer.threadName;
+		else
+			out << "VideoRecorder client " << tid;
+		out << "\"}}";
+		first = false;
+		const unsigned int count = buffer.count.load(std::memory_order_acquire);
+		for (unsigned int idx = 0; idx < count; idx++)
+		{
+			const Event &event = buffer.events[idx];
+			out << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"VideoRecorder\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << tid <<
+				",\"ts\":" << duration<double, std::micro>(event.start.time_since_epoch()).count() <<
+				",\"dur\":" << duration<double, std::micro>(event.finish - event.start).count() << '}';
+		}
+	}
+	out << "\n]}\n";
+	out.close();
+	if (!out)
+		Log(LogSeverity::Error) << "Fail to write trace file \"" << filename << "\".";
+	else if (const auto lost = this->lost.load(std::memory_order_relaxed))
+		Log(LogSeverity::Warning) << "Trace \"" << filename << "\" is incomplete: " << lost << " event(s) lost due to buffer overflow.";
+	else
+		Log(LogSeverity::Info) << "Trace \"" << filename << "\" has been saved.";
+}
+#pragma endregion
+
+void CVideoRecorder::Trace(const char name[], clock::time_point start, clock::time_point finish) noexcept
+{
+	if (tracing.load(std::memory_order_acquire))
+		tracer->Record(*this, name, start, finish);
+}
+
+// EAGAIN from avcodec_send_frame() means encoder output is full => drain pending packets and resend
+bool CVideoRecorder::Encode(const AVFrame *frame)
+{
+	const auto start = clock::now();
+	clock::duration muxTime{};
+	int result;
+	bool sent;
+	do
+	{
+		result = avcodec_send_frame(context.get(), frame);
+		sent = result != AVERROR(EAGAIN);
+		if (sent)
+		{
+			assert(result == 0);
+			if (result < 0)
+			{
+				Log(LogSeverity::Error) << "Fail to " << (frame ? "send frame to" : "flush") << " the encoder: " << AVErrorString(result) << '.';
+				return false;
+			}
+			if (frame)
+			{
+				encoderLag.fetch_add(1, std::memory_order_relaxed);
+#ifdef VIDEO_RECORDER_TEST_HOOKS
+				if (frame->pict_type == AV_PICTURE_TYPE_I)
+					testKeyframes.push_back(frame->pts);
+				testFrames.emplace_back(frame->pts, frame->data[0][0]);
+#endif
+			}
+		}
+		if (!Drain(muxTime))
+			return false;
+	} while (!sent);
+	SetMemory(MemoryCategory::Encoder, encoderLag.load(std::memory_order_relaxed) * memoryCurrent[(unsigned int)MemoryCategory::VideoFrame].load(std::memory_order_relaxed));
+	const auto finish = clock::now();
+	if (tracing.load(std::memory_order_relaxed))
+		Trace("Encode", start, finish);
+	RecordLatency(Stage::Encode, start + muxTime, finish);
+	if (muxTime.count())
+		RecordLatency(Stage::Mux, finish - muxTime, finish);
+	return true;
+}
+
+// writes all packets currently available from encoder
+bool CVideoRecorder::Drain(clock::duration &muxTime)
+{
+	int result;
+	while ((result = avcodec_receive_packet(context.get(), packet.get())) == 0)
+	{
+		av_packet_rescale_ts(packet.get(), context->time_base, videoStream->time_base);
+		packet->stream_index = videoStream->index;
+		const auto packetSize = packet->size;
+		const auto muxStart = clock::now();
+		result = av_interleaved_write_frame(videoFile.get(), packet.get());
+		const auto muxFinish = clock::now();
+		muxTime += muxFinish - muxStart;
+		if (tracing.load(std::memory_order_relaxed))
+			Trace("Mux", muxStart, muxFinish);
+		assert(result == 0);
+		av_packet_unref(packet.get());
+		if (result < 0)
+		{
+			Log(LogSeverity::Error) << "Fail to write video data to file: " << AVErrorString(result) << '.';
+			return false;
+		}
+		bytesWritten.fetch_add(packetSize, std::memory_order_relaxed);
+		if (encoderLag.load(std::memory_order_relaxed))
+			encoderLag.fetch_sub(1, std::memory_order_relaxed);
+	}
+	switch (result)
+	{
+	case AVERROR(EAGAIN):
+	case AVERROR_EOF:
+		return true;
+	default:
+		Log(LogSeverity::Error) << "Fail to receive packet from the encoder: " << AVErrorString(result) << '.';
+		return false;
+	}
+}
+
+#ifdef VIDEO_RECORDER_TEST_HOOKS
+// in-memory sink instead of file
+int CVideoRecorder::OpenOutput(const char [])
+{
+	static constexpr int bufferSize = 4096;
+	testSink.clear();
+	testKeyframes.clear();
+	testFrames.clear();
+	const auto buffer = static_cast<unsigned char *>(av_malloc(bufferSize));
+	if (!buffer)
+		return AVERROR(ENOMEM);
+	videoFile->pb = avio_alloc_context(buffer, bufferSize, 1, &testSink, NULL, [](void *opaque, auto data, int size)
+	{
+		static_cast<std::vector<uint8_t> *>(opaque)->insert(static_cast<std::vector<uint8_t> *>(opaque)->end(), data, data + size);
+		return size;
+	}, NULL);
+	if (!videoFile->pb)
+	{
+		av_free(buffer);
+		return AVERROR(ENOMEM);
+	}
+	return 0;
+}
+
+int CVideoRecorder::CloseOutput()
+{
+	avio_flush(videoFile->pb);
+	const int result = videoFile->pb->error;
+	av_freep(&videoFile->pb->buffer);
+	avio_context_free(&videoFile->pb);
+	return result;
+}
+#else
+int CVideoRecorder::OpenOutput(const char filename[])
+{
+	return avio_open(&videoFile->pb, filename, AVIO_FLAG_WRITE);
+}
+
+int CVideoRecorder::CloseOutput()
+{
+	return avio_closep(&videoFile->pb);
+}
+#endif
+
+// libx264 wrapper picks changed crf option up on next frame and reconfigures encoder mid-stream
+void CVideoRecorder::GovernQuality(clock::time_point start, unsigned int frames)
+{
+	// frames waiting behind current one, task being executed is counted as pending
+	const unsigned int pending = pendingFrameTasks.load(std::memory_order_relaxed);
+	const uint_least64_t backlog = (pending ? pending - 1 : 0) + spillBacklog.load(std::memory_order_relaxed);
+	if (!governor->Update(clock::now() - start, frames, backlog))
+		return;
+	const int result = av_opt_set_double(context->priv_data, "crf", double(governor->CRF()), 0);
+	assert(result == 0);
+	if (result < 0)
+	{
+		Log(LogSeverity::Error) << "Fail to change crf, disabling quality governor: " << AVErrorString(result) << '.';
+		governor.reset();
+		governedCRF.store(-1, std::memory_order_relaxed);
+		return;
+	}
+	governedCRF.store(governor->CRF(), std::memory_order_relaxed);
+}
+
+bool CVideoRecorder::DetectSceneCut()
+{
+	const auto start = clock::now();
+	const double score = sceneDetector->Score(*dstFrame);
+	if (tracing.load(std::memory_order_relaxed))
+		Trace("SceneDetect", start, clock::now());
+	sceneScore.store(score, std::memory_order_relaxed);
+	if (!sceneDetector->Cut(score))
+		return false;
+	sceneCuts.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+// any Cleanup() but regular stop aborts record session
+void CVideoRecorder::Cleanup()
+{
+	recordAborted = true;
+	encoderLag.store(0, std::memory_order_relaxed);
+	governor.reset();
+	governedCRF.store(-1, std::memory_order_relaxed);
+	activeEncoder.store(nullptr, std::memory_order_relaxed);
+	activeFallback.store(0, std::memory_order_relaxed);
+	sceneDetector.reset();
+	sceneScore.store(0, std::memory_order_relaxed);
+	context.reset();
+	dstFrame.reset();
+	if (videoFile && videoFile->pb)
+		CloseOutput();
+	videoFile.reset();
+	spool.reset();
+	if (spill)
+	{
+		if (spill->PendingFrames())
+			DropFrames(spill->PendingFrames(), FrameLossReason::Error);
+		spill.reset();
+		spillBacklog.store(0, std::memory_order_relaxed);
+	}
+	convertBuffer.clear();
+	convertBuffer.shrink_to_fit();
+	SetMemory(MemoryCategory::Conversion, 0);
+	SetMemory(MemoryCategory::Encoder, 0);
+	SetMemory(MemoryCategory::VideoFrame, 0);
+	SetMemory(MemoryCategory::Muxer, 0);
+}
+
+#ifdef _WIN32
+typedef DirectX::WICCodecs ScreenshotCodec;
+static constexpr std::underlying_type<ScreenshotCodec>::type CODEC_DDS = 0xFFFF0001, CODEC_TGA = 0xFFFF0002;
+static constexpr ScreenshotCodec fallbackScreenshotCodec = ScreenshotCodec(CODEC_TGA);
+static constexpr std::pair<const wchar_t *, ScreenshotCodec> pictureFormats[] =
+{
+	{ L".bmp",	DirectX::WIC_CODEC_BMP			},
+	{ L".jpg",	DirectX::WIC_CODEC_JPEG			},
+	{ L".jpeg",	DirectX::WIC_CODEC_JPEG			},
+	{ L".png",	DirectX::WIC_CODEC_PNG			},
+	{ L".tif",	DirectX::WIC_CODEC_TIFF			},
+	{ L".tiff",	DirectX::WIC_CODEC_TIFF			},
+	{ L".gif",	DirectX::WIC_CODEC_GIF			},
+	{ L".hdp",	DirectX::WIC_CODEC_WMP			},
+	{ L".jxr",	DirectX::WIC_CODEC_WMP			},
+	{ L".wdp",	DirectX::WIC_CODEC_WMP			},
+	{ L".ico",	DirectX::WIC_CODEC_ICO			},
+	{ L".dds",	DirectX::WICCodecs(CODEC_DDS)	},
+	{ L".tga",	DirectX::WICCodecs(CODEC_TGA)	},
+};
+#else
+typedef Imaging::Codec ScreenshotCodec;
+static constexpr ScreenshotCodec fallbackScreenshotCodec = ScreenshotCodec::TGA;
+static constexpr std::pair<const wchar_t *, ScreenshotCodec> pictureFormats[] =
+{
+	{ L".bmp",	ScreenshotCodec::BMP	},
+	{ L".jpg",	ScreenshotCodec::JPEG	},
+	{ L".jpeg",	ScreenshotCodec::JPEG	},
+	{ L".png",	ScreenshotCodec::PNG	},
+	{ L".tif",	ScreenshotCodec::TIFF	},
+	{ L".tiff",	ScreenshotCodec::TIFF	},
+	{ L".dds",	ScreenshotCodec::DDS	},
+	{ L".tga",	ScreenshotCodec::TGA	},
+};
+#endif
+
+static ScreenshotCodec GetScreenshotCodec(std::wstring &&ext)
+{
+	std::transform(ext.begin(), ext.end(), ext.begin(), tolower);
+	const auto found = std::find_if(std::begin(pictureFormats), std::end(pictureFormats), [&ext](const std::remove_extent<decltype(pictureFormats)>::type &format)
+	{
+		return ext == format.first;
+	});
+	if (found == std::end(pictureFormats))
+	{
+		Log(LogSeverity::Warning) << "Unrecognized screenshot format \"" << ext << "\". Using \"tga\" as fallback.";
+		return fallbackScreenshotCodec;
+	}
+	else
+		return found->second;
+}
+
+#pragma region Task
+/*
+	tasks are stored inline in fixed capacity ring and dispatched via std::visit (no vtables, no heap)
+	they are moved in and out of the ring => no const data members
+*/
+
+#pragma region CFrameTask
+class CVideoRecorder::CFrameTask final
+{
+	friend void CFrame::Cancel();
+	friend void CVideoRecorder::RepeatLastFrame(decltype(CFrame::videoPendingFrames) videoPendingFrames, FrameLossReason reason);
+
+private:
+	std::shared_ptr<CFrame> sharedFrame;	// either shared or pooled frame owner is set
+	CFramePtr<CFrame> pooledFrame;
+	CFrame *srcFrame;
+	clock::time_point enqueueTime = clock::now();
+	size_t memoryCharge;	// accounted as MemoryCategory::QueuedFrames
+
+private:
+	void AccountRepeats(CVideoRecorder &parent) const;
+	bool Spill(CVideoRecorder &parent, bool sceneCut);
+	void RepeatSpilled(CVideoRecorder &parent);
+
+public:
+	CFrameTask(std::shared_ptr<CFrame> &&frame, size_t memoryCharge) noexcept : sharedFrame(std::move(frame)), srcFrame(sharedFrame.get()), memoryCharge(memoryCharge) { assert(srcFrame); }
+	CFrameTask(CFramePtr<CFrame> &&frame, size_t memoryCharge) noexcept : pooledFrame(std::move(frame)), srcFrame(pooledFrame.get()), memoryCharge(memoryCharge) { assert(srcFrame); }
+	CFrameTask(CFrameTask &&) noexcept = default;
+	CFrameTask &operator =(CFrameTask &&) noexcept = default;
+
+public:
+	static constexpr const char *traceName = "CFrameTask";
+	size_t MemoryCharge() const noexcept { return memoryCharge; }
+	void operator ()(CVideoRecorder &parent);
+	operator bool() const noexcept { return srcFrame->ready; }	// is task ready to handle
+};
+#pragma endregion
+
+#pragma region CStartVideoRecordRequest
+class CVideoRecorder::CStartVideoRecordRequest final
+{
+	std::wstring filename;
+	unsigned int width, height;
+	Codec codecID;
+	EncoderConfig config;
+	Format format;
+	FPS fps;
+	bool spool, matchedStop;
+	std::wstring spillFilename;
+	unsigned int spillDepth;
+	size_t spillMaxBytes;
+	GovernorConfig governorConfig;
+	SceneCutConfig sceneCut;
+	std::shared_ptr<const FallbackChain> fallback;
+
+private:
+	const AVCodec *OpenEncoder(CVideoRecorder &parent, Codec codecID, const EncoderConfig &config) const;
+	void AllocFrame(CVideoRecorder &parent, AVPixelFormat format) const;
+
+public:
+	// spool session ignores codec, config, spill, governor, scene cut detection and fallback
+	CStartVideoRecordRequest(std::wstring &&filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, EncoderConfig config, bool spool, bool matchedStop,
+		std::wstring &&spillFilename = {}, unsigned int spillDepth = 0, size_t spillMaxBytes = 0, GovernorConfig governorConfig = {}, SceneCutConfig sceneCut = {}, std::shared_ptr<const FallbackChain> fallback = {}) noexcept :
+		filename(std::move(filename)), width(width), height(height),
+		codecID(codec), config(config), format(format), fps(fps), spool(spool), matchedStop(matchedStop),
+		spillFilename(std::move(spillFilename)), spillDepth(spillDepth), spillMaxBytes(spillMaxBytes), governorConfig(governorConfig), sceneCut(sceneCut), fallback(std::move(fallback)) {}
+	CStartVideoRecordRequest(CStartVideoRecordRequest &&) noexcept = default;
+	CStartVideoRecordRequest &operator =(CStartVideoRecordRequest &&) noexcept = default;
+
+public:
+	static constexpr const char *traceName = "CStartVideoRecordRequest";
+	void operator ()(CVideoRecorder &parent);
+};
+#pragma endregion
+
+#pragma region CStopVideoRecordRequest
+class CVideoRecorder::CStopVideoRecordRequest final
+{
+	bool matchedStart;
 
 public:
 	CStopVideoRecordRequest(bool matchedStart) noexcept : matchedStart(matchedStart) {}
-	CStopVideoRecordRequest(CStopVideoRecordRequest &&) noexcept = default;
 
 public:
-	void operator ()(CVideoRecorder &parent) override;
+	static constexpr const char *traceName = "CStopVideoRecordRequest";
+	void operator ()(CVideoRecorder &parent);
 };
 #pragma endregion
 
-void CVideoRecorder::CFrameTask::operator ()(CVideoRecorder &parent)
+#pragma region CEncodeSpoolRequest
+class CVideoRecorder::CEncodeSpoolRequest final
+{
+	std::wstring spoolFilename, filename;
+	Codec codecID;
+	EncoderConfig config;
+	std::shared_ptr<const FallbackChain> fallback;
+	int64_t firstPts, lastPts;	// spool timeline range to encode, inclusive
+	unsigned int cancelEpoch;	// CVideoRecorder::spoolCancelEpoch at enqueue time
+
+private:
+	bool Canceled(const CVideoRecorder &parent) const noexcept { return parent.spoolCancelEpoch.load(std::memory_order_relaxed) != cancelEpoch; }
+
+public:
+	CEncodeSpoolRequest(std::wstring &&spoolFilename, std::wstring &&filename, Codec codec, EncoderConfig config, std::shared_ptr<const FallbackChain> fallback, int64_t firstPts, int64_t lastPts, unsigned int cancelEpoch) noexcept :
+		spoolFilename(std::move(spoolFilename)), filename(std::move(filename)), codecID(codec), config(config), fallback(std::move(fallback)), firstPts(firstPts), lastPts(lastPts), cancelEpoch(cancelEpoch) {}
+	CEncodeSpoolRequest(CEncodeSpoolRequest &&) noexcept = default;
+	CEncodeSpoolRequest &operator =(CEncodeSpoolRequest &&) noexcept = default;
+
+public:
+	static constexpr const char *traceName = "CEncodeSpoolRequest";
+	void operator ()(CVideoRecorder &parent);
+};
+#pragma endregion
+
+#pragma region CReconfigureRequest
+class CVideoRecorder::CReconfigureRequest final
+{
+	RateControl rateControl;
+
+private:
+	bool InPlace(const AVCodecContext &context) const noexcept;
+	void Apply(AVCodecContext &context) const;
+	bool Reopen(CVideoRecorder &parent) const;
+
+public:
+	explicit CReconfigureRequest(RateControl rateControl) noexcept : rateControl(rateControl) {}
+
+public:
+	static constexpr const char *traceName = "CReconfigureRequest";
+	void operator ()(CVideoRecorder &parent);
+};
+#pragma endregion
+
+#pragma region CTaskQueue
+class CVideoRecorder::CTaskQueue
+{
+public:
+	typedef std::variant<std::monostate, CFrameTask, CStartVideoRecordRequest, CStopVideoRecordRequest, CEncodeSpoolRequest, CReconfigureRequest> Task;
+
+private:
+	Task items[taskQueueCapacity];
+	unsigned int head = 0, count = 0;
+
+public:
+	bool empty() const noexcept { return !count; }
+	bool full() const noexcept { return count == taskQueueCapacity; }
+	unsigned int size() const noexcept { return count; }
+	Task &operator [](unsigned int idx) noexcept { assert(idx < count); return items[(head + idx) % taskQueueCapacity]; }
+	Task &front() noexcept { return operator [](0); }
+	Task &back() noexcept { return operator [](count - 1); }
+
+public:
+	template<class SpecificTask>
+	void push_back(SpecificTask &&task) noexcept;
+	void pop_front() noexcept;
+	void erase(unsigned int idx) noexcept;
+};
+
+template<class SpecificTask>
+inline void CVideoRecorder::CTaskQueue::push_back(SpecificTask &&task) noexcept
+{
+	assert(!full());
+	items[(head + count++) % taskQueueCapacity].emplace<std::decay_t<SpecificTask>>(std::move(task));
+}
+
+inline void CVideoRecorder::CTaskQueue::pop_front() noexcept
+{
+	assert(count);
+	items[head].emplace<std::monostate>();
+	head = (head + 1) % taskQueueCapacity, count--;
+}
+
+void CVideoRecorder::CTaskQueue::erase(unsigned int idx) noexcept
 {
-	using namespace DirectX;
+	for (; idx + 1 < count; idx++)
+		operator [](idx) = std::move(operator [](idx + 1));
+	count--;
+	items[(head + count) % taskQueueCapacity].emplace<std::monostate>();
+}
+#pragma endregion
 
+void CVideoRecorder::CFrameTask::operator ()(CVideoRecorder &parent)
+{
+	const auto start = clock::now();
+	parent.RecordLatency(Stage::QueueWait, enqueueTime, start);
 	auto srcFrameData = srcFrame->GetFrameData();
-	if (!srcFrameData.pixels)
+	parent.RecordLatency(Stage::GetFrameData, start, clock::now());
+	if (srcFrameData.pixels)
+		parent.frameBytesEstimate.store(srcFrameData.stride * srcFrameData.height, std::memory_order_relaxed);
+	else
 	{
-		wcerr << "Invalid frame occured. Skipping it." << endl;
+		Log(LogSeverity::Warning) << "Invalid frame occured. Skipping it.";
+		if (parent.videoFile || parent.spool || parent.recordAborted)
+			parent.DropFrames(srcFrame->videoPendingFrames, FrameLossReason::Error);
 		return;
 	}
 
-	while (!srcFrame->screenshotPaths.empty())
+	for (const auto &screenshotFilename : srcFrame->screenshotPaths)
 	{
-		wclog << "Saving screenshot \"" << srcFrame->screenshotPaths.front() << "\"..." << endl;
+		Log(LogSeverity::Info) << "Saving screenshot \"" << screenshotFilename << "\"...";
 
 		try
 		{
-			std::tr2::sys::path screenshotPath(srcFrame->screenshotPaths.front());
-			const auto screenshotCodec = GetScreenshotCodec(screenshotPath.extension());
+			const std::filesystem::path screenshotPath(screenshotFilename);
+			const auto screenshotCodec = GetScreenshotCodec(screenshotPath.extension().wstring());
 
+#ifdef _WIN32
+			using namespace DirectX;
 			const Image image =
 			{
 				srcFrameData.width, srcFrameData.height, GetDXGIFormat(srcFrameData.format),
@@ -374,272 +1393,886 @@ void CVideoRecorder::CFrameTask::operator ()(CVideoRecorder &parent)
 			switch (screenshotCodec)
 			{
 			case CODEC_DDS:
-				CheckHR(SaveToDDSFile(image, DDS_FLAGS_NONE, srcFrame->screenshotPaths.front().c_str()));
+				CheckHR(SaveToDDSFile(image, DDS_FLAGS_NONE, screenshotFilename.c_str()));
 				break;
 			case CODEC_TGA:
-				CheckHR(SaveToTGAFile(image, srcFrame->screenshotPaths.front().c_str()));
+				CheckHR(SaveToTGAFile(image, screenshotFilename.c_str()));
 				break;
 			default:
-				CheckHR(SaveToWICFile(image, WIC_FLAGS_NONE, GetWICCodec(screenshotCodec), srcFrame->screenshotPaths.front().c_str()));
+				CheckHR(SaveToWICFile(image, WIC_FLAGS_NONE, GetWICCodec(screenshotCodec), screenshotFilename.c_str()));
 				break;
 			}
+#else
+			Imaging::Save(srcFrameData, screenshotCodec, screenshotPath, parent.simdLevel.load(std::memory_order_relaxed));
+#endif
+
+			Log(LogSeverity::Info) << "Screenshot \"" << screenshotFilename << "\" has been saved.";
+		}
+#ifdef _WIN32
+		catch (HRESULT hr)
+		{
+			Log(LogSeverity::Error) << screenshotErrorMsgPrefix << screenshotFilename << "\" (hr=" << hr << ").";
+		}
+#endif
+		catch (const std::exception &error)
+		{
+			Log(LogSeverity::Error) << screenshotErrorMsgPrefix << screenshotFilename << ": " << error.what() << '.';
+		}
+	}
+	srcFrame->screenshotPaths.clear();
+
+	if (srcFrame->videoPendingFrames && parent.recordAborted)
+		parent.DropFrames(srcFrame->videoPendingFrames, FrameLossReason::Error);
+	else if (srcFrame->videoPendingFrames && (parent.videoFile || parent.spool))
+	{
+		// frames of this task not encoded yet are lost along with the rest of the session
+		const auto Abort = [&]
+		{
+			parent.DropFrames(srcFrame->videoPendingFrames, FrameLossReason::Error);
+			parent.Cleanup();
+		};
+
+		static constexpr char convertErrorMsgPrefix[] = "Fail to convert frame for video";
+
+		AVPixelFormat srcVideoFormat = AV_PIX_FMT_BGRA;
+		switch (srcFrameData.format)
+		{
+		case FrameFormat::R10G10B10A2:
+		{
+			// 10 bit target keeps full precision via 16 bit intermediate
+			const bool deep = parent.dstFrame->format == AV_PIX_FMT_YUV420P10;
+			const size_t stride = (srcFrameData.width * (deep ? 8 : 4) + cache_line - 1) & ~size_t(cache_line - 1);
+			try
+			{
+				parent.convertBuffer.resize(stride * srcFrameData.height);
+			}
+			catch (const std::bad_alloc &)
+			{
+				Log(LogSeverity::Error) << convertErrorMsgPrefix << " (out of memory).";
+				Abort();
+				return;
+			}
+			parent.SetMemory(MemoryCategory::Conversion, parent.convertBuffer.capacity());
+			const auto start = clock::now();
+			if (deep)
+			{
+				Imaging::ConvertToR16G16B16A16(srcFrameData, parent.convertBuffer.data(), stride, parent.simdLevel.load(std::memory_order_relaxed));
+				srcVideoFormat = AV_PIX_FMT_RGBA64;
+			}
+			else
+				Imaging::ConvertToB8G8R8A8(srcFrameData, parent.convertBuffer.data(), stride, parent.simdLevel.load(std::memory_order_relaxed));
+			const auto finish = clock::now();
+			parent.RecordLatency(Stage::Convert, start, finish);
+			if (parent.tracing.load(std::memory_order_relaxed))
+				parent.Trace("Convert", start, finish);
+			srcFrameData.stride = stride;
+			srcFrameData.pixels = parent.convertBuffer.data();
+			break;
+		}
+		case FrameFormat::B8G8R8A8:
+			break;	// scaler takes it directly
+		}
+
+		parent.cvtCtx.reset(sws_getCachedContext(parent.cvtCtx.release(),
+			srcFrameData.width, srcFrameData.height, srcVideoFormat,
+			parent.dstFrame->width, parent.dstFrame->height, AVPixelFormat(parent.dstFrame->format),
+			SWS_BILINEAR, NULL, NULL, NULL));
+		assert(parent.cvtCtx);
+		if (!parent.cvtCtx)
+		{
+			Log(LogSeverity::Error) << convertErrorMsgPrefix << '.';
+			Abort();
+			return;
+		}
+		const int srcStride = srcFrameData.stride;
+		const auto Scale = [&]
+		{
+			const auto scaleStart = clock::now();
+			sws_scale(parent.cvtCtx.get(), reinterpret_cast<const uint8_t *const*>(&srcFrameData.pixels), &srcStride, 0, srcFrameData.height, parent.dstFrame->data, parent.dstFrame->linesize);
+			const auto scaleFinish = clock::now();
+			parent.RecordLatency(Stage::Scale, scaleStart, scaleFinish);
+			if (parent.tracing.load(std::memory_order_relaxed))
+				parent.Trace("Scale", scaleStart, scaleFinish);
+		};
+		Scale();
+
+		// decided before frame is spooled, spilled or encoded => all paths force keyframe at the same frame
+		const bool sceneCut = parent.sceneDetector && parent.DetectSceneCut();
+
+		if (parent.spool)
+		{
+			// stored once, repeats are materialized by EncodeSpool()
+			const auto spoolStart = clock::now();
+			try
+			{
+				parent.spool->Append(*parent.dstFrame, parent.dstFrame->pts, (unsigned int)srcFrame->videoPendingFrames);
+			}
+			catch (const std::exception &error)
+			{
+				Log(LogSeverity::Error) << "Fail to write frame to spool: " << error.what() << '.';
+				Abort();
+				return;
+			}
+			const auto spoolFinish = clock::now();
+			parent.RecordLatency(Stage::Mux, spoolStart, spoolFinish);
+			if (parent.tracing.load(std::memory_order_relaxed))
+				parent.Trace("Spool", spoolStart, spoolFinish);
+			parent.bytesWritten.fetch_add(parent.spool->RecordSize(), std::memory_order_relaxed);
+			parent.framesEncoded.fetch_add(srcFrame->videoPendingFrames, std::memory_order_relaxed);
+			AccountRepeats(parent);
+			parent.dstFrame->pts += srcFrame->videoPendingFrames;
+			srcFrame->videoPendingFrames = 0;
+			return;
+		}
+
+		// once anything is spilled following frames go there too to keep order
+		if (parent.spill && (!parent.spill->Empty() || parent.pendingFrameTasks.load(std::memory_order_relaxed) > parent.spill->Depth()))
+		{
+			if (parent.spill->Full())
+			{
+				RepeatSpilled(parent);
+				return;
+			}
+			if (Spill(parent, sceneCut))
+				return;
+			// spilled frames go first, then this one is encoded directly
+			if (!parent.DrainSpill())
+			{
+				Abort();
+				return;
+			}
+			if (!parent.MakeWritable(*parent.dstFrame))
+			{
+				Abort();
+				return;
+			}
+			Scale();	// draining has overwritten converted frame
+		}
+
+		const auto frames = srcFrame->videoPendingFrames;
+		bool duplicate = false;
+		parent.dstFrame->pict_type = sceneCut ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;	// duplicates are regular frames
+		do
+		{
+			if (!parent.MakeWritable(*parent.dstFrame) || !parent.Encode(parent.dstFrame.get()))
+			{
+				Abort();
+				return;
+			}
+			parent.framesEncoded.fetch_add(1, std::memory_order_relaxed);
+			parent.dstFrame->pict_type = AV_PICTURE_TYPE_NONE;
+			if (duplicate)
+			{
+				// sum of duplicates[] >= videoPendingFrames - 1 (screenshot only task may get folded frames)
+				unsigned int reason = 0;
+				while (!srcFrame->duplicates[reason])
+					reason++;
+				assert(reason < frameLossReasonCount);
+				srcFrame->duplicates[reason]--;
+				parent.framesDuplicatedBy[reason].fetch_add(1, std::memory_order_relaxed);
+			}
+			duplicate = true;
+			parent.dstFrame->pts++;
+		} while (--srcFrame->videoPendingFrames);
+
+		if (parent.governor)
+			parent.GovernQuality(start, (unsigned int)frames);
+	}
+}
+
+// accounts duplicates of frame stored once for videoPendingFrames slots, same reason order as encoding loop
+void CVideoRecorder::CFrameTask::AccountRepeats(CVideoRecorder &parent) const
+{
+	auto repeats = srcFrame->videoPendingFrames - 1;
+	for (unsigned int reason = 0; repeats; reason++)
+	{
+		assert(reason < frameLossReasonCount);
+		const auto duplicates = std::min(srcFrame->duplicates[reason], repeats);
+		srcFrame->duplicates[reason] -= duplicates;
+		parent.framesDuplicatedBy[reason].fetch_add(duplicates, std::memory_order_relaxed);
+		repeats -= duplicates;
+	}
+}
+
+// stores converted frame for later encoding, false if spill failed (spill is left unchanged)
+bool CVideoRecorder::CFrameTask::Spill(CVideoRecorder &parent, bool sceneCut)
+{
+	const auto spillStart = clock::now();
+	try
+	{
+		parent.spill->Push(*parent.dstFrame, parent.dstFrame->pts, (unsigned int)srcFrame->videoPendingFrames, sceneCut ? Spool::forceKeyframe : 0);
+	}
+	catch (const std::exception &error)
+	{
+		Log(LogSeverity::Warning) << "Fail to spill frame, encoding it directly: " << error.what() << '.';
+		return false;
+	}
+	const auto spillFinish = clock::now();
+	parent.RecordLatency(Stage::Mux, spillStart, spillFinish);
+	if (parent.tracing.load(std::memory_order_relaxed))
+		parent.Trace("Spill", spillStart, spillFinish);
+	parent.framesSpilled.fetch_add(srcFrame->videoPendingFrames, std::memory_order_relaxed);
+	parent.spillBacklog.store(parent.spill->PendingFrames(), std::memory_order_relaxed);
+	AccountRepeats(parent);
+	parent.dstFrame->pts += srcFrame->videoPendingFrames;
+	srcFrame->videoPendingFrames = 0;
+	return true;
+}
+
+// spill size cap reached => frame is turned into repeats of last spilled one like producer does under memory budget
+void CVideoRecorder::CFrameTask::RepeatSpilled(CVideoRecorder &parent)
+{
+	parent.spill->Repeat((unsigned int)srcFrame->videoPendingFrames);
+	AccountRepeats(parent);
+	parent.framesDuplicatedBy[(unsigned int)FrameLossReason::MemoryBudget].fetch_add(1, std::memory_order_relaxed);	// frame itself
+	parent.RecordFrameEvent(FrameEventType::Duplicated, FrameLossReason::MemoryBudget, 1);
+	parent.framesSpilled.fetch_add(srcFrame->videoPendingFrames, std::memory_order_relaxed);
+	parent.spillBacklog.store(parent.spill->PendingFrames(), std::memory_order_relaxed);
+	parent.dstFrame->pts += srcFrame->videoPendingFrames;
+	srcFrame->videoPendingFrames = 0;
+}
 
-			wclog << "Screenshot \"" << srcFrame->screenshotPaths.front() << "\" has been saved." << endl;
-		}
-		catch (HRESULT hr)
+// configures and opens encoder context, container should be created already (dictates codec flags), throws like operator ()
+const AVCodec *CVideoRecorder::CStartVideoRecordRequest::OpenEncoder(CVideoRecorder &parent, Codec codecID, const EncoderConfig &config) const
+{
+	const AVCodec *const codec = FindEncoder(codecID, config.nv);
+	if (!codec)
+		throw "Fail to find codec";
+
+	parent.context.reset(avcodec_alloc_context3(codec));
+	if (!parent.context)
+		throw "Fail to init codec";
+
+	parent.context->width = width & ~1;
+	parent.context->height = height & ~1;
+	parent.context->time_base = { 1, (int)fps };
+	parent.context->framerate = { (int)fps, 1 };
+#if ENABLE_10BIT_TARGET_FORMAT
+	parent.context->pix_fmt = GetAVFormat(format);
+#else
+	parent.context->pix_fmt = AV_PIX_FMT_YUV420P;
+#endif
+	if (const auto availableThreads = std::thread::hardware_concurrency())
+		parent.context->thread_count = availableThreads;	// TODO: consider reserving 1 or more threads for other stuff
+
+	if (config.nv)
+	{
+		if (config.nvenc.cq != -1)
 		{
-			wcerr << screenshotErrorMsgPrefix << srcFrame->screenshotPaths.front() << "\" (hr=" << hr << ")." << endl;
+			const int result = av_opt_set_int(parent.context.get(), "cq", config.nvenc.cq, AV_OPT_SEARCH_CHILDREN);
+			assert(result == 0);
+			if (result < 0)
+				Log(LogSeverity::Error) << "Fail to set cq for video \"" << filename << "\": " << parent.AVErrorString(result) << '.';
 		}
-		catch (const std::exception &error)
+
+		if (config.nvenc.preset != PresetNV::Default)
 		{
-			wcerr << screenshotErrorMsgPrefix << srcFrame->screenshotPaths.front() << ": " << error.what() << '.' << endl;
+			if (const char *const presetStr = EncodePreset_2_Str(config.nvenc.preset))
+			{
+				const int result = av_opt_set(parent.context->priv_data, "preset", presetStr, 0);
+				assert(result == 0);
+				if (result < 0)
+					Log(LogSeverity::Error) << "Fail to set preset for video \"" << filename << "\": " << parent.AVErrorString(result) << '.';
+			}
+			else
+				Log(LogSeverity::Error) << "Invalid encode preset value for video \"" << filename << "\".";
 		}
-
-		srcFrame->screenshotPaths.pop();
 	}
-
-	if (srcFrame->videoPendingFrames && parent.videoFile)
+	else
 	{
-		static constexpr char convertErrorMsgPrefix[] = "Fail to convert frame for video";
-		av_init_packet(parent.packet.get());
-		parent.packet->data = NULL;
-		parent.packet->size = 0;
-
-		AVPixelFormat srcVideoFormat = AV_PIX_FMT_BGRA;
-		ScratchImage convertedImage;
-		switch (srcFrameData.format)
+		if (config.x264_265.crf != -1)
 		{
-		case FrameFormat::R10G10B10A2:
+			const int result = av_opt_set_int(parent.context.get(), "crf", config.x264_265.crf, AV_OPT_SEARCH_CHILDREN);
+			assert(result == 0);
+			if (result < 0)
+				Log(LogSeverity::Error) << "Fail to set crf for video \"" << filename << "\": " << parent.AVErrorString(result) << '.';
+		}
+
+		if (config.x264_265.preset != Preset::Default)
 		{
-			const Image srcImage =
-			{
-				srcFrameData.width, srcFrameData.height, GetDXGIFormat(srcFrameData.format),
-				srcFrameData.stride, srcFrameData.stride * srcFrameData.height, const_cast<uint8_t *>(reinterpret_cast<const uint8_t *>(srcFrameData.pixels))
-			};
-			const auto intermediateDXFormat = parent.dstFrame->format == AV_PIX_FMT_YUV420P10 ? (srcVideoFormat = AV_PIX_FMT_RGBA64, DXGI_FORMAT_R16G16B16A16_UNORM) : DXGI_FORMAT_B8G8R8A8_UNORM;
-			const HRESULT hr = Convert(srcImage, intermediateDXFormat, TEX_FILTER_DEFAULT, .5f, convertedImage);
-			if (FAILED(hr))
+			if (const char *const presetStr = EncodePreset_2_Str(config.x264_265.preset))
 			{
-				wcerr << convertErrorMsgPrefix << " (hr=" << hr << ")." << endl;
-				parent.Cleanup();
-				return;
+				const int result = av_opt_set(parent.context->priv_data, "preset", presetStr, 0);
+				assert(result == 0);
+				if (result < 0)
+					Log(LogSeverity::Error) << "Fail to set preset for video \"" << filename << "\": " << parent.AVErrorString(result) << '.';
 			}
-			const auto resultImage = convertedImage.GetImage(0, 0, 0);
-			srcFrameData.stride = resultImage->rowPitch;
-			srcFrameData.pixels = resultImage->pixels;
-			break;
-		}
+			else
+				Log(LogSeverity::Error) << "Invalid encode preset value for video \"" << filename << "\".";
 		}
+	}
 
-		parent.cvtCtx.reset(sws_getCachedContext(parent.cvtCtx.release(),
-			srcFrameData.width, srcFrameData.height, srcVideoFormat,
-			parent.dstFrame->width, parent.dstFrame->height, AVPixelFormat(parent.dstFrame->format),
-			SWS_BILINEAR, NULL, NULL, NULL));
-		assert(parent.cvtCtx);
-		if (!parent.cvtCtx)
+	// recorder detects scene cuts => forced frames become IDR, encoder detection is off and lookahead is shortened
+	if (sceneCut.threshold > 0)
+	{
+		// options are encoder specific, those unknown to current encoder are skipped
+		const auto SetOption = [&](const char name[], const char value[])
 		{
-			wcerr << convertErrorMsgPrefix << '.' << endl;
-			parent.Cleanup();
-			return;
-		}
-		const int srcStride = srcFrameData.stride;
-		sws_scale(parent.cvtCtx.get(), reinterpret_cast<const uint8_t *const*>(&srcFrameData.pixels), &srcStride, 0, srcFrameData.height, parent.dstFrame->data, parent.dstFrame->linesize);
-		convertedImage.Release();
-
-		do
+			const int result = av_opt_set(parent.context.get(), name, value, AV_OPT_SEARCH_CHILDREN);
+			if (result < 0 && result != AVERROR_OPTION_NOT_FOUND)
+				Log(LogSeverity::Error) << "Fail to set " << name << " for video \"" << filename << "\": " << parent.AVErrorString(result) << '.';
+		};
+		const std::string lookahead = std::to_string(sceneCut.lookahead);
+		SetOption("forced-idr", "1");
+		if (std::strcmp(codec->name, "libx265") == 0)
+			SetOption("x265-params", sceneCut.lookahead != -1 ? ("scenecut=0:rc-lookahead=" + lookahead).c_str() : "scenecut=0");
+		else
 		{
-			const int result = av_frame_make_writable(parent.dstFrame.get());
-			assert(result == 0);
-			if (result < 0)
-			{
-				wcerr << "Fail to prepare video frame for writing: " << parent.AVErrorString(result) << '.' << endl;
-				parent.Cleanup();
-				return;
-			}
-			if (!parent.Encode())
-			{
-				parent.Cleanup();
-				return;
-			}
-			parent.dstFrame->pts++;
-		} while (--srcFrame->videoPendingFrames);
+			SetOption("sc_threshold", "0");	// libx264
+			SetOption("no-scenecut", "1");	// NVENC
+			if (sceneCut.lookahead != -1)
+				SetOption("rc-lookahead", lookahead.c_str());
+		}
 	}
+
+	if (parent.videoFile->oformat->flags & AVFMT_GLOBALHEADER)
+		parent.context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+#ifdef VIDEO_RECORDER_TEST_HOOKS
+	if (unopenableEncoders.load(std::memory_order_relaxed) >> ((unsigned int)codecID * 2 + config.nv) & 1)
+		parent.CheckAVResultImpl(AVERROR_EXTERNAL, "Fail to open codec");	// stub backend found but unusable like NVENC without GPU/driver
+#endif
+	// found encoder may still fail to open (e.g. NVENC without GPU/driver) => expected failure handled by fallback, no assert
+	parent.CheckAVResultImpl(avcodec_open2(parent.context.get(), codec, NULL), "Fail to open codec");
+	return codec;
+}
+
+// even dimensions as required by 4:2:0
+void CVideoRecorder::CStartVideoRecordRequest::AllocFrame(CVideoRecorder &parent, AVPixelFormat format) const
+{
+	parent.dstFrame.reset(av_frame_alloc());
+	assert(parent.dstFrame);
+	if (!parent.dstFrame)
+		throw "Fail to allocate frame";
+
+	parent.dstFrame->format = format;
+	parent.dstFrame->width = width & ~1;
+	parent.dstFrame->height = height & ~1;
+	parent.dstFrame->pts = 0;
+
+	parent.CheckAVResult(av_frame_get_buffer(parent.dstFrame.get(), cache_line), 0, "Fail to allocate frame data");
+	parent.SetMemory(MemoryCategory::VideoFrame, av_image_get_buffer_size(format, parent.dstFrame->width, parent.dstFrame->height, cache_line));
 }
 
 void CVideoRecorder::CStartVideoRecordRequest::operator ()(CVideoRecorder &parent)
 {
 	if (!matchedStop)
-		wcerr << "Starting new video record session without stopping previouse one." << endl;
+		Log(LogSeverity::Warning) << "Starting new video record session without stopping previouse one.";
 
-	if (parent.videoFile)
+	if (parent.videoFile || parent.spool)
 	{
 		CStopVideoRecordRequest stopRecord(true);
 		stopRecord(parent);
 	}
 
+	for (unsigned int stage = 0; stage < stageCount; stage++)
+		parent.latencyHistograms[stage].Reset();
+	parent.recordAborted = false;
+
 	try
 	{
-		const AVCodec *const codec = FindEncoder(codecID, config.nv);
-		if (!codec)
-			throw "Fail to find codec";
-
-		parent.context.reset(avcodec_alloc_context3(codec));
-		if (!parent.context)
-			throw "Fail to init codec";
-
-		parent.context->width = width & ~1;
-		parent.context->height = height & ~1;
-		parent.context->time_base = { 1, (int)fps };
+		if (spool)
+		{
 #if ENABLE_10BIT_TARGET_FORMAT
-		parent.context->pix_fmt = GetAVFormat(format);
+			const Format spoolFormat = format;
 #else
-		parent.context->pix_fmt = AV_PIX_FMT_YUV420P;
+			const Format spoolFormat = Format::_8bit;
 #endif
-		if (const auto availableThreads = std::thread::hardware_concurrency())
-			parent.context->thread_count = availableThreads;	// TODO: consider reserving 1 or more threads for other stuff
+			AllocFrame(parent, GetAVFormat(spoolFormat));
+			parent.spool = std::make_unique<CSpoolWriter>(std::filesystem::path(filename), parent.dstFrame->width, parent.dstFrame->height, spoolFormat, fps);
+			Log(LogSeverity::Info) << "Spooling video \"" << filename << "\"...";
+			return;
+		}
+
+		const std::string convertedFilename = std::wstring_convert<std::codecvt_utf8<wchar_t>>().to_bytes(filename);
+
+		// container goes first as it dictates codec flags, stream parameters are then taken from opened codec
+		{
+			AVFormatContext *output;
+			parent.CheckAVResult(avformat_alloc_output_context2(&output, NULL, NULL, convertedFilename.c_str()), "Fail to init output context");
+			parent.videoFile.reset(output);
+		}
 
-		if (config.nv)
+		// requested encoder, then validated fallback chain
+		Codec activeCodecID = codecID;
+		EncoderConfig activeConfig = config;
+		unsigned int fallbackIdx = 0, position = 0;
+		const auto Fallback = [&](const char error[], const int *result)
 		{
-			if (config.nvenc.cq != -1)
+			if (!fallback || fallbackIdx == fallback->size())
+				return false;
+			auto log = Log(LogSeverity::Warning);	// submitted on destruction
+			log << error << " for video \"" << filename << '\"';
+			if (result)
+				log << ": " << parent.AVErrorString(*result);
+			const auto &entry = (*fallback)[fallbackIdx++];
+			log << ", falling back to encoder #" << entry.position << '.';
+			activeCodecID = entry.codec;
+			activeConfig = entry.config;
+			position = entry.position;
+			return true;
+		};
+		const AVCodec *codec;
+		for (;;)
+			try
 			{
-				const int result = av_opt_set_int(parent.context.get(), "cq", config.nvenc.cq, AV_OPT_SEARCH_CHILDREN);
-				assert(result == 0);
-				if (result < 0)
-					wcerr << "Fail to set cq for video \"" << filename << "\": " << parent.AVErrorString(result) << '.' << endl;
+				codec = OpenEncoder(parent, activeCodecID, activeConfig);
+				break;
 			}
-
-			if (config.nvenc.preset != PresetNV::Default)
+			catch (const char error[])
 			{
-				if (const char *const presetStr = EncodePreset_2_Str(config.nvenc.preset))
-				{
-					const int result = av_opt_set(parent.context->priv_data, "preset", presetStr, 0);
-					assert(result == 0);
-					if (result < 0)
-						wcerr << "Fail to set preset for video \"" << filename << "\": " << parent.AVErrorString(result) << '.' << endl;
-				}
-				else
-					wcerr << "Invalid encode preset value for video \"" << filename << "\"." << endl;
+				if (!Fallback(error, nullptr))
+					throw;
 			}
-		}
-		else
+			catch (const std::pair<const char *, int> error)
+			{
+				if (!Fallback(error.first, &error.second))
+					throw;
+			}
+		parent.activeEncoder.store(codec->name, std::memory_order_relaxed);
+		parent.activeFallback.store(position, std::memory_order_relaxed);
+
+		Log(LogSeverity::Info) << "Recording video \"" << filename << "\" (using " << codec->name << " with " << parent.context->thread_count << " threads for encoding)...";
+
+		AllocFrame(parent, parent.context->pix_fmt);
+
+		parent.videoStream = avformat_new_stream(parent.videoFile.get(), NULL);
+		assert(parent.videoStream);
+		if (!parent.videoStream)
+			throw "Fail to add video stream";
+		parent.CheckAVResult(avcodec_parameters_from_context(parent.videoStream->codecpar, parent.context.get()), "Fail to extract codec parameters");
+		parent.videoStream->time_base = parent.context->time_base;
+		parent.videoStream->avg_frame_rate = parent.context->framerate;
+
+		parent.CheckAVResult(parent.OpenOutput(convertedFilename.c_str()), "Fail to create file");
+		parent.SetMemory(MemoryCategory::Muxer, parent.videoFile->pb->buffer_size);
+		parent.CheckMemoryBudget();
+		parent.CheckAVResult(avformat_write_header(parent.videoFile.get(), NULL), AVSTREAM_INIT_IN_WRITE_HEADER, "Fail to write header");
+
+		if (sceneCut.threshold > 0)
+			parent.sceneDetector = std::make_unique<CSceneDetector>(sceneCut.threshold);
+
+		// optional => failure degrades to regular frame dropping/duplication
+		if (spillDepth)
 		{
-			if (config.x264_265.crf != -1)
+			const Format spillFormat = parent.dstFrame->format == AV_PIX_FMT_YUV420P10 ? Format::_10bit : Format::_8bit;
+			try
 			{
-				const int result = av_opt_set_int(parent.context.get(), "crf", config.x264_265.crf, AV_OPT_SEARCH_CHILDREN);
-				assert(result == 0);
-				if (result < 0)
-					wcerr << "Fail to set crf for video \"" << filename << "\": " << parent.AVErrorString(result) << '.' << endl;
+				parent.spill = std::make_unique<CSpill>(std::filesystem::path(spillFilename), parent.dstFrame->width, parent.dstFrame->height, spillFormat, spillDepth, spillMaxBytes);
+			}
+			catch (const std::exception &error)
+			{
+				Log(LogSeverity::Warning) << "Fail to create spill file \"" << spillFilename << "\", recording without spill: " << error.what() << '.';
 			}
+		}
 
-			if (config.x264_265.preset != Preset::Default)
+		if (governorConfig.minCRF != -1)
+		{
+			// other encoders (x265, NVENC) do not reconfigure rate control mid-stream via libavcodec
+			if (!activeConfig.nv && std::strcmp(codec->name, "libx264") == 0)
 			{
-				if (const char *const presetStr = EncodePreset_2_Str(config.x264_265.preset))
+				static constexpr int64_t x264DefaultCRF = 23;
+				parent.governor = std::make_unique<CQualityGovernor>(governorConfig, activeConfig.x264_265.crf != -1 ? activeConfig.x264_265.crf : x264DefaultCRF, fps);
+				parent.governedCRF.store(parent.governor->CRF(), std::memory_order_relaxed);
+				if (parent.governor->CRF() != activeConfig.x264_265.crf)
 				{
-					const int result = av_opt_set(parent.context->priv_data, "preset", presetStr, 0);
+					const int result = av_opt_set_double(parent.context->priv_data, "crf", double(parent.governor->CRF()), 0);
 					assert(result == 0);
 					if (result < 0)
-						wcerr << "Fail to set preset for video \"" << filename << "\": " << parent.AVErrorString(result) << '.' << endl;
+						Log(LogSeverity::Error) << "Fail to set crf for video \"" << filename << "\": " << parent.AVErrorString(result) << '.';
 				}
-				else
-					wcerr << "Invalid encode preset value for video \"" << filename << "\"." << endl;
 			}
+			else
+				Log(LogSeverity::Warning) << "Encoder \"" << codec->name << "\" does not support quality governor, recording video \"" << filename << "\" with fixed quality.";
+		}
+	}
+	catch (const char error[])
+	{
+		Log(LogSeverity::Error) << error << " for video \"" << filename << "\".";
+		parent.Cleanup();
+	}
+	catch (const std::pair<const char *, int> error)
+	{
+		Log(LogSeverity::Error) << error.first << " for video \"" << filename << "\": " << parent.AVErrorString(error.second) << '.';
+		parent.Cleanup();
+	}
+	catch (const std::exception &error)	// catches exception during string conversion
+	{
+		Log(LogSeverity::Error) << "Fail to start record video \"" << filename << "\": " << error.what() << '.';
+		parent.Cleanup();
+	}
+}
+
+void CVideoRecorder::CStopVideoRecordRequest::operator ()(CVideoRecorder &parent)
+{
+	if (!matchedStart)
+		Log(LogSeverity::Warning) << "Stopping video record without matched start.";
+
+	parent.recordAborted = false;
+	if (parent.spool)
+	{
+		bool ok = true;
+		try
+		{
+			parent.spool->Finish();
+		}
+		catch (const std::exception &error)
+		{
+			Log(LogSeverity::Error) << "Fail to write spool index: " << error.what() << '.';
+			ok = false;
+		}
+
+		parent.Cleanup();
+		parent.recordAborted = false;
+
+		if (ok)
+			Log(LogSeverity::Info) << "Video has been spooled.";
+		else
+			Log(LogSeverity::Error) << "Fail to spool video.";
+		return;
+	}
+	if (!parent.videoFile)
+		return;
+
+	if (parent.spill && !parent.DrainSpill())
+	{
+		parent.recordAborted = false;
+		Log(LogSeverity::Error) << "Fail to record video.";
+		return;
+	}
+
+	bool ok = parent.Encode(NULL);
+
+	int result = av_write_trailer(parent.videoFile.get());
+	assert(result == 0);
+	if (result < 0)
+	{
+		Log(LogSeverity::Error) << "Fail to write video stream trailer: " << parent.AVErrorString(result) << '.';
+		ok = false;
+	}
+
+	result = parent.CloseOutput();
+	assert(result == 0);
+	if (result < 0)
+	{
+		Log(LogSeverity::Error) << "Fail to flush trailing video data to file: " << parent.AVErrorString(result) << '.';
+		ok = false;
+	}
+
+	parent.Cleanup();
+	parent.recordAborted = false;
+
+	if (ok)
+		Log(LogSeverity::Info) << "Video has been recorded.";
+	else
+		Log(LogSeverity::Error) << "Fail to record video.";
+}
+
+// regular session fed from spool instead of application frames, cancel is checked between frames => stop and destruction do not wait for whole spool
+void CVideoRecorder::CEncodeSpoolRequest::operator ()(CVideoRecorder &parent)
+{
+	if (Canceled(parent))
+	{
+		Log(LogSeverity::Info) << "Encoding spool \"" << spoolFilename << "\" has been canceled.";
+		return;
+	}
+
+	std::unique_ptr<CSpoolReader> reader;
+	try
+	{
+		reader = std::make_unique<CSpoolReader>(std::filesystem::path(spoolFilename));
+	}
+	catch (const std::exception &error)
+	{
+		Log(LogSeverity::Error) << "Fail to open spool \"" << spoolFilename << "\": " << error.what() << '.';
+		return;
+	}
+	if (!reader->Finished())
+		Log(LogSeverity::Warning) << "Spool \"" << spoolFilename << "\" has not been finished, encoding " << reader->Size() << " complete frame(s).";
+
+	// seek to record covering range start
+	const uint_least64_t first = reader->Find(firstPts);
+	if (first == reader->Size())
+	{
+		Log(LogSeverity::Error) << "Fail to encode spool \"" << spoolFilename << "\": it has no frame at " << firstPts << '.';
+		return;
+	}
+
+	CStartVideoRecordRequest startRecord(std::move(filename), reader->GetWidth(), reader->GetHeight(), reader->GetFormat(), reader->GetFPS(), codecID, config, false, true, {}, 0, 0, {}, {}, std::move(fallback));
+	startRecord(parent);
+	if (!parent.videoFile)
+	{
+		parent.recordAborted = false;
+		return;
+	}
+
+	Log(LogSeverity::Info) << "Encoding spool \"" << spoolFilename << "\"...";
+	// output timeline starts at range start, records straddling range bounds are clipped
+	for (uint_least64_t idx = first; idx < reader->Size() && (*reader)[idx].pts <= lastPts; idx++)
+	{
+		// file stays playable: frames encoded so far are flushed and trailer is written by stop below
+		if (Canceled(parent))
+		{
+			Log(LogSeverity::Warning) << "Encoding spool \"" << spoolFilename << "\" has been canceled after " << idx - first << " of " << reader->Size() - first << " record(s).";
+			break;
 		}
 
-		wclog << "Recording video \"" << filename << "\" (using " << parent.context->thread_count << " threads for encoding)..." << endl;
+		if (!parent.MakeWritable(*parent.dstFrame))
+		{
+			parent.Cleanup();
+			parent.recordAborted = false;
+			return;
+		}
+		reader->CopyTo(idx, *parent.dstFrame);
+		const auto &record = (*reader)[idx];
+		const int64_t end = std::min(record.pts + record.repeats - 1, lastPts) - firstPts;
+		for (parent.dstFrame->pts = std::max(record.pts, firstPts) - firstPts; parent.dstFrame->pts <= end; parent.dstFrame->pts++)
+			if (!parent.Encode(parent.dstFrame.get()))
+			{
+				parent.Cleanup();
+				parent.recordAborted = false;
+				return;
+			}
+	}
+
+	CStopVideoRecordRequest stopRecord(true);
+	stopRecord(parent);
+}
+
+static inline bool IsNVENC(const AVCodecContext &context)
+{
+	return std::strstr(context.codec->name, "nvenc") != nullptr;
+}
+
+/*
+	libavcodec wrappers compare rate control fields against running encoder on every frame and reconfigure it if they differ:
+		libx264		crf, bitrate and VBV within rate control mode selected at open, VBV can not be turned on later
+		NVENC		bitrate and VBV of bitrate driven session
+*/
+bool CVideoRecorder::CReconfigureRequest::InPlace(const AVCodecContext &context) const noexcept
+{
+	const bool abr = context.bit_rate > 0, vbv = context.rc_max_rate > 0 && context.rc_buffer_size > 0;
+	const bool vbvChange = rateControl.vbvMaxRate != -1 || rateControl.vbvBufferSize != -1;
+	if (vbvChange && (!vbv || !rateControl.vbvMaxRate || !rateControl.vbvBufferSize))
+		return false;
+	if (std::strcmp(context.codec->name, "libx264") == 0)
+		return abr ? rateControl.crf == -1 : rateControl.bitrate == -1;
+	if (IsNVENC(context))
+		return abr && rateControl.crf == -1;
+	return false;
+}
+
+void CVideoRecorder::CReconfigureRequest::Apply(AVCodecContext &context) const
+{
+	if (rateControl.crf != -1)
+	{
+		context.bit_rate = 0;
+		const int result = av_opt_set_double(context.priv_data, IsNVENC(context) ? "cq" : "crf", double(rateControl.crf), 0);
+		if (result < 0)
+			throw std::make_pair("Fail to set crf", result);
+	}
+	if (rateControl.bitrate != -1)
+	{
+		context.bit_rate = rateControl.bitrate;
+		if (!IsNVENC(context))
+			av_opt_set_double(context.priv_data, "crf", -1, 0);	// crf takes precedence over bitrate in x264/x265 wrappers
+	}
+	if (rateControl.vbvMaxRate != -1)
+		context.rc_max_rate = rateControl.vbvMaxRate;
+	if (rateControl.vbvBufferSize != -1)
+		context.rc_buffer_size = (int)rateControl.vbvBufferSize;
+}
 
-		parent.CheckAVResult(avcodec_open2(parent.context.get(), codec, NULL), 0, "Fail to open codec");
+/*
+	new encoder is opened with current options plus changed rate control, old one is flushed into the same stream
+	new one starts with IDR carrying its own parameter sets => possible only if container keeps no global headers
+	failure to open new encoder keeps old one, failure to flush aborts session
+*/
+bool CVideoRecorder::CReconfigureRequest::Reopen(CVideoRecorder &parent) const
+{
+	if (parent.videoFile->oformat->flags & AVFMT_GLOBALHEADER)
+	{
+		Log(LogSeverity::Error) << "Fail to reconfigure encoder \"" << parent.context->codec->name << "\": it can not be changed in place and container requires global headers.";
+		return true;
+	}
 
-		parent.dstFrame.reset(av_frame_alloc());
-		assert(parent.dstFrame);
-		if (!parent.dstFrame)
-			throw "Fail to allocate frame";
+	std::unique_ptr<AVCodecContext, ContextDeleter> context;
+	try
+	{
+		context.reset(avcodec_alloc_context3(parent.context->codec));
+		if (!context)
+			throw "Fail to init codec";
+		context->width = parent.context->width;
+		context->height = parent.context->height;
+		context->time_base = parent.context->time_base;
+		context->framerate = parent.context->framerate;
+		context->pix_fmt = parent.context->pix_fmt;
+		context->thread_count = parent.context->thread_count;
+		context->flags = parent.context->flags;
+		context->bit_rate = parent.context->bit_rate;
+		context->rc_max_rate = parent.context->rc_max_rate;
+		context->rc_buffer_size = parent.context->rc_buffer_size;
+		// encoder may reject requested settings => failure is expected and reported below, no assert
+		parent.CheckAVResultImpl(av_opt_copy(context->priv_data, parent.context->priv_data), "Fail to copy encoder options");
+		Apply(*context);
+		parent.CheckAVResultImpl(avcodec_open2(context.get(), context->codec, NULL), "Fail to open codec");
+	}
+	catch (const char error[])
+	{
+		Log(LogSeverity::Error) << error << " for encoder reconfiguration, keeping current settings.";
+		return true;
+	}
+	catch (const std::pair<const char *, int> error)
+	{
+		Log(LogSeverity::Error) << error.first << " for encoder reconfiguration, keeping current settings: " << parent.AVErrorString(error.second) << '.';
+		return true;
+	}
 
-		parent.dstFrame->format = parent.context->pix_fmt;
-		parent.dstFrame->width = parent.context->width;
-		parent.dstFrame->height = parent.context->height;
-		parent.dstFrame->pts = 0;
+	if (!parent.Encode(NULL))
+		return false;
+	parent.context = std::move(context);
+	parent.encoderLag.store(0, std::memory_order_relaxed);
+	Log(LogSeverity::Info) << "Encoder has been reopened with new rate control settings, switching at keyframe.";
+	return true;
+}
 
-		parent.CheckAVResult(av_frame_get_buffer(parent.dstFrame.get(), cache_line), 0, "Fail to allocate frame data");
+// ordered with frames => queued ones are encoded with previous settings
+void CVideoRecorder::CReconfigureRequest::operator ()(CVideoRecorder &parent)
+{
+	if (!parent.context)
+	{
+		if (!parent.recordAborted)
+			Log(LogSeverity::Warning) << "Reconfiguring encoder without video record session (ignored).";
+		return;
+	}
 
-		const std::string convertedFilename = std::wstring_convert<std::codecvt_utf8<wchar_t>>().to_bytes(filename);
+	// explicit quality choice overrides governor for the rest of session
+	if (parent.governor && (rateControl.crf != -1 || rateControl.bitrate != -1))
+	{
+		Log(LogSeverity::Info) << "Quality governor has been disabled by explicit reconfiguration.";
+		parent.governor.reset();
+		parent.governedCRF.store(-1, std::memory_order_relaxed);
+	}
 
+	if (InPlace(*parent.context))
+	{
+		try
 		{
-			AVFormatContext *output;
-			parent.CheckAVResult(avformat_alloc_output_context2(&output, NULL, NULL, convertedFilename.c_str()), "Fail to init output context");
-			parent.videoFile.reset(output);
+			Apply(*parent.context);
+			Log(LogSeverity::Info) << "Encoder rate control has been reconfigured.";
+		}
+		catch (const std::pair<const char *, int> error)
+		{
+			Log(LogSeverity::Error) << error.first << " for encoder reconfiguration: " << parent.AVErrorString(error.second) << '.';
 		}
-
-		parent.videoStream = avformat_new_stream(parent.videoFile.get(), codec);
-		assert(parent.videoStream);
-		if (!parent.videoStream)
-			throw "Fail to add video stream";
-		parent.CheckAVResult(avcodec_parameters_from_context(parent.videoStream->codecpar, parent.context.get()), "Fail to extract codec parameters");
-		parent.videoStream->time_base = parent.context->time_base;
-
-		parent.CheckAVResult(avio_open(&parent.videoFile->pb, convertedFilename.c_str(), AVIO_FLAG_WRITE), "Fail to create file");
-		parent.CheckAVResult(avformat_write_header(parent.videoFile.get(), NULL), AVSTREAM_INIT_IN_WRITE_HEADER, "Fail to write header");
 	}
-	catch (const char error[])
+	else if (!Reopen(parent))
 	{
-		wcerr << error << " for video \"" << filename << "\"." << endl;
+		Log(LogSeverity::Error) << "Fail to flush encoder for reconfiguration.";
 		parent.Cleanup();
 	}
-	catch (const std::pair<const char *, int> error)
+}
+#pragma endregion
+
+// oldest spilled record, failure aborts session
+bool CVideoRecorder::EncodeSpilled()
+{
+	assert(spill && !spill->Empty());
+	const auto start = clock::now();
+	if (!MakeWritable(*dstFrame))
 	{
-		wcerr << error.first << " for video \"" << filename << "\": " << parent.AVErrorString(error.second) << '.' << endl;
-		parent.Cleanup();
+		Cleanup();
+		return false;
 	}
-	catch (const std::exception &error)	// catches exception during string conversion
+	const auto nextPts = dstFrame->pts;	// of next application frame
+	const auto record = spill->Front(*dstFrame);
+	spill->Pop();
+	spillBacklog.store(spill->PendingFrames(), std::memory_order_relaxed);
+	dstFrame->pict_type = record.flags & Spool::forceKeyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+	for (dstFrame->pts = record.pts; dstFrame->pts < record.pts + record.repeats; dstFrame->pts++)
 	{
-		wcerr << "Fail to start record video \"" << filename << "\": " << error.what() << '.' << endl;
-		parent.Cleanup();
+		if (!Encode(dstFrame.get()))
+		{
+			DropFrames(record.pts + record.repeats - dstFrame->pts, FrameLossReason::Error);
+			Cleanup();
+			return false;
+		}
+		framesEncoded.fetch_add(1, std::memory_order_relaxed);
+		dstFrame->pict_type = AV_PICTURE_TYPE_NONE;
 	}
+	dstFrame->pts = nextPts;
+	if (governor)
+		GovernQuality(start, record.repeats);
+	return true;
 }
 
-void CVideoRecorder::CStopVideoRecordRequest::operator ()(CVideoRecorder &parent)
+bool CVideoRecorder::DrainSpill()
 {
-	if (!matchedStart)
-		wcerr << "Stopping video record without matched start." << endl;
+	while (!spill->Empty())
+		if (!EncodeSpilled())
+			return false;
+	return true;
+}
 
-	if (!parent.videoFile)
-		return;
+/*
+	NOTE: exceptions related to mutex locks
+		- aren't handled in worker thread which leads to terminate()
+		- calls abort() in main thread
+*/
 
-	bool ok = parent.Encode();
+[[noreturn]]
+void CVideoRecorder::Error(const std::system_error &error)
+{
+	Log(LogSeverity::Fatal) << "System error occured: " << error.what();	// flushed synchronously
+	abort();
+}
 
-	int result = av_write_trailer(parent.videoFile.get());
-	assert(result == 0);
-	if (result < 0)
+void CVideoRecorder::Error(const std::exception &error, const char errorMsgPrefix[], const std::wstring *filename)
+{
 	{
-		wcerr << "Fail to write video stream trailer: " << parent.AVErrorString(result) << '.' << endl;
-		ok = false;
+		CLogMessage message(LogSeverity::Error);
+		message << errorMsgPrefix;
+		if (filename)
+			message << '\"' << *filename << '\"';
+		message << ": " << error.what() << '.';
+		switch (status)
+		{
+		case Status::OK:
+			message << " Try again...";
+			break;
+		case Status::RETRY:
+			break;
+		}
 	}
 
-	result = avio_closep(&parent.videoFile->pb);
-	assert(result == 0);
-	if (result < 0)
+	if (status == Status::OK)
 	{
-		wcerr << "Fail to flush trailing video data to file: " << parent.AVErrorString(result) << '.' << endl;
-		ok = false;
+		try
+		{
+			// let worker free memory before retry
+			std::unique_lock<decltype(mtx)> lck(mtx);
+			workerEvent.wait(lck, [this] { return taskQueue->empty(); });
+		}
+		catch (const std::system_error &error)
+		{
+			Error(error);
+		}
 	}
-
-	parent.Cleanup();
-
-	if (ok)
-		wclog << "Video has been recorded." << endl;
-	else
-		wcerr << "Fail to record video." << endl;
 }
-#pragma endregion
 
 #pragma region CFrame
 CVideoRecorder::CFrame::CFrame(Opaque opaque) :
-	parent				(std::get<0>(std::move(opaque))),
-	screenshotPaths		(std::get<1>(std::move(opaque))),
-	videoPendingFrames	(std::get<2>(std::move(opaque)))
-{}
+	parent				(std::get<0>(opaque)),
+	videoPendingFrames	(std::get<2>(opaque))
+{
+	// steal screenshot paths only if there are any, default constructed vector does not allocate (unlike deque behind std::queue)
+	if (!std::get<1>(opaque).empty())
+		screenshotPaths.swap(std::get<1>(opaque));
+}
 
 void CVideoRecorder::CFrame::Ready()
 {
+	const CTraceScope traceScope(parent, "CFrame::Ready");
 	try
 	{
 		std::lock_guard<decltype(mtx)> lck(parent.mtx);
@@ -657,23 +2290,19 @@ void CVideoRecorder::CFrame::Cancel()
 	try
 	{
 		std::lock_guard<decltype(mtx)> lck(parent.mtx);
-		/*
-			remove_if always traverses all the range
-			find_if/erase pair allows to stop traverse after element being removed was found
-
-			no exception should be thrown during erase() because std::unique_ptr has noexcept move ctor/assignment
-		*/
-		const auto pred = [this](decltype(parent.taskQueue)::const_reference task)
+		// stop traverse after element being removed was found, erase() is noexcept
+		for (unsigned int idx = 0; idx < parent.taskQueue->size(); idx++)
 		{
-			if (const CFrameTask *frameTask = dynamic_cast<const CFrameTask *>(task.get()))
-				return frameTask->srcFrame.get() == this;
-			return false;
-		};
-		const auto taskToDelete = std::find_if(parent.taskQueue.cbegin(), parent.taskQueue.cend(), pred);
-		if (taskToDelete != parent.taskQueue.cend())
-		{
-			parent.taskQueue.erase(taskToDelete);
-			assert(std::find_if(parent.taskQueue.cbegin(), parent.taskQueue.cend(), pred) == parent.taskQueue.cend());
+			if (const CFrameTask *frameTask = std::get_if<CFrameTask>(&(*parent.taskQueue)[idx]))
+				if (frameTask->srcFrame == this)
+				{
+					if (videoPendingFrames)
+						parent.DropFrames(videoPendingFrames, FrameLossReason::Canceled);
+					parent.AccountMemory(MemoryCategory::QueuedFrames, -(ptrdiff_t)frameTask->MemoryCharge());
+					parent.taskQueue->erase(idx);
+					parent.pendingFrameTasks.fetch_sub(1, std::memory_order_release);
+					break;
+				}
 		}
 		parent.workerEvent.notify_all();
 	}
@@ -689,33 +2318,613 @@ void CVideoRecorder::Process()
 	std::unique_lock<decltype(mtx)> lck(mtx);
 	while (!finish)
 	{
-		if (taskQueue.empty() || !*taskQueue.front())
+		const CFrameTask *const frameTask = taskQueue->empty() ? nullptr : std::get_if<CFrameTask>(&taskQueue->front());
+		if (taskQueue->empty() || (frameTask && !*frameTask))
 		{
 			workerEvent.notify_one();
-			workerEvent.wait(lck);
+			// spill is worker owned, backlog is encoded one record at a time between tasks
+			if (spill && !spill->Empty())
+			{
+				lck.unlock();
+				EncodeSpilled();
+				lck.lock();
+			}
+			else
+				workerEvent.wait(lck);
 		}
 		else
 		{
-			auto task = std::move(taskQueue.front());
-			taskQueue.pop_front();
+			// slot is reused by producer once popped => nothing but local task is referenced below
+			auto task = std::move(taskQueue->front());
+			const bool isFrameTask = std::holds_alternative<CFrameTask>(task);
+			const bool wasFull = taskQueue->full();
+			taskQueue->pop_front();
+			if (wasFull)
+				workerEvent.notify_all();
 			lck.unlock();
-			task->operator ()(*this);
+			std::visit([this](auto &task)
+			{
+				if constexpr (!std::is_same_v<std::decay_t<decltype(task)>, std::monostate>)
+				{
+					const CTraceScope traceScope(*this, task.traceName);
+					task(*this);
+				}
+			}, task);
+			if (const CFrameTask *const completedFrameTask = std::get_if<CFrameTask>(&task))
+				AccountMemory(MemoryCategory::QueuedFrames, -(ptrdiff_t)completedFrameTask->MemoryCharge());
+			task.emplace<std::monostate>();	// release frame outside the lock
+			const bool framesThrottled = isFrameTask && pendingFrameTasks.fetch_sub(1, std::memory_order_release) == frameQueueDepth;
 			lck.lock();
+			// wake offline producer blocked in PrepareSample()
+			if (framesThrottled)
+				workerEvent.notify_all();
+		}
+	}
+}
+
+#pragma region CMetricsExporter
+class CVideoRecorder::CMetricsExporter
+{
+	const CVideoRecorder &recorder;
+	const std::wstring filename, tmpFilename;
+	const MetricsFormat format;
+	const std::chrono::milliseconds period;
+	bool finish = false;
+	std::mutex mtx;	// does not interfere with recorder's one
+	std::condition_variable event;
+	std::thread thread;
+
+private:
+	static void WritePrometheus(std::ostream &out, const Stats &stats);
+	static void WriteJSON(std::ostream &out, const Stats &stats);
+	void Export() const;
+	void Run();
+
+public:
+	CMetricsExporter(const CVideoRecorder &recorder, std::wstring &&filename, MetricsFormat format, std::chrono::milliseconds period);
+	~CMetricsExporter();
+};
+
+static constexpr const char *const stageNames[] = { "queue_wait", "get_frame_data", "convert", "scale", "encode", "mux" };
+static_assert(std::extent<decltype(stageNames)>::value == CVideoRecorder::stageCount, "stage names mismatch");
+static constexpr const char *const frameLossReasonNames[] = { "app_late", "frames_in_flight", "pool_exhausted", "memory_budget", "canceled", "error" };
+static_assert(std::extent<decltype(frameLossReasonNames)>::value == CVideoRecorder::frameLossReasonCount, "frame loss reason names mismatch");
+static constexpr const char *const memoryCategoryNames[] = { "queued_frames", "conversion", "video_frame", "encoder", "muxer" };
+static_assert(std::extent<decltype(memoryCategoryNames)>::value == CVideoRecorder::memoryCategoryCount, "memory category names mismatch");
+static constexpr const char *const simdLevelNames[] = { "scalar", "sse2", "avx2", "avx512" };
+static_assert(std::extent<decltype(simdLevelNames)>::value == CVideoRecorder::simdLevelCount, "SIMD level names mismatch");
+
+void CVideoRecorder::CMetricsExporter::WritePrometheus(std::ostream &out, const Stats &stats)
+{
+	using std::chrono::duration;
+	const auto counter = [&out](const char name[], const char help[], uint_least64_t value)
+	{
+		out << "# HELP video_recorder_" << name << ' ' << help << "\n# TYPE video_recorder_" << name << " counter\nvideo_recorder_" << name << ' ' << value << '\n';
+	};
+	const auto gauge = [&out](const char name[], const char help[], uint_least64_t value)
+	{
+		out << "# HELP video_recorder_" << name << ' ' << help << "\n# TYPE video_recorder_" << name << " gauge\nvideo_recorder_" << name << ' ' << value << '\n';
+	};
+	counter("frames_sampled_total", "Frames requested from application.", stats.framesSampled);
+	counter("frames_encoded_total", "Frames sent to encoder, duplicates included.", stats.framesEncoded);
+	counter("frames_late_total", "Frame slots missed by application.", stats.framesLate);
+	const auto byReason = [&out](const char name[], const char help[], const uint_least64_t (&values)[frameLossReasonCount])
+	{
+		out << "# HELP video_recorder_" << name << ' ' << help << "\n# TYPE video_recorder_" << name << " counter\n";
+		for (unsigned int reason = 0; reason < frameLossReasonCount; reason++)
+			out << "video_recorder_" << name << "{reason=\"" << frameLossReasonNames[reason] << "\"} " << values[reason] << '\n';
+	};
+	byReason("frames_duplicated_total", "Frames repeated to keep frame rate.", stats.framesDuplicatedBy);
+	byReason("frames_dropped_total", "Frames lost.", stats.framesDroppedBy);
+	counter("bytes_written_total", "Encoded video bytes written.", stats.bytesWritten);
+	gauge("queue_depth", "Frames queued or being processed.", stats.queueDepth);
+	gauge("encoder_lag_frames", "Frames sent to encoder without packets written yet.", stats.encoderLag);
+	counter("frames_spilled_total", "Frames parked in scratch file while encoder was behind.", stats.framesSpilled);
+	gauge("spill_backlog_frames", "Spilled frames not encoded yet.", stats.spillBacklog);
+	out << "# HELP video_recorder_crf Current CRF of governed session, -1 if not governed.\n# TYPE video_recorder_crf gauge\nvideo_recorder_crf " << stats.crf << '\n';
+	out << "# HELP video_recorder_scene_score Scene change score of last converted frame, 0 if detection is off.\n# TYPE video_recorder_scene_score gauge\nvideo_recorder_scene_score " << stats.sceneScore << '\n';
+	counter("scene_cuts_total", "Keyframes forced at detected scene cuts.", stats.sceneCuts);
+	if (stats.encoder)
+		out << "# HELP video_recorder_encoder_info Encoder of current session, fallback is its position in fallback chain (0 if requested encoder is used).\n# TYPE video_recorder_encoder_info gauge\nvideo_recorder_encoder_info{encoder=\"" << stats.encoder << "\",fallback=\"" << stats.encoderFallback << "\"} 1\n";
+	gauge("memory_budget_bytes", "Memory budget, 0 if unlimited.", stats.memoryBudget);
+	out << "# HELP video_recorder_simd_info Pixel conversion kernel variant.\n# TYPE video_recorder_simd_info gauge\nvideo_recorder_simd_info{level=\"" << simdLevelNames[(unsigned int)stats.simdLevel] << "\"} 1\n";
+	out << "# HELP video_recorder_memory_bytes Tracked memory by category.\n# TYPE video_recorder_memory_bytes gauge\n";
+	for (unsigned int category = 0; category < memoryCategoryCount; category++)
+		out << "video_recorder_memory_bytes{category=\"" << memoryCategoryNames[category] << "\"} " << stats.memory[category].current << '\n';
+	out << "# HELP video_recorder_memory_peak_bytes Tracked memory high-water mark by category.\n# TYPE video_recorder_memory_peak_bytes gauge\n";
+	for (unsigned int category = 0; category < memoryCategoryCount; category++)
+		out << "video_recorder_memory_peak_bytes{category=\"" << memoryCategoryNames[category] << "\"} " << stats.memory[category].peak << '\n';
+	out << "video_recorder_memory_peak_bytes{category=\"total\"} " << stats.memoryTotal.peak << '\n';
+
+	out << "# HELP video_recorder_stage_latency_seconds Per-stage latency for current record session, quantile 1 is max.\n# TYPE video_recorder_stage_latency_seconds summary\n";
+	for (unsigned int stage = 0; stage < stageCount; stage++)
+	{
+		const auto &latency = stats.stages[stage];
+		out << "video_recorder_stage_latency_seconds{stage=\"" << stageNames[stage] << "\",quantile=\"0.5\"} " << duration<double>(latency.p50).count() << '\n';
+		out << "video_recorder_stage_latency_seconds{stage=\"" << stageNames[stage] << "\",quantile=\"0.99\"} " << duration<double>(latency.p99).count() << '\n';
+		out << "video_recorder_stage_latency_seconds{stage=\"" << stageNames[stage] << "\",quantile=\"1\"} " << duration<double>(latency.max).count() << '\n';
+		out << "video_recorder_stage_latency_seconds_sum{stage=\"" << stageNames[stage] << "\"} " << duration<double>(latency.sum).count() << '\n';
+		out << "video_recorder_stage_latency_seconds_count{stage=\"" << stageNames[stage] << "\"} " << latency.count << '\n';
+	}
+	out << "# HELP video_recorder_stage_rate Per-stage throughput (per second).\n# TYPE video_recorder_stage_rate gauge\n";
+	for (unsigned int stage = 0; stage < stageCount; stage++)
+		out << "video_recorder_stage_rate{stage=\"" << stageNames[stage] << "\"} " << stats.stages[stage].fps << '\n';
+}
+
+void CVideoRecorder::CMetricsExporter::WriteJSON(std::ostream &out, const Stats &stats)
+{
+	using std::chrono::duration;
+	out << "{\n"
+		"\t\"frames_sampled\": " << stats.framesSampled << ",\n"
+		"\t\"frames_encoded\": " << stats.framesEncoded << ",\n"
+		"\t\"frames_duplicated\": " << stats.framesDuplicated << ",\n"
+		"\t\"frames_dropped\": " << stats.framesDropped << ",\n"
+		"\t\"frames_late\": " << stats.framesLate << ",\n";
+	const auto byReason = [&out](const char name[], const uint_least64_t (&values)[frameLossReasonCount])
+	{
+		out << "\t\"" << name << "\": {";
+		for (unsigned int reason = 0; reason < frameLossReasonCount; reason++)
+			out << (reason ? ", " : " ") << '"' << frameLossReasonNames[reason] << "\": " << values[reason];
+		out << " },\n";
+	};
+	byReason("frames_duplicated_by", stats.framesDuplicatedBy);
+	byReason("frames_dropped_by", stats.framesDroppedBy);
+	out <<
+		"\t\"bytes_written\": " << stats.bytesWritten << ",\n"
+		"\t\"queue_depth\": " << stats.queueDepth << ",\n"
+		"\t\"encoder_lag\": " << stats.encoderLag << ",\n"
+		"\t\"frames_spilled\": " << stats.framesSpilled << ",\n"
+		"\t\"spill_backlog\": " << stats.spillBacklog << ",\n"
+		"\t\"crf\": " << stats.crf << ",\n"
+		"\t\"encoder\": ";
+	if (stats.encoder)
+		out << '"' << stats.encoder << '"';
+	else
+		out << "null";
+	out << ",\n"
+		"\t\"encoder_fallback\": " << stats.encoderFallback << ",\n"
+		"\t\"scene_score\": " << stats.sceneScore << ",\n"
+		"\t\"scene_cuts\": " << stats.sceneCuts << ",\n"
+		"\t\"simd_level\": \"" << simdLevelNames[(unsigned int)stats.simdLevel] << "\",\n"
+		"\t\"memory\": {";
+	for (unsigned int category = 0; category < memoryCategoryCount; category++)
+		out << (category ? ", " : " ") << '"' << memoryCategoryNames[category] << "\": { \"current\": " << stats.memory[category].current << ", \"peak\": " << stats.memory[category].peak << " }";
+	out << ", \"total\": { \"current\": " << stats.memoryTotal.current << ", \"peak\": " << stats.memoryTotal.peak << " }, \"budget\": " << stats.memoryBudget << " },\n"
+		"\t\"stages\": {";
+	for (unsigned int stage = 0; stage < stageCount; stage++)
+	{
+		const auto &latency = stats.stages[stage];
+		out << (stage ? ",\n" : "\n") << "\t\t\"" << stageNames[stage] << "\": { "
+			"\"p50\": " << duration<double>(latency.p50).count() << ", "
+			"\"p99\": " << duration<double>(latency.p99).count() << ", "
+			"\"max\": " << duration<double>(latency.max).count() << ", "
+			"\"sum\": " << duration<double>(latency.sum).count() << ", "
+			"\"fps\": " << latency.fps << ", "
+			"\"count\": " << latency.count << " }";
+	}
+	out << "\n\t}\n}\n";
+}
+
+// write to temp file and then replace target so that scrapers never observe partially written file
+void CVideoRecorder::CMetricsExporter::Export() const
+{
+	const Stats stats = recorder.GetStats();	// lock-free
+	{
+		std::ofstream out(std::filesystem::path(tmpFilename), std::ios::out | std::ios::trunc);
+		out.imbue(std::locale::classic());
+		switch (format)
+		{
+		case MetricsFormat::Prometheus:
+			WritePrometheus(out, stats);
+			break;
+		case MetricsFormat::JSON:
+			WriteJSON(out, stats);
+			break;
+		}
+		out.close();
+		if (!out)
+		{
+			Log(LogSeverity::Error) << "Fail to write metrics file \"" << tmpFilename << "\".";
+			return;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(tmpFilename, filename, error);
+	if (error)
+		Log(LogSeverity::Error) << "Fail to replace metrics file \"" << filename << "\".";
+}
+
+void CVideoRecorder::CMetricsExporter::Run()
+{
+	std::unique_lock<decltype(mtx)> lck(mtx);
+	do
+	{
+		lck.unlock();
+		Export();
+		lck.lock();
+	} while (!event.wait_for(lck, period, [this] { return finish; }));
+	lck.unlock();
+	Export();	// final snapshot
+}
+
+CVideoRecorder::CMetricsExporter::CMetricsExporter(const CVideoRecorder &recorder, std::wstring &&filename, MetricsFormat format, std::chrono::milliseconds period) :
+	recorder(recorder), filename(std::move(filename)), tmpFilename(this->filename + L".tmp"), format(format), period(period),
+	thread(std::mem_fn(&CMetricsExporter::Run), this)
+{
+}
+
+CVideoRecorder::CMetricsExporter::~CMetricsExporter()
+{
+	try
+	{
+		{
+			std::lock_guard<decltype(mtx)> lck(mtx);
+			finish = true;
+			event.notify_all();
 		}
+		thread.join();
+	}
+	catch (const std::system_error &error)
+	{
+		Error(error);
+	}
+}
+#pragma endregion
+
+/*
+	host level unless VIDEO_RECORDER_SIMD forces lower one for A/B testing
+	forced level also caps FFmpeg CPU flags (process wide) so that sws_scale follows it, "sse2" emulates pre-AVX host (FFmpeg keeps up to SSE4.2)
+*/
+static CVideoRecorder::SIMDLevel ResolveSIMDLevel()
+{
+	typedef CVideoRecorder::SIMDLevel SIMDLevel;
+	const SIMDLevel host = Imaging::HostSIMDLevel();
+#ifdef _MSC_VER
+#	pragma warning(suppress: 4996)	// getenv is fine for read once at startup
+#endif
+	const char *const forced = std::getenv("VIDEO_RECORDER_SIMD");
+	if (!forced || !*forced)
+	{
+		Log(LogSeverity::Info) << "SIMD level: " << simdLevelNames[(unsigned int)host] << '.';
+		return host;
 	}
+
+	const auto found = std::find_if(std::begin(simdLevelNames), std::end(simdLevelNames), [forced](const char *name) { return std::strcmp(name, forced) == 0; });
+	if (found == std::end(simdLevelNames))
+	{
+		Log(LogSeverity::Warning) << "Unknown VIDEO_RECORDER_SIMD value \"" << forced << "\", using host SIMD level " << simdLevelNames[(unsigned int)host] << '.';
+		return host;
+	}
+	const SIMDLevel level = SIMDLevel(found - std::begin(simdLevelNames));
+	if (level > host)
+	{
+		Log(LogSeverity::Warning) << "VIDEO_RECORDER_SIMD level " << forced << " is not supported by host, using " << simdLevelNames[(unsigned int)host] << '.';
+		return host;
+	}
+
+	int avFlagsMask = -1;
+	switch (level)
+	{
+	case SIMDLevel::Scalar:
+		avFlagsMask = 0;
+		break;
+	case SIMDLevel::SSE2:
+		avFlagsMask &= ~(AV_CPU_FLAG_AVX | AV_CPU_FLAG_AVXSLOW | AV_CPU_FLAG_AVX2 | AV_CPU_FLAG_FMA3 | AV_CPU_FLAG_FMA4 | AV_CPU_FLAG_XOP);
+		[[fallthrough]];
+	case SIMDLevel::AVX2:
+		avFlagsMask &= ~AV_CPU_FLAG_AVX512;
+#ifdef AV_CPU_FLAG_AVX512ICL
+		avFlagsMask &= ~AV_CPU_FLAG_AVX512ICL;
+#endif
+		break;
+	case SIMDLevel::AVX512:
+		break;
+	}
+	if (~avFlagsMask)
+		av_force_cpu_flags(av_get_cpu_flags() & avFlagsMask);
+	Log(LogSeverity::Info) << "SIMD level forced to " << forced << " (host " << simdLevelNames[(unsigned int)host] << ").";
+	return level;
+}
+
+// process wide FFmpeg state
+static CVideoRecorder::SIMDLevel InitLibrary()
+{
+	// registration is implicit since FFmpeg 4.0 (and the functions are gone since 5.0)
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+	av_register_all();
+	avcodec_register_all();
+#endif
+	return ResolveSIMDLevel();
 }
 
+static CVideoRecorder::SIMDLevel LibrarySIMDLevel()
+{
+	static const CVideoRecorder::SIMDLevel resolvedSIMDLevel = InitLibrary();	// once per process as FFmpeg registry and CPU flags are global
+	return resolvedSIMDLevel;
+}
+
+// recorder which never records or takes screenshots costs no thread, see Launch(), library init is paid once per process
 CVideoRecorder::CVideoRecorder() try :
 	avErrorBuf(std::make_unique<char []>(AV_ERROR_MAX_STRING_SIZE)),
 	cvtCtx(nullptr, sws_freeContext),
-	packet(std::make_unique<decltype(packet)::element_type>()),
-	worker(std::mem_fn(&CVideoRecorder::Process), this)
+	packet(AllocPacket()),
+	taskQueue(std::make_unique<CTaskQueue>()),
+	latencyHistograms(std::make_unique<CLatencyHistogram []>(stageCount)),
+	frameEventLog(std::make_unique<CFrameEventLog>())
 {
+	simdLevel.store(LibrarySIMDLevel(), std::memory_order_relaxed);
 }
 catch (const std::exception &error)
 {
-	wcerr << "Fail to init video recorder: " << error.what() << '.' << endl;
+	Log(LogSeverity::Error) << "Fail to init video recorder: " << error.what() << '.';
+}
+
+// on first task (StartRecord(), Screenshot() and the like), producer thread only
+void CVideoRecorder::Launch()
+{
+	worker = std::thread(std::mem_fn(&CVideoRecorder::Process), this);
+}
+
+#pragma region CEncoderProbe
+/*
+	every check opens real encoder instance => result reflects FFmpeg build, drivers and GPU actually present
+	cache is plain text (one tab separated line per Codec/backend pair) keyed by FFmpeg version and CPU count, NVENC entries are re-checked on load
+*/
+class CVideoRecorder::CEncoderProbe
+{
+	static constexpr char cacheSignature[] = "VideoRecorder encoder probe 1";
+	static constexpr int checkWidth = 256, checkHeight = 144;	// presets/formats, small for cheap open
+	static constexpr int scoreWidth = 1280, scoreHeight = 720, scoreFrames = 30;
+	typedef std::unique_ptr<AVCodecContext, ContextDeleter> Context;
+
+private:
+	static Context Open(const AVCodec &codec, AVPixelFormat format, int width, int height, const char preset[]);
+	static void Fill(AVFrame &frame, int idx, bool deep);
+	static double Score(const AVCodec &codec, Format format);
+	static EncoderCaps Probe(Codec codec, bool nv);
+	static std::string CacheKey();
+	static bool Load(const std::filesystem::path &filename, std::vector<EncoderCaps> &caps);
+	static bool HardwareUnchanged(const std::vector<EncoderCaps> &caps);
+	static void Save(const std::filesystem::path &filename, const std::vector<EncoderCaps> &caps);
+
+public:
+	static std::vector<EncoderCaps> Run(const std::wstring &cacheFilename, bool refresh);
+	// test open of encoder with preset (NULL for default one) in 8 bit format
+	static bool Usable(Codec codec, bool nv, const char preset[]);
+};
+
+// NULL if encoder rejects configuration
+auto CVideoRecorder::CEncoderProbe::Open(const AVCodec &codec, AVPixelFormat format, int width, int height, const char preset[]) -> Context
+{
+	Context context(avcodec_alloc_context3(&codec));
+	if (!context)
+		throw std::bad_alloc();
+	context->width = width;
+	context->height = height;
+	context->time_base = { 1, 60 };
+	context->framerate = { 60, 1 };
+	context->pix_fmt = format;
+	if (const auto availableThreads = std::thread::hardware_concurrency())
+		context->thread_count = availableThreads;
+	if (preset && av_opt_set(context->priv_data, "preset", preset, 0) < 0)
+		return {};
+	if (avcodec_open2(context.get(), &codec, NULL) < 0)
+		return {};
+	return context;
+}
+
+bool CVideoRecorder::CEncoderProbe::Usable(Codec codec, bool nv, const char preset[])
+{
+	const AVCodec *const encoder = FindEncoder(codec, nv);
+	return encoder && Open(*encoder, GetAVFormat(Format::_8bit), checkWidth, checkHeight, preset);
+}
+
+// moving gradient with noise, keeps encoder busy like real content does
+void CVideoRecorder::CEncoderProbe::Fill(AVFrame &frame, int idx, bool deep)
+{
+	uint_least32_t seed = idx * 2654435761u + 1;
+	for (unsigned int plane = 0; plane < 3; plane++)
+	{
+		const int width = plane ? frame.width / 2 : frame.width, height = plane ? frame.height / 2 : frame.height;
+		for (int y = 0; y < height; y++)
+		{
+			uint8_t *const row = frame.data[plane] + y * frame.linesize[plane];
+			for (int x = 0; x < width; x++)
+			{
+				seed = seed * 1664525 + 1013904223;
+				const unsigned int sample = plane ? (x * 2 + y + idx * (plane * 3)) & 0xFF : ((x + y + idx * 4) & 0xFF) / 2 + 64 + (seed >> 28);
+				if (deep)
+					reinterpret_cast<uint16_t *>(row)[x] = uint16_t(sample << 2);
+				else
+					row[x] = uint8_t(sample);
+			}
+		}
+	}
+}
+
+// frames per second of encoder with default preset, frame generation excluded, 0 if encoding fails
+double CVideoRecorder::CEncoderProbe::Score(const AVCodec &codec, Format format)
+{
+	const Context context = Open(codec, GetAVFormat(format), scoreWidth, scoreHeight, nullptr);
+	const std::unique_ptr<AVFrame, FrameDeleter> frame(av_frame_alloc());
+	const std::unique_ptr<AVPacket, PacketDeleter> packet(av_packet_alloc());
+	if (!frame || !packet)
+		throw std::bad_alloc();
+	if (!context)
+		return 0;
+	frame->format = context->pix_fmt;
+	frame->width = scoreWidth;
+	frame->height = scoreHeight;
+	if (av_frame_get_buffer(frame.get(), 0) < 0)
+		throw std::bad_alloc();
+
+	std::chrono::steady_clock::duration time{};
+	for (int idx = 0; idx <= scoreFrames; idx++)
+	{
+		// extra iteration flushes encoder
+		const bool flush = idx == scoreFrames;
+		if (!flush)
+		{
+			if (av_frame_make_writable(frame.get()) < 0)
+				return 0;
+			Fill(*frame, idx, format == Format::_10bit);
+			frame->pts = idx;
+		}
+		const auto start = std::chrono::steady_clock::now();
+		if (avcodec_send_frame(context.get(), flush ? NULL : frame.get()) < 0)
+			return 0;
+		int result;
+		while ((result = avcodec_receive_packet(context.get(), packet.get())) == 0)
+			av_packet_unref(packet.get());
+		time += std::chrono::steady_clock::now() - start;
+		if (result != AVERROR(EAGAIN) && result != AVERROR_EOF)
+			return 0;
+	}
+	return scoreFrames / std::chrono::duration<double>(time).count();
+}
+
+auto CVideoRecorder::CEncoderProbe::Probe(Codec codec, bool nv) -> EncoderCaps
+{
+	EncoderCaps caps{ codec, nv };
+	const AVCodec *const encoder = FindEncoder(codec, nv);
+	if (!encoder)
+		return caps;
+	caps.encoder = encoder->name;
+
+	for (unsigned int format = 0; format < formatCount; format++)
+		caps.formats[format] = bool(Open(*encoder, GetAVFormat(Format(format)), checkWidth, checkHeight, nullptr));
+	const auto usableFormat = std::find(std::begin(caps.formats), std::end(caps.formats), true);
+	if (usableFormat == std::end(caps.formats))
+	{
+		Log(LogSeverity::Warning) << "Encoder \"" << encoder->name << "\" is present but fails to open.";
+		return caps;
+	}
+	const Format format = Format(usableFormat - std::begin(caps.formats));
+
+	const auto CheckPreset = [&](unsigned int preset, const char name[])
+	{
+		if (name && Open(*encoder, GetAVFormat(format), checkWidth, checkHeight, name))
+			caps.presets |= 1u << preset;
+	};
+	if (nv)
+		for (unsigned int preset = 0; EncodePreset_2_Str(PresetNV(preset)); preset++)
+			CheckPreset(preset, EncodePreset_2_Str(PresetNV(preset)));
+	else
+		for (unsigned int preset = 0; EncodePreset_2_Str(Preset(preset)); preset++)
+			CheckPreset(preset, EncodePreset_2_Str(Preset(preset)));
+
+	// wrappers like libx264 declare none, codec family list is the best available hint then
+	const AVProfile *profiles = encoder->profiles;
+	if (!profiles)
+		if (const AVCodecDescriptor *const descriptor = avcodec_descriptor_get(encoder->id))
+			profiles = descriptor->profiles;
+	for (; profiles && profiles->name; profiles++)	// terminator has no name
+		caps.profiles.push_back(profiles->name);
+
+	caps.fps = Score(*encoder, format);
+	Log(LogSeverity::Info) << "Encoder \"" << encoder->name << "\" scores " << int(caps.fps + .5) << " fps at " << scoreWidth << 'x' << scoreHeight << '.';
+	return caps;
+}
+
+// probe result is invalidated by FFmpeg upgrade or different machine
+std::string CVideoRecorder::CEncoderProbe::CacheKey()
+{
+	return std::string(cacheSignature) + '\t' + std::to_string(avcodec_version()) + '\t' + std::to_string(std::thread::hardware_concurrency());
+}
+
+bool CVideoRecorder::CEncoderProbe::Load(const std::filesystem::path &filename, std::vector<EncoderCaps> &caps)
+{
+	std::ifstream in(filename);
+	in.imbue(std::locale::classic());
+	std::string line;
+	if (!std::getline(in, line) || line != CacheKey())
+		return false;
+
+	caps.clear();
+	while (std::getline(in, line))
+	{
+		// codec nv encoder formats presets fps profiles...
+		std::istringstream fields(line);
+		fields.imbue(std::locale::classic());
+		EncoderCaps entry{};
+		unsigned int codec, formats;
+		std::string encoder;
+		if (!(fields >> codec >> entry.nv >> encoder >> formats >> entry.presets >> entry.fps))
+			return false;
+		entry.codec = Codec(codec);
+		if (encoder != "-")
+			entry.encoder = std::move(encoder);
+		for (unsigned int format = 0; format < formatCount; format++)
+			entry.formats[format] = formats >> format & 1;
+		fields.ignore(1);	// '\t'
+		for (std::string profile; std::getline(fields, profile, '\t');)
+			entry.profiles.push_back(std::move(profile));
+		caps.push_back(std::move(entry));
+	}
+	return !caps.empty();
+}
+
+// NVENC depends on GPU and driver which cache key does not cover => cached availability is confirmed by single test open per entry
+bool CVideoRecorder::CEncoderProbe::HardwareUnchanged(const std::vector<EncoderCaps> &caps)
+{
+	LibrarySIMDLevel();
+	for (const auto &entry : caps)
+		if (entry.nv && Usable(entry.codec, true, nullptr) != (!entry.encoder.empty() && entry.formats[(unsigned int)Format::_8bit]))
+		{
+			Log(LogSeverity::Info) << "NVENC availability has changed since encoder probe cache was written.";
+			return false;
+		}
+	return true;
+}
+
+void CVideoRecorder::CEncoderProbe::Save(const std::filesystem::path &filename, const std::vector<EncoderCaps> &caps)
+{
+	std::filesystem::path tmpFilename(filename);
+	tmpFilename += L".tmp";
+	{
+		std::ofstream out(tmpFilename, std::ios::out | std::ios::trunc);
+		out.imbue(std::locale::classic());
+		out << CacheKey() << '\n';
+		for (const auto &entry : caps)
+		{
+			unsigned int formats = 0;
+			for (unsigned int format = 0; format < formatCount; format++)
+				formats |= entry.formats[format] << format;
+			out << (unsigned int)entry.codec << '\t' << entry.nv << '\t' << (entry.encoder.empty() ? "-" : entry.encoder) << '\t' << formats << '\t' << entry.presets << '\t' << std::setprecision(6) << entry.fps;
+			for (const auto &profile : entry.profiles)
+				out << '\t' << profile;
+			out << '\n';
+		}
+		out.close();
+		if (!out)
+		{
+			Log(LogSeverity::Error) << "Fail to write encoder probe cache \"" << tmpFilename.wstring() << "\".";
+			return;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(tmpFilename, filename, error);
+	if (error)
+		Log(LogSeverity::Error) << "Fail to replace encoder probe cache \"" << filename.wstring() << "\".";
+}
+
+std::vector<CVideoRecorder::EncoderCaps> CVideoRecorder::CEncoderProbe::Run(const std::wstring &cacheFilename, bool refresh)
+{
+	std::vector<EncoderCaps> caps;
+	if (!cacheFilename.empty() && !refresh && Load(std::filesystem::path(cacheFilename), caps) && HardwareUnchanged(caps))
+		return caps;
+	caps.clear();
+
+	LibrarySIMDLevel();
+	Log(LogSeverity::Info) << "Probing encoders...";
+	for (const Codec codec : { Codec::H264, Codec::HEVC })
+		for (const bool nv : { false, true })
+			caps.push_back(Probe(codec, nv));
+	if (!cacheFilename.empty())
+		Save(std::filesystem::path(cacheFilename), caps);
+	return caps;
 }
+#pragma endregion
 
 /*
 	make it external in order to allow for forward decl for std::unique_ptr
@@ -727,32 +2936,35 @@ CVideoRecorder::CVideoRecorder(CVideoRecorder &&) = default;
 
 CVideoRecorder::~CVideoRecorder()
 {
+	spoolCancelEpoch.fetch_add(1, std::memory_order_relaxed);
 	try
 	{
 		if (fps != STOPPED)
 		{
-			// wait to establish character order for wcerr
-			std::unique_lock<decltype(mtx)> lck(mtx);
-			workerEvent.wait(lck, [this] { return taskQueue.empty(); });
-			wcerr << "Destroying video recorder without stopping current record session." << endl;
-			lck.unlock();
+			Log(LogSeverity::Warning) << "Destroying video recorder without stopping current record session.";
 			StopRecord();
 		}
 
+		// idle recorder has no worker to stop
+		if (worker.joinable())
 		{
-			std::unique_lock<decltype(mtx)> lck(mtx);
-			workerEvent.wait(lck, [this] { return taskQueue.empty(); });
+			{
+				std::unique_lock<decltype(mtx)> lck(mtx);
+				workerEvent.wait(lck, [this] { return taskQueue->empty(); });
 
-			finish = true;
-			workerEvent.notify_all();
+				finish = true;
+				workerEvent.notify_all();
+			}
+			worker.join();
 		}
-
-		worker.join();
 	}
 	catch (const std::system_error &error)
 	{
 		Error(error);
 	}
+
+	if (tracing)
+		StopTrace();
 }
 
 // 1 call site
@@ -765,15 +2977,16 @@ inline void CVideoRecorder::AdvanceFrame(clock::time_point now, decltype(CFrame:
 	videoPendingFrames = delta.count();
 }
 
-void CVideoRecorder::SampleFrame(const std::function<std::shared_ptr<CFrame> (CFrame::Opaque)> &RequestFrameCallback)
+// returns true if new frame should be requested
+bool CVideoRecorder::PrepareSample(decltype(CFrame::videoPendingFrames) &videoPendingFrames)
 {
-	decltype(CFrame::videoPendingFrames) videoPendingFrames = 0;
+	videoPendingFrames = 0;
 
-	const auto nextFrameBackup = nextFrame;
-	if (fps != STOPPED)
+	if (fps != STOPPED && !paused)
 	{
-		const auto now = clock::now();
-		if (now >= nextFrame)
+		if (offline)
+			videoPendingFrames = 1;
+		else if (const auto now = clock::now(); now >= nextFrame)
 		{
 			switch (fps)
 			{
@@ -788,68 +3001,152 @@ void CVideoRecorder::SampleFrame(const std::function<std::shared_ptr<CFrame> (CF
 				break;
 			default:
 				assert(false);
-				__assume(false);
+				UNREACHABLE;
 			}
 		}
 	}
 
-	if (videoPendingFrames || !screenshotPaths.empty())
+	if (!videoPendingFrames && screenshotPaths.empty())
+		return false;
+
+	// degrade to repeating frames rather than piling up memory, offline producer is throttled by frames in flight limit below
+	// frame is always taken when none is in flight => budget below session footprint slows recording down to single frame in flight instead of repeating forever
+	if (const size_t budget = memoryBudget.load(std::memory_order_relaxed);
+		budget && !offline && pendingFrameTasks.load(std::memory_order_acquire) && memoryTotal.load(std::memory_order_relaxed) > budget)
+	{
+		AccountLate(videoPendingFrames);
+		RepeatLastFrame(videoPendingFrames, FrameLossReason::MemoryBudget);
+		return false;
+	}
+
+	// only this (producer) thread increments the counter => it can not exceed the limit until EnqueueFrame()
+	if (pendingFrameTasks.load(std::memory_order_acquire) < frameQueueDepth)
+		return true;
+
+	if (offline)
 	{
 		try
 		{
-			auto task = std::make_unique<CFrameTask>(RequestFrameCallback(std::make_tuple(std::ref(*this), std::move(screenshotPaths), std::move(videoPendingFrames))));
-			std::lock_guard<decltype(mtx)> lck(mtx);
-			taskQueue.push_back(std::move(task));
-			workerEvent.notify_all();
+			std::unique_lock<decltype(mtx)> lck(mtx);
+			workerEvent.wait(lck, [this] { return pendingFrameTasks.load(std::memory_order_acquire) < frameQueueDepth; });
 		}
 		catch (const std::system_error &error)
 		{
 			Error(error);
 		}
-		catch (const std::exception &error)
+		return true;
+	}
+
+	// all frame tasks are in flight (encoder falls behind), screenshots remain pending for next sample
+	AccountLate(videoPendingFrames);
+	RepeatLastFrame(videoPendingFrames, FrameLossReason::FramesInFlight);
+	return false;
+}
+
+// video is duplicated for missed slots, accounted once slots are consumed
+void CVideoRecorder::AccountLate(decltype(CFrame::videoPendingFrames) videoPendingFrames)
+{
+	if (videoPendingFrames > 1)
+	{
+		framesLate.fetch_add(videoPendingFrames - 1, std::memory_order_relaxed);
+		RecordFrameEvent(FrameEventType::Late, FrameLossReason::AppLate, videoPendingFrames - 1);
+	}
+}
+
+// duplicate last queued frame instead of sampling new one
+void CVideoRecorder::RepeatLastFrame(decltype(CFrame::videoPendingFrames) videoPendingFrames, FrameLossReason reason)
+{
+	if (!videoPendingFrames)
+		return;
+
+	try
+	{
+		std::unique_lock<decltype(mtx)> lck(mtx);
+		if (!taskQueue->empty())
 		{
-			nextFrame = nextFrameBackup;
-			Error(error, "Fail to sample frame");
-			if (status == Status::OK)
+			if (CFrameTask *const frameTask = std::get_if<CFrameTask>(&taskQueue->back()))
 			{
-				status = Status::RETRY;
-				SampleFrame(RequestFrameCallback);
-				status = Status::OK;
+				frameTask->srcFrame->videoPendingFrames += videoPendingFrames;
+				frameTask->srcFrame->duplicates[(unsigned int)reason] += videoPendingFrames;
+				lck.unlock();
+				RecordFrameEvent(FrameEventType::Duplicated, reason, videoPendingFrames);
+				return;
 			}
 		}
 	}
+	catch (const std::system_error &error)
+	{
+		Error(error);
+	}
+
+	DropFrames(videoPendingFrames, reason);
+	Log(LogSeverity::Warning) << "No queued video frame to repeat (" << frameLossReasonNames[(unsigned int)reason] << "), " << videoPendingFrames << " frame(s) dropped.";
+}
+
+template<class Task>
+void CVideoRecorder::EnqueueTask(Task &&task)
+{
+	if (!worker.joinable())
+		Launch();
+	std::unique_lock<decltype(mtx)> lck(mtx);
+	workerEvent.wait(lck, [this] { return !taskQueue->full(); });
+	taskQueue->push_back(std::move(task));
+	workerEvent.notify_all();
+}
+
+void CVideoRecorder::EnqueueFrame(std::shared_ptr<CFrame> &&frame, decltype(CFrame::videoPendingFrames) videoPendingFrames)
+{
+	if (!frame)
+		return RepeatLastFrame(videoPendingFrames, FrameLossReason::PoolExhausted);
+	if (videoPendingFrames)
+		frame->duplicates[(unsigned int)FrameLossReason::AppLate] = videoPendingFrames - 1;
+	pendingFrameTasks.fetch_add(1, std::memory_order_relaxed);
+	framesSampled.fetch_add(1, std::memory_order_relaxed);
+	const size_t memoryCharge = frameBytesEstimate.load(std::memory_order_relaxed);
+	AccountMemory(MemoryCategory::QueuedFrames, memoryCharge);
+	EnqueueTask(CFrameTask(std::move(frame), memoryCharge));
+}
+
+void CVideoRecorder::EnqueueFrame(CFramePtr<CFrame> &&frame, decltype(CFrame::videoPendingFrames) videoPendingFrames)
+{
+	// null frame means exhausted pool
+	if (!frame)
+		return RepeatLastFrame(videoPendingFrames, FrameLossReason::PoolExhausted);
+	if (videoPendingFrames)
+		frame->duplicates[(unsigned int)FrameLossReason::AppLate] = videoPendingFrames - 1;
+	pendingFrameTasks.fetch_add(1, std::memory_order_relaxed);
+	framesSampled.fetch_add(1, std::memory_order_relaxed);
+	const size_t memoryCharge = frameBytesEstimate.load(std::memory_order_relaxed);
+	AccountMemory(MemoryCategory::QueuedFrames, memoryCharge);
+	EnqueueTask(CFrameTask(std::move(frame), memoryCharge));
+}
+
+void CVideoRecorder::SampleFrame(const std::function<std::shared_ptr<CFrame> (CFrame::Opaque)> &RequestFrameCallback)
+{
+	SampleFrameImpl(RequestFrameCallback);
 }
 
-// CStartVideoRecordRequest steals (moves) filename during construction => can not reuse filename during retry => reuse task instead (if it was created successfully)
-void CVideoRecorder::StartRecordImpl(std::wstring &&filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, EncoderConfig config, std::unique_ptr<CStartVideoRecordRequest> &&task)
+// tasks are constructed inline in the queue => nothing but locks can fail here
+void CVideoRecorder::StartRecordImpl(std::wstring &&filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, EncoderConfig config, bool spool)
 {
 	try
 	{
-		if (!task)
-			task.reset(new CStartVideoRecordRequest(std::move(filename), width, height, format, fps, codec, config, this->fps == STOPPED));
-		std::lock_guard<decltype(mtx)> lck(mtx);
-		taskQueue.push_back(std::move(task));
-		workerEvent.notify_all();
+		// offline sessions are not real-time => nothing to govern
+		EnqueueTask(CStartVideoRecordRequest(std::move(filename), width, height, format, fps, codec, config, spool, this->fps == STOPPED,
+			std::wstring(spillFilename), spillDepth, spillMaxBytes, offline ? GovernorConfig() : governorConfig, sceneCutConfig, encoderFallback));
 		this->fps = fps;
+		paused = false;
 		nextFrame = clock::now();
+		// queued frames are charged before first one is observed by worker, both source formats are 32 bpp
+		frameBytesEstimate.store(size_t(width) * height * sizeof(uint32_t), std::memory_order_relaxed);
 	}
 	catch (const std::system_error &error)
 	{
 		Error(error);
 	}
-	catch (const std::exception &error)
-	{
-		Error(error, "Fail to start video record ", &(task ? task->GetFilename() : filename));
-		if (status == Status::OK)
-		{
-			status = Status::RETRY;
-			StartRecordImpl(std::move(filename), width, height, format, fps, codec, config, std::move(task));
-			status = Status::OK;
-		}
-	}
 }
 
-void CVideoRecorder::StartRecordImplCheckFPS(std::wstring &&filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, EncoderConfig config)
+void CVideoRecorder::StartRecordImplCheckFPS(std::wstring &&filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, EncoderConfig config, bool spool)
 {
 	switch (fps)
 	{
@@ -858,17 +3155,15 @@ void CVideoRecorder::StartRecordImplCheckFPS(std::wstring &&filename, unsigned i
 	case FPS::_60:
 		break;
 	default:
-		// wait to establish character order for wcerr
-		std::unique_lock<decltype(mtx)> lck(mtx);
-		wcerr << "Invalid fps for video \"" << filename << "\"." << endl;
+		Log(LogSeverity::Error) << "Invalid fps for video \"" << filename << "\".";
 		return;
 	}
-	StartRecordImpl(std::move(filename), width, height, format, fps, codec, config);
+	StartRecordImpl(std::move(filename), width, height, format, fps, codec, config, spool);
 }
 
 void CVideoRecorder::StartRecord(std::wstring filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, int64_t crf, Preset preset)
 {
-	StartRecordImplCheckFPS(std::move(filename), width, height, format, fps, codec, { crf, preset });
+	StartRecordImplCheckFPS(std::move(filename), width, height, format, fps, codec, { crf, preset }, false);
 }
 
 void CVideoRecorder::StartRecordNV(std::wstring filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, int64_t cq, PresetNV preset)
@@ -877,40 +3172,278 @@ void CVideoRecorder::StartRecordNV(std::wstring filename, unsigned int width, un
 	config.nvenc.cq = cq;
 	config.nvenc.preset = preset;
 	config.nv = true;
-	StartRecordImplCheckFPS(std::move(filename), width, height, format, fps, codec, config);
+	StartRecordImplCheckFPS(std::move(filename), width, height, format, fps, codec, config, false);
+}
+
+void CVideoRecorder::StartSpool(std::wstring filename, unsigned int width, unsigned int height, Format format, FPS fps)
+{
+	StartRecordImplCheckFPS(std::move(filename), width, height, format, fps, Codec::H264, {}, true);
+}
+
+void CVideoRecorder::EncodeSpoolImpl(std::wstring &&spoolFilename, std::wstring &&filename, Codec codec, EncoderConfig config, int64_t firstPts, int64_t lastPts)
+{
+	if (firstPts < 0 || lastPts < firstPts)
+	{
+		Log(LogSeverity::Error) << "Fail to encode spool \"" << spoolFilename << "\": invalid range [" << firstPts << ", " << lastPts << "].";
+		return;
+	}
+
+	// spool session would be stopped by encoding and frames sampled meanwhile would have nowhere to go
+	if (fps != STOPPED)
+	{
+		Log(LogSeverity::Error) << "Fail to encode spool \"" << spoolFilename << "\": record session is active.";
+		return;
+	}
+
+	try
+	{
+		EnqueueTask(CEncodeSpoolRequest(std::move(spoolFilename), std::move(filename), codec, config, encoderFallback, firstPts, lastPts, spoolCancelEpoch.load(std::memory_order_relaxed)));
+	}
+	catch (const std::system_error &error)
+	{
+		Error(error);
+	}
+}
+
+void CVideoRecorder::EncodeSpool(std::wstring spoolFilename, std::wstring filename, Codec codec, int64_t crf, Preset preset, int64_t firstPts, int64_t lastPts)
+{
+	EncodeSpoolImpl(std::move(spoolFilename), std::move(filename), codec, { crf, preset }, firstPts, lastPts);
+}
+
+void CVideoRecorder::EncodeSpoolNV(std::wstring spoolFilename, std::wstring filename, Codec codec, int64_t cq, PresetNV preset, int64_t firstPts, int64_t lastPts)
+{
+	EncoderConfig config;
+	config.nvenc.cq = cq;
+	config.nvenc.preset = preset;
+	config.nv = true;
+	EncodeSpoolImpl(std::move(spoolFilename), std::move(filename), codec, config, firstPts, lastPts);
 }
 
 void CVideoRecorder::StopRecord()
 {
+	// nothing of producer's own to stop => it is spool encoding to be stopped
+	if (fps == STOPPED)
+		spoolCancelEpoch.fetch_add(1, std::memory_order_relaxed);
+
 	try
 	{
-		auto task = std::make_unique<CStopVideoRecordRequest>(fps != STOPPED);
-		std::lock_guard<decltype(mtx)> lck(mtx);
-		taskQueue.push_back(std::move(task));
-		workerEvent.notify_all();
+		EnqueueTask(CStopVideoRecordRequest(fps != STOPPED));
 		fps = STOPPED;
+		paused = false;
+	}
+	catch (const std::system_error &error)
+	{
+		Error(error);
+	}
+}
+
+void CVideoRecorder::Reconfigure(int64_t crf, int64_t bitrate, int64_t vbvMaxRate, int64_t vbvBufferSize)
+{
+	if (crf != -1 && bitrate != -1)
+	{
+		Log(LogSeverity::Error) << "Fail to reconfigure encoder: crf and bitrate are mutually exclusive.";
+		return;
+	}
+	if (crf < -1 || bitrate < -1 || bitrate == 0 || vbvMaxRate < -1 || vbvBufferSize < -1 || vbvBufferSize > INT_MAX)
+	{
+		Log(LogSeverity::Error) << "Fail to reconfigure encoder: invalid rate control settings.";
+		return;
+	}
+	if (fps == STOPPED)
+	{
+		Log(LogSeverity::Warning) << "Reconfiguring encoder without video record session (ignored).";
+		return;
+	}
+
+	try
+	{
+		EnqueueTask(CReconfigureRequest({ crf, bitrate, vbvMaxRate, vbvBufferSize }));
 	}
 	catch (const std::system_error &error)
 	{
 		Error(error);
 	}
+}
+
+void CVideoRecorder::Pause()
+{
+	if (fps == STOPPED)
+	{
+		Log(LogSeverity::Warning) << "Pausing video record without active session (ignored).";
+		return;
+	}
+	if (!paused)
+	{
+		paused = true;
+		Log(LogSeverity::Info) << "Video record has been paused.";
+	}
+}
+
+void CVideoRecorder::Resume()
+{
+	if (!paused)
+	{
+		Log(LogSeverity::Warning) << "Resuming video record that is not paused (ignored).";
+		return;
+	}
+	// AdvanceFrame() would otherwise fill paused interval with duplicates
+	nextFrame = clock::now();
+	paused = false;
+	Log(LogSeverity::Info) << "Video record has been resumed.";
+}
+
+auto CVideoRecorder::ProbeEncoders(const std::wstring &cacheFilename, bool refresh) -> std::vector<EncoderCaps>
+{
+	try
+	{
+		return CEncoderProbe::Run(cacheFilename, refresh);
+	}
+	catch (const char error[])
+	{
+		Log(LogSeverity::Error) << "Fail to probe encoders: " << error << '.';
+	}
 	catch (const std::exception &error)
 	{
-		Error(error, "Fail to stop video record");
-		if (status == Status::OK)
+		Log(LogSeverity::Error) << "Fail to probe encoders: " << error.what() << '.';
+	}
+	return {};
+}
+
+// producer thread, queued start requests keep chain they were issued with
+void CVideoRecorder::SetEncoderFallback(const std::vector<EncoderFallback> &chain)
+{
+	try
+	{
+		LibrarySIMDLevel();
+		auto validated = std::make_shared<FallbackChain>();
+		validated->reserve(chain.size());
+		for (unsigned int position = 1; position <= chain.size(); position++)
 		{
-			status = Status::CLEAN;
-			StopRecord();
-			status = Status::OK;
+			const auto &entry = chain[position - 1];
+			FallbackEncoder fallback{ entry.codec, {}, position };
+			const char *preset;
+			if (entry.nv)
+			{
+				fallback.config.nvenc.cq = entry.quality;
+				fallback.config.nvenc.preset = PresetNV(entry.preset);
+				preset = EncodePreset_2_Str(fallback.config.nvenc.preset);
+			}
+			else
+			{
+				fallback.config.x264_265.crf = entry.quality;
+				fallback.config.x264_265.preset = Preset(entry.preset);
+				preset = EncodePreset_2_Str(fallback.config.x264_265.preset);
+			}
+			fallback.config.nv = entry.nv;
+			if (CEncoderProbe::Usable(entry.codec, entry.nv, preset))
+				validated->push_back(fallback);
+			else
+				Log(LogSeverity::Warning) << "Fallback encoder #" << position << " is not usable, leaving it out of fallback chain.";
 		}
+		if (validated->empty())
+			encoderFallback.reset();
+		else
+			encoderFallback = std::move(validated);
+	}
+	catch (const char error[])
+	{
+		Log(LogSeverity::Error) << "Fail to set encoder fallback: " << error << '.';
+	}
+	catch (const std::exception &error)
+	{
+		Log(LogSeverity::Error) << "Fail to set encoder fallback: " << error.what() << '.';
+	}
+}
+
+void CVideoRecorder::SetOfflineMode(bool offline)
+{
+	this->offline = offline;
+}
+
+void CVideoRecorder::SetMemoryBudget(size_t bytes)
+{
+	memoryBudget.store(bytes, std::memory_order_relaxed);
+	CheckMemoryBudget();
+}
+
+// memory not freed by throttling producer, known once session is set up
+void CVideoRecorder::CheckMemoryBudget() const
+{
+	const size_t budget = memoryBudget.load(std::memory_order_relaxed);
+	const size_t footprint = memoryTotal.load(std::memory_order_relaxed) - memoryCurrent[(unsigned int)MemoryCategory::QueuedFrames].load(std::memory_order_relaxed);
+	if (budget && budget < footprint)
+		Log(LogSeverity::Warning) << "Memory budget of " << budget << " bytes is below " << footprint << " bytes taken by record session itself, frames will be sampled one at a time.";
+}
+
+void CVideoRecorder::SetSpill(std::wstring scratchFilename, unsigned int depth, size_t maxBytes)
+{
+	// full queue makes producer repeat frames before spill could kick in
+	if (depth >= frameQueueDepth)
+	{
+		Log(LogSeverity::Warning) << "Spill depth " << depth << " exceeds frame queue capacity, clamping to " << frameQueueDepth - 1 << '.';
+		depth = frameQueueDepth - 1;
+	}
+	spillFilename = std::move(scratchFilename);
+	spillDepth = spillFilename.empty() ? 0 : depth;
+	spillMaxBytes = maxBytes;
+}
+
+void CVideoRecorder::SetQualityGovernor(int64_t minCRF, int64_t maxCRF, double margin)
+{
+	if (minCRF != -1 && (minCRF < 0 || maxCRF < minCRF || !(margin > 0 && margin < .5)))
+	{
+		Log(LogSeverity::Error) << "Invalid quality governor settings (crf " << minCRF << ".." << maxCRF << ", margin " << margin << ").";
+		return;
+	}
+	governorConfig = { minCRF, maxCRF, margin };
+}
+
+void CVideoRecorder::SetSceneCutDetection(double threshold, int lookahead)
+{
+	if (!(threshold >= 0 && threshold <= 1) || lookahead < -1)
+	{
+		Log(LogSeverity::Error) << "Invalid scene cut detection settings (threshold " << threshold << ", lookahead " << lookahead << ").";
+		return;
+	}
+	sceneCutConfig = { threshold, lookahead };
+}
+
+#ifdef VIDEO_RECORDER_TEST_HOOKS
+void CVideoRecorder::WaitIdle()
+{
+	try
+	{
+		// worker pops task before executing it => empty queue after no-op task means preceding tasks are done
+		EnqueueTask(std::monostate());
+		std::unique_lock<decltype(mtx)> lck(mtx);
+		workerEvent.wait(lck, [this] { return taskQueue->empty(); });
+	}
+	catch (const std::system_error &error)
+	{
+		Error(error);
 	}
 }
 
+double CVideoRecorder::SceneScore(const void *prevLuma, const void *luma, ptrdiff_t stride, unsigned int width, unsigned int height, bool deep) noexcept
+{
+	CSceneDetector detector(1);
+	AVFrame frame{};
+	frame.linesize[0] = (int)stride;
+	frame.width = width;
+	frame.height = height;
+	frame.format = deep ? AV_PIX_FMT_YUV420P10 : AV_PIX_FMT_YUV420P;
+	frame.data[0] = static_cast<uint8_t *>(const_cast<void *>(prevLuma));
+	detector.Score(frame);
+	frame.data[0] = static_cast<uint8_t *>(const_cast<void *>(luma));
+	return detector.Score(frame);
+}
+#endif
+
 void CVideoRecorder::Screenshot(std::wstring filename)
 {
 	try
 	{
-		screenshotPaths.push(std::move(filename));
+		screenshotPaths.push_back(std::move(filename));
 	}
 	// locks does not happen here => no need to catch 'std::system_error'
 	catch (const std::exception &error)
@@ -923,4 +3456,105 @@ void CVideoRecorder::Screenshot(std::wstring filename)
 			status = Status::OK;
 		}
 	}
+}
+
+auto CVideoRecorder::GetStats() const -> Stats
+{
+	Stats stats;
+	for (unsigned int stage = 0; stage < stageCount; stage++)
+		stats.stages[stage] = latencyHistograms[stage].GetStats();
+	stats.framesSampled = framesSampled.load(std::memory_order_relaxed);
+	stats.framesEncoded = framesEncoded.load(std::memory_order_relaxed);
+	stats.framesLate = framesLate.load(std::memory_order_relaxed);
+	stats.framesDuplicated = stats.framesDropped = 0;
+	for (unsigned int reason = 0; reason < frameLossReasonCount; reason++)
+	{
+		stats.framesDuplicated += stats.framesDuplicatedBy[reason] = framesDuplicatedBy[reason].load(std::memory_order_relaxed);
+		stats.framesDropped += stats.framesDroppedBy[reason] = framesDroppedBy[reason].load(std::memory_order_relaxed);
+	}
+	for (unsigned int category = 0; category < memoryCategoryCount; category++)
+		stats.memory[category] = { memoryCurrent[category].load(std::memory_order_relaxed), memoryPeak[category].load(std::memory_order_relaxed) };
+	stats.memoryTotal = { memoryTotal.load(std::memory_order_relaxed), memoryTotalPeak.load(std::memory_order_relaxed) };
+	stats.memoryBudget = memoryBudget.load(std::memory_order_relaxed);
+	stats.bytesWritten = bytesWritten.load(std::memory_order_relaxed);
+	stats.queueDepth = pendingFrameTasks.load(std::memory_order_relaxed);
+	stats.encoderLag = encoderLag.load(std::memory_order_relaxed);
+	stats.framesSpilled = framesSpilled.load(std::memory_order_relaxed);
+	stats.spillBacklog = spillBacklog.load(std::memory_order_relaxed);
+	stats.crf = governedCRF.load(std::memory_order_relaxed);
+	stats.encoder = activeEncoder.load(std::memory_order_relaxed);
+	stats.encoderFallback = activeFallback.load(std::memory_order_relaxed);
+	stats.sceneScore = sceneScore.load(std::memory_order_relaxed);
+	stats.sceneCuts = sceneCuts.load(std::memory_order_relaxed);
+	stats.simdLevel = simdLevel.load(std::memory_order_relaxed);
+	return stats;
+}
+
+auto CVideoRecorder::TakeFrameEvents() -> std::vector<FrameEvent>
+{
+	try
+	{
+		return frameEventLog->Take();
+	}
+	catch (const std::system_error &error)
+	{
+		Error(error);
+	}
+}
+
+void CVideoRecorder::StartMetricsExport(std::wstring filename, MetricsFormat format, std::chrono::milliseconds period)
+{
+	try
+	{
+		metricsExporter.reset();
+		metricsExporter = std::make_unique<CMetricsExporter>(*this, std::move(filename), format, period);
+	}
+	catch (const std::exception &error)
+	{
+		Log(LogSeverity::Error) << "Fail to start metrics export: " << error.what() << '.';
+	}
+}
+
+void CVideoRecorder::StopMetricsExport()
+{
+	metricsExporter.reset();
+}
+
+void CVideoRecorder::StartTrace(std::wstring filename)
+{
+	try
+	{
+		if (!tracer)
+			tracer = std::make_unique<CTracer>();
+		else if (tracing)
+			StopTrace();
+		tracer->Start(std::move(filename));
+		tracing.store(true, std::memory_order_release);
+	}
+	catch (const std::system_error &error)
+	{
+		Error(error);
+	}
+	catch (const std::exception &error)
+	{
+		Log(LogSeverity::Error) << "Fail to start trace: " << error.what() << '.';
+	}
+}
+
+void CVideoRecorder::StopTrace()
+{
+	if (!tracing.exchange(false, std::memory_order_acq_rel))
+		return;
+	try
+	{
+		tracer->Dump();
+	}
+	catch (const std::system_error &error)
+	{
+		Error(error);
+	}
+	catch (const std::exception &error)
+	{
+		Log(LogSeverity::Error) << "Fail to save trace: " << error.what() << '.';
+	}
 }
\ No newline at end of file
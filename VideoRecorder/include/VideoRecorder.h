@@ -2,8 +2,6 @@
 
 #include <vector>
 #include <string>
-#include <queue>
-#include <deque>
 #include <memory>
 #include <utility>
 #include <tuple>
@@ -14,9 +12,13 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 #include <exception>
 #include <system_error>
+#include <new>
+#include <cstddef>
 #include <cstdint>
+#include <cassert>
 
 class CVideoRecorder
 {
@@ -29,8 +31,13 @@ class CVideoRecorder
 	std::unique_ptr<struct AVCodecContext, ContextDeleter> context;
 
 	std::unique_ptr<struct SwsContext, void (*const)(struct SwsContext *swsContext)> cvtCtx;
+	std::vector<uint8_t> convertBuffer;	// R10G10B10A2 intermediate, reused across frames
 
-	const std::unique_ptr<struct AVPacket> packet;
+	struct PacketDeleter
+	{
+		void operator ()(struct AVPacket *packet) const;
+	};
+	const std::unique_ptr<struct AVPacket, PacketDeleter> packet;	// reused across frames
 
 	struct FrameDeleter
 	{
@@ -38,7 +45,30 @@ class CVideoRecorder
 	};
 	std::unique_ptr<struct AVFrame, FrameDeleter> dstFrame;
 
+#ifdef VIDEO_RECORDER_TEST_HOOKS
+public:
+	// deterministic harness support: manually advanced clock replaces steady_clock for pacing and latency measurements
+	class CTestClock
+	{
+		static inline std::atomic<std::chrono::steady_clock::rep> ticks{};
+
+	public:
+		typedef std::chrono::steady_clock::rep rep;
+		typedef std::chrono::steady_clock::period period;
+		typedef std::chrono::steady_clock::duration duration;
+		typedef std::chrono::steady_clock::time_point time_point;
+		static constexpr bool is_steady = true;
+
+	public:
+		static time_point now() noexcept { return time_point(duration(ticks.load(std::memory_order_acquire))); }
+		static void Advance(duration delta) noexcept { ticks.fetch_add(delta.count(), std::memory_order_acq_rel); }
+	};
+
+private:
+	typedef CTestClock clock;
+#else
 	typedef std::chrono::steady_clock clock;
+#endif
 	template<unsigned int fps>
 	using FrameDuration = std::chrono::duration<clock::rep, std::ratio<1, fps>>;
 	clock::time_point nextFrame;
@@ -48,27 +78,95 @@ class CVideoRecorder
 		inline void operator ()(struct AVFormatContext *output) const;
 	};
 	std::unique_ptr<struct AVFormatContext, OutputContextDeleter> videoFile;
+#ifdef VIDEO_RECORDER_TEST_HOOKS
+	std::vector<uint8_t> testSink;	// in-memory output of last record session, replaces file
+	std::vector<int64_t> testKeyframes;	// pts of frames sent to encoder as forced keyframes in last record session
+	std::vector<std::pair<int64_t, uint8_t>> testFrames;	// pts and first luma byte of frames sent to encoder in last record session
+#endif
+
+	// StartSpool() session stores frames here instead of encoding them, see Spool.h
+	class CSpoolWriter;
+	class CSpoolReader;
+	std::unique_ptr<CSpoolWriter> spool;
+	std::atomic<unsigned int> spoolCancelEpoch{};	// bumped to cancel EncodeSpool() requests queued before
+
+	// frames parked in scratch file while encoder falls behind, drained by worker when idle, see SetSpill()
+	class CSpill;
+	std::unique_ptr<CSpill> spill;
 
 	struct AVStream *videoStream;
 
-	std::queue<std::wstring> screenshotPaths;
+	std::vector<std::wstring> screenshotPaths;
 
-	struct ITask;
 	class CFrameTask;
 	class CStartVideoRecordRequest;
 	class CStopVideoRecordRequest;
-	std::deque<std::unique_ptr<ITask>> taskQueue;
+	class CEncodeSpoolRequest;
+	class CReconfigureRequest;
+	class CEncoderProbe;
+	class CTaskQueue;	// fixed capacity ring of tasks stored inline
+	static constexpr unsigned int frameQueueDepth = 16, taskQueueCapacity = frameQueueDepth + 8;
+	const std::unique_ptr<CTaskQueue> taskQueue;
+	std::atomic<unsigned int> pendingFrameTasks{};	// queued or being executed
+
+	// written by worker thread only, read lock-free by GetStats()
+	class CLatencyHistogram;
+	const std::unique_ptr<CLatencyHistogram []> latencyHistograms;
+	std::atomic<uint_least64_t> framesSampled{}, framesEncoded{}, framesLate{}, bytesWritten{};
+	std::atomic<uint_least64_t> framesSpilled{}, spillBacklog{};
+
+	// adjusts CRF of x264 session to keep real-time margin, see SetQualityGovernor()
+	class CQualityGovernor;
+	std::unique_ptr<CQualityGovernor> governor;
+	std::atomic<int_least64_t> governedCRF{ -1 };
+
+	// forces keyframes at scene cuts found by luma histogram of converted frame, see SetSceneCutDetection()
+	class CSceneDetector;
+	std::unique_ptr<CSceneDetector> sceneDetector;
+	std::atomic<double> sceneScore{};
+	std::atomic<uint_least64_t> sceneCuts{};
+
+	// encoder of current session, see SetEncoderFallback()
+	std::atomic<const char *> activeEncoder{};
+	std::atomic<unsigned int> activeFallback{};
+	std::atomic<unsigned int> encoderLag{};
+
+	class CFrameEventLog;
+	const std::unique_ptr<CFrameEventLog> frameEventLog;
+	bool recordAborted = false;	// worker thread only, frames of failed session are accounted as dropped
+
+	class CMetricsExporter;
+	std::unique_ptr<CMetricsExporter> metricsExporter;
+
+	// created on first StartTrace() and kept till destruction => recording threads never observe dangling tracer
+	class CTracer;
+	std::unique_ptr<CTracer> tracer;
+	std::atomic<bool> tracing{};
+
+	class CTraceScope
+	{
+		CVideoRecorder &recorder;
+		const char *const name;
+		const bool enabled;
+		const clock::time_point start;
+
+	public:
+		CTraceScope(CVideoRecorder &recorder, const char name[]) noexcept :
+			recorder(recorder), name(name), enabled(recorder.tracing.load(std::memory_order_relaxed)), start(enabled ? clock::now() : clock::time_point()) {}
+		CTraceScope(CTraceScope &) = delete;
+		void operator =(CTraceScope &) = delete;
+		~CTraceScope() { if (enabled) recorder.Trace(name, start, clock::now()); }
+	};
 
 	bool finish = false;
 	std::mutex mtx;
 	std::condition_variable workerEvent;
-	std::thread worker;
+	std::thread worker;	// started by Launch() on first task
 
 	enum class Status : uint_least8_t
 	{
 		OK,
 		RETRY,
-		CLEAN,
 	} status = Status::OK;
 
 public:
@@ -77,6 +175,7 @@ public:
 		_8bit,
 		_10bit,
 	};
+	static constexpr unsigned int formatCount = (unsigned int)Format::_10bit + 1;
 	enum struct FPS : signed
 	{
 		_25 = 25,
@@ -131,18 +230,46 @@ public:
 #	endif
 #	undef ENCOE_PRESET_ENUM_ENTRY
 
+	template<class Frame>
+	class CFramePtr;
+
+	template<class Frame, unsigned int capacity>
+	class CFramePool;
+
+	// frames in flight limit, CFramePool with greater capacity never gets exhausted by single recorder
+	static constexpr unsigned int maxFramesInFlight = frameQueueDepth;
+
+	// why video frame was duplicated, dropped or missed
+	enum class FrameLossReason : unsigned int
+	{
+		AppLate,		// SampleFrame() called after frame slot(s) passed, previous frame repeated
+		FramesInFlight,	// frames in flight limit reached (encoder falls behind), sample skipped
+		PoolExhausted,	// callback provided no frame (e.g. exhausted CFramePool)
+		MemoryBudget,	// tracked memory exceeds SetMemoryBudget()
+		Canceled,		// CFrame::Cancel()
+		Error,			// invalid frame data or record session aborted by failure
+	};
+	static constexpr unsigned int frameLossReasonCount = (unsigned int)FrameLossReason::Error + 1;
+
 	class CFrame
 	{
 		friend class CVideoRecorder;
+		template<class Frame>
+		friend class CFramePtr;
+		template<class Frame, unsigned int capacity>
+		friend class CFramePool;
 
 	private:
 		CVideoRecorder &parent;
-		decltype(screenshotPaths) screenshotPaths;
+		std::vector<std::wstring> screenshotPaths;
 		std::conditional<std::is_floating_point<clock::rep>::value, uintmax_t, clock::rep>::type videoPendingFrames;
+		decltype(videoPendingFrames) duplicates[frameLossReasonCount]{};	// repeats of this frame by reason
 		bool ready = false;
+		std::atomic<unsigned int> refCount{};		// used by CFramePtr for pooled frames only
+		std::atomic<bool> *poolSlot = nullptr;
 
 	public:
-		typedef std::tuple<decltype(parent), decltype(screenshotPaths), decltype(videoPendingFrames)> &&Opaque;
+		typedef std::tuple<decltype(parent), decltype(screenshotPaths) &, const decltype(videoPendingFrames) &> &&Opaque;
 
 	protected:
 		CFrame(Opaque opaque);
@@ -150,6 +277,10 @@ public:
 		void operator =(CFrame &) = delete;
 		virtual ~CFrame() = default;
 
+	private:
+		void AddRef() noexcept { refCount.fetch_add(1, std::memory_order_relaxed); }
+		inline void Release() noexcept;
+
 	public:
 		void Ready(), Cancel();
 
@@ -169,6 +300,182 @@ public:
 		virtual FrameData GetFrameData() const = 0;
 	};
 
+	// intrusive smart pointer to frame from CFramePool
+	template<class Frame>
+	class CFramePtr
+	{
+		template<class>
+		friend class CFramePtr;
+
+	private:
+		Frame *frame = nullptr;
+
+	public:
+		CFramePtr() = default;
+		explicit CFramePtr(Frame *frame) noexcept : frame(frame) { if (frame) static_cast<CFrame *>(frame)->AddRef(); }
+		CFramePtr(const CFramePtr &src) noexcept : CFramePtr(src.frame) {}
+		CFramePtr(CFramePtr &&src) noexcept : frame(src.frame) { src.frame = nullptr; }
+		template<class Derived>
+		CFramePtr(CFramePtr<Derived> &&src) noexcept : frame(src.frame) { src.frame = nullptr; }
+		CFramePtr &operator =(CFramePtr src) noexcept { std::swap(frame, src.frame); return *this; }
+		~CFramePtr() { if (frame) static_cast<CFrame *>(frame)->Release(); }
+
+	public:
+		Frame *get() const noexcept { return frame; }
+		Frame *operator ->() const noexcept { return frame; }
+		Frame &operator *() const noexcept { return *frame; }
+		explicit operator bool() const noexcept { return frame; }
+		void reset() noexcept { CFramePtr().swap(*this); }
+		void swap(CFramePtr &other) noexcept { std::swap(frame, other.frame); }
+	};
+
+	/*
+		fixed set of frames reused in place to avoid heap traffic in SampleFrame()
+		Acquire() is intended to be called from SampleFrame() callback, it constructs Frame in free slot or returns null if all the frames are in flight
+		pool must outlive recorder(s) it feeds frames to
+	*/
+	template<class Frame, unsigned int capacity>
+	class CFramePool
+	{
+		static_assert(std::is_base_of<CFrame, Frame>::value, "Frame should be derived from CVideoRecorder::CFrame");
+
+		struct Slot
+		{
+			typename std::aligned_storage<sizeof(Frame), alignof(Frame)>::type storage;
+			std::atomic<bool> busy{};
+		} slots[capacity];
+
+	public:
+		CFramePool() = default;
+		CFramePool(CFramePool &) = delete;
+		void operator =(CFramePool &) = delete;
+		~CFramePool();
+
+	public:
+		template<typename ...Args>
+		CFramePtr<Frame> Acquire(CFrame::Opaque opaque, Args &&...args);
+	};
+
+	enum class Stage : unsigned int
+	{
+		QueueWait,		// from SampleFrame() till worker picks frame up (includes waiting for CFrame::Ready())
+		GetFrameData,
+		Convert,		// R10G10B10A2 unpacking to 8/16 bit intermediate (10 bit source only)
+		Scale,			// sws_scale
+		Encode,			// avcodec_send_frame() + avcodec_receive_packet()
+		Mux,			// av_interleaved_write_frame()
+	};
+	static constexpr unsigned int stageCount = (unsigned int)Stage::Mux + 1;
+
+	enum class MemoryCategory : unsigned int
+	{
+		QueuedFrames,	// application frames in flight, estimated from last frame size
+		Conversion,		// R10G10B10A2 intermediate image
+		VideoFrame,		// frame fed to encoder
+		Encoder,		// frames held by encoder (lookahead/reordering), estimated from encoder lag
+		Muxer,			// output IO buffer
+	};
+	static constexpr unsigned int memoryCategoryCount = (unsigned int)MemoryCategory::Muxer + 1;
+
+	// kernel variant for pixel conversion, resolved once per process from host CPU, VIDEO_RECORDER_SIMD env var (scalar, sse2, avx2, avx512) can force lower one
+	enum class SIMDLevel : uint_least8_t
+	{
+		Scalar,
+		SSE2,
+		AVX2,
+		AVX512,
+	};
+	static constexpr unsigned int simdLevelCount = (unsigned int)SIMDLevel::AVX512 + 1;
+
+	// cheap enough to be polled every frame, latencies are accumulated per record session
+	struct Stats
+	{
+		struct StageStats
+		{
+			std::chrono::nanoseconds p50, p99, max, sum;	// sum of all counted latencies
+			double fps;
+			uint_least64_t count;
+		} stages[stageCount];
+		uint_least64_t framesSampled, framesEncoded, framesDuplicated, framesDropped, bytesWritten;	// since recorder creation
+		uint_least64_t framesLate;	// frame slots missed by SampleFrame()
+		uint_least64_t framesDuplicatedBy[frameLossReasonCount], framesDroppedBy[frameLossReasonCount];
+		struct MemoryStats
+		{
+			size_t current, peak;	// bytes, peak since recorder creation
+		} memory[memoryCategoryCount], memoryTotal;
+		size_t memoryBudget;	// 0 if unlimited
+		unsigned int queueDepth;	// frames queued or being processed
+		unsigned int encoderLag;	// frames sent to encoder without packets written yet
+		uint_least64_t framesSpilled;	// since recorder creation
+		uint_least64_t spillBacklog;	// spilled frames not encoded yet
+		int_least64_t crf;	// current CRF of governed session, -1 otherwise
+		const char *encoder;	// FFmpeg name of encoder of current session, nullptr if none
+		unsigned int encoderFallback;	// 0 if requested encoder is used, n if nth SetEncoderFallback() entry took over
+		double sceneScore;	// scene change score of last converted frame in [0, 1], 0 if detection is off
+		uint_least64_t sceneCuts;	// keyframes forced at detected scene cuts, since recorder creation
+		SIMDLevel simdLevel;
+	};
+
+	enum class FrameEventType : uint_least8_t
+	{
+		Late,
+		Duplicated,
+		Dropped,
+	};
+	struct FrameEvent
+	{
+		FrameEventType type;
+		FrameLossReason reason;
+		unsigned int frames;
+		std::chrono::steady_clock::time_point time;
+	};
+
+	enum class LogSeverity : uint_least8_t
+	{
+		Info,
+		Warning,
+		Error,
+		Fatal,	// followed by abort()
+	};
+	struct LogRecord
+	{
+		LogSeverity severity;
+		std::chrono::steady_clock::time_point time;
+		std::thread::id thread;
+		const wchar_t *message;
+	};
+	typedef std::function<void (const LogRecord &record)> LogSink;
+
+	// ProbeEncoders() result for Codec and backend (x264/x265 or NVENC)
+	struct EncoderCaps
+	{
+		Codec codec;
+		bool nv;
+		std::string encoder;			// FFmpeg encoder name, empty if not available
+		bool formats[formatCount];		// accepted target formats
+		uint_least32_t presets;			// bit (1 << value) per Preset/PresetNV accepted by encoder
+		std::vector<std::string> profiles;	// declared by encoder or codec family
+		double fps;						// throughput score: 1280x720 frames per second with default preset, 0 if encoding fails
+	};
+
+	// SetEncoderFallback() chain entry, settings have the same meaning as in StartRecord()/StartRecordNV()
+	struct EncoderFallback
+	{
+		Codec codec;
+		bool nv;
+		int64_t quality;	// crf or cq
+		int preset;			// Preset or PresetNV value
+
+		EncoderFallback(Codec codec, int64_t crf = INT64_C(-1), Preset preset = Preset::Default) noexcept : codec(codec), nv(false), quality(crf), preset(int(preset)) {}
+		EncoderFallback(Codec codec, int64_t cq, PresetNV preset) noexcept : codec(codec), nv(true), quality(cq), preset(int(preset)) {}
+	};
+
+	enum class MetricsFormat
+	{
+		Prometheus,	// text exposition format
+		JSON,
+	};
+
 private:
 	struct EncoderConfig
 	{
@@ -187,22 +494,77 @@ private:
 		};
 		bool nv;
 	};
+	struct FallbackEncoder
+	{
+		Codec codec;
+		EncoderConfig config;
+		unsigned int position;	// 1-based in SetEncoderFallback() chain
+	};
+	typedef std::vector<FallbackEncoder> FallbackChain;
+	struct RateControl
+	{
+		int64_t crf, bitrate, vbvMaxRate, vbvBufferSize;	// -1 keeps current value
+	};
 	static constexpr FPS STOPPED = FPS(-1);
 	FPS fps = STOPPED;
+	bool offline = false;
+	bool paused = false;
+	std::wstring spillFilename;
+	unsigned int spillDepth = 0;
+	size_t spillMaxBytes = 0;
+	struct GovernorConfig
+	{
+		int64_t minCRF = -1, maxCRF = -1;	// -1 disables
+		double margin = 0;
+	} governorConfig;
+	struct SceneCutConfig
+	{
+		double threshold = 0;	// 0 disables
+		int lookahead = -1;		// -1 keeps encoder default
+	} sceneCutConfig;
+	std::shared_ptr<const FallbackChain> encoderFallback;	// validated entries, shared with queued start requests
+	std::atomic<SIMDLevel> simdLevel{ SIMDLevel::Scalar };	// resolved by constructor, read by GetStats() from any thread
+	std::atomic<uint_least64_t> framesDuplicatedBy[frameLossReasonCount]{}, framesDroppedBy[frameLossReasonCount]{};
+	std::atomic<size_t> memoryCurrent[memoryCategoryCount]{}, memoryPeak[memoryCategoryCount]{}, memoryTotal{}, memoryTotalPeak{}, memoryBudget{};
+	std::atomic<size_t> frameBytesEstimate{};	// last observed application frame size, estimated from resolution at session start
 
 private:
 	static inline const char *EncodePreset_2_Str(Preset preset), *EncodePreset_2_Str(PresetNV preset);
 	inline char *AVErrorString(int error);
 	inline void CheckAVResultImpl(int result, const char error[]), CheckAVResult(int result, const char error[]), CheckAVResult(int result, int expected, const char error[]);
-	bool Encode();
+	bool MakeWritable(struct AVFrame &frame);
+	bool Encode(const struct AVFrame *frame);	// NULL flushes encoder
+	bool Drain(clock::duration &muxTime);
+	int OpenOutput(const char filename[]), CloseOutput();	// videoFile->pb
 	void Cleanup();
 	[[noreturn]]
-	void Error(const std::system_error &error);
+	static void Error(const std::system_error &error);
 	void Error(const std::exception &error, const char errorMsgPrefix[], const std::wstring *filename = nullptr);
+	inline void RecordLatency(Stage stage, clock::time_point start, clock::time_point finish);
+	void Trace(const char name[], clock::time_point start, clock::time_point finish) noexcept;
+	void RecordFrameEvent(FrameEventType type, FrameLossReason reason, decltype(CFrame::videoPendingFrames) frames);
+	void DropFrames(decltype(CFrame::videoPendingFrames) frames, FrameLossReason reason);
+	void AccountMemory(MemoryCategory category, ptrdiff_t delta) noexcept;
+	void SetMemory(MemoryCategory category, size_t bytes) noexcept;
+	void CheckMemoryBudget() const;
 	template<FPS>
 	inline void AdvanceFrame(clock::time_point now, decltype(CFrame::videoPendingFrames) &videoPendingFrames);
-	void StartRecordImpl(std::wstring &&filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, EncoderConfig config, std::unique_ptr<CStartVideoRecordRequest> &&task = nullptr);
-	void StartRecordImplCheckFPS(std::wstring &&filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, EncoderConfig config);
+	bool PrepareSample(decltype(CFrame::videoPendingFrames) &videoPendingFrames);
+	void AccountLate(decltype(CFrame::videoPendingFrames) videoPendingFrames);
+	void RepeatLastFrame(decltype(CFrame::videoPendingFrames) videoPendingFrames, FrameLossReason reason);
+	template<class Task>
+	void EnqueueTask(Task &&task);
+	void EnqueueFrame(std::shared_ptr<CFrame> &&frame, decltype(CFrame::videoPendingFrames) videoPendingFrames);
+	void EnqueueFrame(CFramePtr<CFrame> &&frame, decltype(CFrame::videoPendingFrames) videoPendingFrames);
+	template<class Callback>
+	void SampleFrameImpl(Callback &RequestFrameCallback);
+	void StartRecordImpl(std::wstring &&filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, EncoderConfig config, bool spool);
+	void StartRecordImplCheckFPS(std::wstring &&filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, EncoderConfig config, bool spool);
+	void EncodeSpoolImpl(std::wstring &&spoolFilename, std::wstring &&filename, Codec codec, EncoderConfig config, int64_t firstPts, int64_t lastPts);
+	bool EncodeSpilled(), DrainSpill();	// worker thread, false if session aborted
+	void GovernQuality(clock::time_point start, unsigned int frames);
+	bool DetectSceneCut();	// worker thread, true if converted frame starts new scene
+	void Launch();
 	void Process();
 
 public:
@@ -217,8 +579,182 @@ public:
 
 public:
 	void SampleFrame(const std::function<std::shared_ptr<CFrame> (CFrame::Opaque)> &RequestFrameCallback);
+	// callback may return either std::shared_ptr to frame or CFramePtr from CFramePool, the latter does not touch heap in steady state
+	template<class Callback>
+	void SampleFrame(Callback &&RequestFrameCallback) { SampleFrameImpl(RequestFrameCallback); }
 	void StartRecord(std::wstring filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, int64_t crf = INT64_C(-1), Preset preset = Preset::Default);
 	void StartRecordNV(std::wstring filename, unsigned int width, unsigned int height, Format format, FPS fps, Codec codec, int64_t cq = INT64_C(-1), PresetNV preset = PresetNV::Default);
 	void StopRecord();
+	/*
+		changes rate control of running session without gaps, applied in order with queued frames
+		encoder is reconfigured in place where libavcodec supports it (x264: crf, bitrate and VBV within current rate control mode, NVENC: bitrate and VBV of bitrate driven session),
+		otherwise it is reopened and new settings start at keyframe in the same file (requires container without global headers, e.g. raw .h264/.hevc or .ts)
+		crf (cq for NVENC) switches to constant quality, bitrate (bits/s) to average bitrate, VBV rates are in bits/s and bits, -1 keeps current value
+	*/
+	void Reconfigure(int64_t crf, int64_t bitrate = -1, int64_t vbvMaxRate = -1, int64_t vbvBufferSize = -1);
+	/*
+		Pause() keeps session (file, encoder) open and turns SampleFrame() into no-op (screenshots are still taken)
+		Resume() restarts frame pacing from current time => video continues with next pts, paused interval is cut out rather than filled with duplicates
+	*/
+	void Pause();
+	void Resume();
+	/*
+		"record now, encode later" for machines that can not afford real-time encoding
+		StartSpool() starts session storing frames as raw YUV in memory-mapped spool file (format is described in Spool.h), StopRecord() finishes it
+		EncodeSpool() replays spool through regular encoder at full speed, it runs on worker thread (queued after preceding requests) and is refused during record session
+		StopRecord() without record session and recorder destruction cancel spool encoding: queued one is skipped, running one is finished with frames encoded so far
+		[firstPts, lastPts] selects part of spool timeline (video frames at spool fps from 0), its start is found by binary search over spool index and becomes 0 in output
+	*/
+	void StartSpool(std::wstring filename, unsigned int width, unsigned int height, Format format, FPS fps);
+	void EncodeSpool(std::wstring spoolFilename, std::wstring filename, Codec codec, int64_t crf = INT64_C(-1), Preset preset = Preset::Default, int64_t firstPts = 0, int64_t lastPts = INT64_MAX);
+	void EncodeSpoolNV(std::wstring spoolFilename, std::wstring filename, Codec codec, int64_t cq = INT64_C(-1), PresetNV preset = PresetNV::Default, int64_t firstPts = 0, int64_t lastPts = INT64_MAX);
+	/*
+		offline mode decouples video from wall clock (benchmarks, offline rendering):
+		each SampleFrame() during record session yields exactly one video frame and blocks if encoder falls behind instead of duplicating/dropping frames
+	*/
+	void SetOfflineMode(bool offline);
+	/*
+		opens every encoder StartRecord()/StartRecordNV() may use to find out which formats and presets work and how fast it encodes
+		takes seconds => result is cached in cacheFilename (if not empty) and reused while FFmpeg version and CPU count match, refresh forces new probe
+		cached NVENC availability is confirmed by test open on load (GPU/driver change which keeps NVENC available keeps cached score)
+		does not need recorder instance and does not interfere with running sessions
+	*/
+	static std::vector<EncoderCaps> ProbeEncoders(const std::wstring &cacheFilename = {}, bool refresh = false);
+	/*
+		over budget recorder stops taking new frames (last queued one is repeated instead) until queued ones are processed, 0 disables
+		budget below memory taken by record session itself (encoder, muxer, conversion buffers) is warned about and lets single frame in flight
+	*/
+	void SetMemoryBudget(size_t bytes);
+	/*
+		once more than depth frames are queued, further frames are stored raw in scratch file and encoded in order when encoder catches up
+		=> bursts are absorbed by disk instead of dropping/duplicating frames, memory stays bounded by depth
+		scratch file does not grow beyond maxBytes, once it is full last spilled frame is repeated instead (FrameLossReason::MemoryBudget)
+		takes effect at next StartRecord(), depth is clamped below frame queue capacity, 0 disables
+	*/
+	void SetSpill(std::wstring scratchFilename, unsigned int depth, size_t maxBytes = size_t(1) << 30);
+	/*
+		adaptive quality for x264 sessions: worker load (time spent per frame relative to frame period) and backlog are checked about once per second,
+		CRF is raised within [minCRF, maxCRF] when load exceeds 1 - margin or frames pile up and lowered back when there is headroom
+		CRF is changed mid-stream, preset stays as configured (changing it requires reopening encoder)
+		takes effect at next StartRecord(), inactive in offline mode, minCRF == -1 disables
+	*/
+	void SetQualityGovernor(int64_t minCRF, int64_t maxCRF, double margin = .2);
+	/*
+		scene cuts are detected by recorder instead of encoder lookahead: luma histogram of each frame is taken right after conversion
+		and compared with previous one (per frame cost is reported as "SceneDetect" trace span), score (Stats::sceneScore, 0 - same distribution, 1 - disjoint) reaching threshold forces IDR frame
+		encoder own scene cut detection is turned off and its lookahead is set to lookahead frames (-1 keeps encoder default) => lower latency and CPU cost
+		takes effect at next StartRecord(), threshold 0 disables, .3 - .5 catches hard cuts without reacting to motion
+	*/
+	void SetSceneCutDetection(double threshold, int lookahead = 0);
+	/*
+		encoders tried in order when one requested by StartRecord()/StartRecordNV()/EncodeSpool() is missing or fails to open, e.g. NVENC -> x264 veryfast -> x264 ultrafast
+		entries are validated here (test open, takes a while for hardware encoders) and unusable ones are left out => switch at session start costs only failed open of requested encoder
+		choice is reported by Stats::encoder and Stats::encoderFallback, takes effect at next StartRecord(), empty chain disables
+	*/
+	void SetEncoderFallback(const std::vector<EncoderFallback> &chain);
 	void Screenshot(std::wstring filename);
-};
\ No newline at end of file
+	Stats GetStats() const;
+	// duplicated/dropped/late frame events since previous call, log is bounded => oldest events are discarded if not taken in time
+	std::vector<FrameEvent> TakeFrameEvents();
+	// periodically dumps GetStats() to file (replaced atomically), restarts export if already running
+	void StartMetricsExport(std::wstring filename, MetricsFormat format, std::chrono::milliseconds period = std::chrono::seconds(1));
+	void StopMetricsExport();
+	/*
+		log messages are queued lock-free and passed to sink on background thread, floods are rate limited
+		empty sink restores default one (wclog for info, wcerr for others)
+	*/
+	static void SetLogSink(LogSink sink);
+	static void SetLogLevel(LogSeverity minSeverity);
+	// opt-in timeline of recorder work, StopTrace() dumps it as Chrome trace event JSON (loads in Perfetto and chrome://tracing)
+	void StartTrace(std::wstring filename);
+	void StopTrace();
+
+#ifdef VIDEO_RECORDER_TEST_HOOKS
+public:
+	// returns once all tasks queued so far have been executed by worker
+	void WaitIdle();
+	// valid after WaitIdle()
+	const std::vector<uint8_t> &TestSink() const noexcept { return testSink; }
+	// stub backend for codec/backend pair is reported missing, exercises encoder fallback
+	static void FailEncoder(Codec codec, bool nv, bool fail) noexcept;
+	// stub backend for codec/backend pair is found but fails to open, exercises encoder fallback
+	static void FailEncoderOpen(Codec codec, bool nv, bool fail) noexcept;
+	// valid after WaitIdle(), spilled frames are included once encoded
+	const std::vector<int64_t> &TestKeyframes() const noexcept { return testKeyframes; }
+	// valid after WaitIdle(), identifies frame content by first luma byte
+	const std::vector<std::pair<int64_t, uint8_t>> &TestFrames() const noexcept { return testFrames; }
+	// scene detector score of luma plane following previous one, same sample layout as converted frame (deep - 10 bit in 16 bit samples)
+	static double SceneScore(const void *prevLuma, const void *luma, ptrdiff_t stride, unsigned int width, unsigned int height, bool deep) noexcept;
+#endif
+};
+
+inline void CVideoRecorder::CFrame::Release() noexcept
+{
+	if (refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		const auto slot = poolSlot;
+		assert(slot);
+		this->~CFrame();
+		slot->store(false, std::memory_order_release);
+	}
+}
+
+template<class Frame, unsigned int capacity>
+CVideoRecorder::CFramePool<Frame, capacity>::~CFramePool()
+{
+	for ([[maybe_unused]] const auto &slot : slots)
+		assert(!slot.busy.load(std::memory_order_acquire));
+}
+
+template<class Frame, unsigned int capacity>
+template<typename ...Args>
+auto CVideoRecorder::CFramePool<Frame, capacity>::Acquire(CFrame::Opaque opaque, Args &&...args) -> CFramePtr<Frame>
+{
+	for (auto &slot : slots)
+	{
+		if (!slot.busy.load(std::memory_order_acquire))
+		{
+			Frame *const frame = new(&slot.storage) Frame(std::move(opaque), std::forward<Args>(args)...);
+			slot.busy.store(true, std::memory_order_relaxed);
+			static_cast<CFrame *>(frame)->poolSlot = &slot.busy;
+			return CFramePtr<Frame>(frame);
+		}
+	}
+	return {};
+}
+
+template<class Callback>
+void CVideoRecorder::SampleFrameImpl(Callback &RequestFrameCallback)
+{
+	// paused session has nothing to sample but screenshots
+	if (paused && screenshotPaths.empty())
+		return;
+
+	const CTraceScope traceScope(*this, "SampleFrame");
+	decltype(CFrame::videoPendingFrames) videoPendingFrames;
+	const auto nextFrameBackup = nextFrame;
+	if (PrepareSample(videoPendingFrames))
+	{
+		try
+		{
+			auto frame = RequestFrameCallback(std::forward_as_tuple(*this, screenshotPaths, videoPendingFrames));
+			AccountLate(videoPendingFrames);	// not before callback succeeds as retry recounts slots
+			EnqueueFrame(std::move(frame), videoPendingFrames);
+		}
+		catch (const std::system_error &error)
+		{
+			Error(error);
+		}
+		catch (const std::exception &error)
+		{
+			nextFrame = nextFrameBackup;
+			Error(error, "Fail to sample frame");
+			if (status == Status::OK)
+			{
+				status = Status::RETRY;
+				SampleFrameImpl(RequestFrameCallback);
+				status = Status::OK;
+			}
+		}
+	}
+}
\ No newline at end of file